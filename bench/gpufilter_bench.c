@@ -0,0 +1,533 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Martin Johannesson
+ * 
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Measures upload and readback throughput, filter chain passes per second
+   and end-to-end latency over a sweep of image sizes, color formats and
+   chain lengths, and writes the results as JSON. Runs on a headless
+   context, so a software driver such as Mesa's llvmpipe will do:
+ 
+       make bench
+       LIBGL_ALWAYS_SOFTWARE=1 build/desktop/gpufilter_bench --output results.json
+ 
+   Options:
+       --sizes 256,1024     square image sizes (default 256 to 8192)
+       --formats rgba,rgb   color formats: rgba, bgra, rgb (default all)
+       --chains 1,4         filter chain lengths (default 1, 2, 4, 8)
+       --seconds 0.5        minimum time spent on each case (default 0.25)
+       --output path        where to write the JSON (default stdout)
+ */
+
+// clock_gettime() is POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
+#include "gpufilter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MAX_VALUES 16
+#define BENCH_MIN_ITERATIONS 3
+#define BENCH_MAX_ITERATIONS 10000
+
+#if GPU_OPENGL_ES
+#define BENCH_PRECISION "precision highp float;\n"
+#else
+#define BENCH_PRECISION ""
+#endif
+
+// Alternating directions keep the passes from being fused.
+static const char *horizontalBlurCode = BENCH_PRECISION SHADER_STRING
+(
+ varying vec2 uv;
+ uniform sampler2D texture;
+ 
+ void main() {
+     vec2 d = vec2(0.0005, 0.0);
+     gl_FragColor = (texture2D(texture, uv - 2.0 * d) + texture2D(texture, uv - d) +
+                     texture2D(texture, uv) +
+                     texture2D(texture, uv + d) + texture2D(texture, uv + 2.0 * d)) * 0.2;
+ }
+ );
+
+static const char *verticalBlurCode = BENCH_PRECISION SHADER_STRING
+(
+ varying vec2 uv;
+ uniform sampler2D texture;
+ 
+ void main() {
+     vec2 d = vec2(0.0, 0.0005);
+     gl_FragColor = (texture2D(texture, uv - 2.0 * d) + texture2D(texture, uv - d) +
+                     texture2D(texture, uv) +
+                     texture2D(texture, uv + d) + texture2D(texture, uv + 2.0 * d)) * 0.2;
+ }
+ );
+
+typedef struct BenchOptions {
+    uint32_t sizes[BENCH_MAX_VALUES];
+    uint32_t sizeCount;
+    GPUColorFormat formats[BENCH_MAX_VALUES];
+    uint32_t formatCount;
+    uint32_t chainLengths[BENCH_MAX_VALUES];
+    uint32_t chainLengthCount;
+    double secondsPerCase;
+    const char *outputPath;
+} BenchOptions;
+
+/* Writes the JSON result records, separating them with commas. */
+typedef struct BenchOutput {
+    FILE *file;
+    uint32_t recordCount;
+} BenchOutput;
+
+static double benchGetTime(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+static const char *benchFormatName(GPUColorFormat format)
+{
+    switch (format) {
+        case GPUColorFormatRGB: return "rgb";
+        case GPUColorFormatBGRA: return "bgra";
+        default: return "rgba";
+    }
+}
+
+static uint32_t benchFormatSize(GPUColorFormat format)
+{
+    return format == GPUColorFormatRGB ? 3 : 4;
+}
+
+/* Parses a comma-separated list into values, returning the count or 0 if
+   an entry is invalid. */
+static uint32_t benchParseList(const char *list, uint32_t *values, int isFormat)
+{
+    uint32_t count = 0;
+    const char *start = list;
+    while (*start != '\0' && count < BENCH_MAX_VALUES) {
+        size_t length = strcspn(start, ",");
+        char entry[32];
+        if (length == 0 || length >= sizeof(entry)) {
+            return 0;
+        }
+        memcpy(entry, start, length);
+        entry[length] = '\0';
+        
+        if (isFormat) {
+            if (strcmp(entry, "rgba") == 0) {
+                values[count] = GPUColorFormatRGBA;
+            } else if (strcmp(entry, "bgra") == 0) {
+                values[count] = GPUColorFormatBGRA;
+            } else if (strcmp(entry, "rgb") == 0) {
+                values[count] = GPUColorFormatRGB;
+            } else {
+                return 0;
+            }
+        } else {
+            char *end;
+            long value = strtol(entry, &end, 10);
+            if (*end != '\0' || value <= 0) {
+                return 0;
+            }
+            values[count] = (uint32_t)value;
+        }
+        count++;
+        
+        start += length;
+        if (*start == ',') {
+            start++;
+        }
+    }
+    return count;
+}
+
+static int benchParseOptions(int argc, char **argv, BenchOptions *options)
+{
+    static const uint32_t defaultSizes[] = { 256, 512, 1024, 2048, 4096, 8192 };
+    static const uint32_t defaultChainLengths[] = { 1, 2, 4, 8 };
+    
+    memset(options, 0, sizeof(BenchOptions));
+    options->sizeCount = sizeof(defaultSizes) / sizeof(defaultSizes[0]);
+    memcpy(options->sizes, defaultSizes, sizeof(defaultSizes));
+    options->formats[0] = GPUColorFormatRGBA;
+    options->formats[1] = GPUColorFormatBGRA;
+    options->formats[2] = GPUColorFormatRGB;
+    options->formatCount = 3;
+    options->chainLengthCount = sizeof(defaultChainLengths) / sizeof(defaultChainLengths[0]);
+    memcpy(options->chainLengths, defaultChainLengths, sizeof(defaultChainLengths));
+    options->secondsPerCase = 0.25;
+    
+    for (int i = 1; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+        int valid = value != NULL;
+        if (valid && strcmp(argv[i], "--sizes") == 0) {
+            options->sizeCount = benchParseList(value, options->sizes, 0);
+            valid = options->sizeCount > 0;
+        } else if (valid && strcmp(argv[i], "--formats") == 0) {
+            uint32_t formats[BENCH_MAX_VALUES];
+            options->formatCount = benchParseList(value, formats, 1);
+            for (uint32_t j = 0; j < options->formatCount; j++) {
+                options->formats[j] = (GPUColorFormat)formats[j];
+            }
+            valid = options->formatCount > 0;
+        } else if (valid && strcmp(argv[i], "--chains") == 0) {
+            options->chainLengthCount = benchParseList(value, options->chainLengths, 0);
+            valid = options->chainLengthCount > 0;
+        } else if (valid && strcmp(argv[i], "--seconds") == 0) {
+            options->secondsPerCase = atof(value);
+            valid = options->secondsPerCase >= 0.0;
+        } else if (valid && strcmp(argv[i], "--output") == 0) {
+            options->outputPath = value;
+        } else {
+            valid = 0;
+        }
+        if (!valid) {
+            fprintf(stderr, "usage: %s [--sizes 256,1024] [--formats rgba,bgra,rgb] "
+                    "[--chains 1,4] [--seconds 0.25] [--output path]\n", argv[0]);
+            return 0;
+        }
+        i++;
+    }
+    return 1;
+}
+
+/* Whether a case that has run iterations times for elapsed seconds has
+   enough samples. */
+static int benchCaseDone(uint32_t iterations, double elapsed, double secondsPerCase)
+{
+    return iterations >= BENCH_MAX_ITERATIONS ||
+           (iterations >= BENCH_MIN_ITERATIONS && elapsed >= secondsPerCase);
+}
+
+static int benchCompareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Nearest-rank percentile of sorted values. */
+static double benchPercentile(const double *sorted, uint32_t count, double percentile)
+{
+    uint32_t rank = (uint32_t)(percentile * count + 0.999999);
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void benchBeginRecord(BenchOutput *output, const char *test, uint32_t size)
+{
+    fprintf(output->file, "%s\n    {\"test\": \"%s\", \"width\": %u, \"height\": %u",
+            output->recordCount > 0 ? "," : "", test, size, size);
+    output->recordCount++;
+}
+
+static GPUStatus benchUpload(BenchOutput *output, const BenchOptions *options,
+                             uint32_t size, GPUColorFormat format, uint8_t *pixels)
+{
+    GPUTexture texture;
+    GPUStatus status = gpuCreateTexture(&texture);
+    
+    uint32_t iterations = 0;
+    double start = benchGetTime(), elapsed = 0.0;
+    while (status == GPUStatusOK && !benchCaseDone(iterations, elapsed, options->secondsPerCase)) {
+        status = gpuUploadImageToTexture(size, size, format, pixels, &texture);
+        glFinish();
+        iterations++;
+        elapsed = benchGetTime() - start;
+    }
+    gpuDestroyTexture(&texture);
+    
+    if (status == GPUStatusOK) {
+        double bytes = (double)size * size * benchFormatSize(format) * iterations;
+        benchBeginRecord(output, "upload", size);
+        fprintf(output->file, ", \"format\": \"%s\", \"iterations\": %u, \"seconds\": %.6f, \"mbPerSecond\": %.3f}",
+                benchFormatName(format), iterations, elapsed, bytes / elapsed / 1e6);
+    }
+    return status;
+}
+
+static GPUStatus benchReadback(BenchOutput *output, const BenchOptions *options,
+                               uint32_t size, GPUColorFormat format, GPUTexture *input, uint8_t *pixels)
+{
+    GPUProgram program;
+    GPUFramebuffer framebuffer;
+    GPUStatus status = gpuCompileProgram(kGPUDefaultVertexShaderCode, kGPUDefaultFragmentShaderCode, &program, NULL);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    status = gpuCreateFramebuffer(size, size, &framebuffer);
+    if (status == GPUStatusOK) {
+        status = gpuRenderTextureToFramebufferUsingProgram(input, &framebuffer, &program);
+        glFinish();
+    }
+    
+    uint32_t iterations = 0;
+    double start = benchGetTime(), elapsed = 0.0;
+    while (status == GPUStatusOK && !benchCaseDone(iterations, elapsed, options->secondsPerCase)) {
+        status = gpuGetFramebufferContents(&framebuffer, pixels, format);
+        iterations++;
+        elapsed = benchGetTime() - start;
+    }
+    gpuDestroyFramebuffer(&framebuffer);
+    gpuDestroyProgram(&program);
+    
+    if (status == GPUStatusOK) {
+        double bytes = (double)size * size * benchFormatSize(format) * iterations;
+        benchBeginRecord(output, "readback", size);
+        fprintf(output->file, ", \"format\": \"%s\", \"iterations\": %u, \"seconds\": %.6f, \"mbPerSecond\": %.3f}",
+                benchFormatName(format), iterations, elapsed, bytes / elapsed / 1e6);
+    }
+    return status;
+}
+
+static GPUStatus benchCompileChain(uint32_t length, GPUFilterChain *chain)
+{
+    GPUFilterStage stages[BENCH_MAX_VALUES * 4];
+    if (length > sizeof(stages) / sizeof(stages[0])) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    for (uint32_t i = 0; i < length; i++) {
+        stages[i].fragmentShaderCode = i % 2 == 0 ? horizontalBlurCode : verticalBlurCode;
+        stages[i].pointwise = 0;
+    }
+    return gpuCompileFilterChain(stages, length, chain, NULL);
+}
+
+static GPUStatus benchChain(BenchOutput *output, const BenchOptions *options,
+                            uint32_t size, GPUFilterChain *chain, GPUTexture *input)
+{
+    GPUFramebuffer framebuffer;
+    GPUStatus status = gpuCreateFramebuffer(size, size, &framebuffer);
+    
+    // The first run allocates the chain's intermediate framebuffers.
+    if (status == GPUStatusOK) {
+        status = gpuRunFilterChain(chain, input, &framebuffer);
+        glFinish();
+    }
+    
+    uint32_t iterations = 0;
+    double start = benchGetTime(), elapsed = 0.0;
+    while (status == GPUStatusOK && !benchCaseDone(iterations, elapsed, options->secondsPerCase)) {
+        status = gpuRunFilterChain(chain, input, &framebuffer);
+        glFinish();
+        iterations++;
+        elapsed = benchGetTime() - start;
+    }
+    gpuDestroyFramebuffer(&framebuffer);
+    
+    if (status == GPUStatusOK) {
+        double passes = (double)chain->passCount * iterations;
+        benchBeginRecord(output, "chain", size);
+        fprintf(output->file, ", \"passes\": %u, \"iterations\": %u, \"seconds\": %.6f, "
+                "\"passesPerSecond\": %.3f, \"megapixelsPerSecond\": %.3f}",
+                chain->passCount, iterations, elapsed, passes / elapsed,
+                passes * size * size / elapsed / 1e6);
+    }
+    return status;
+}
+
+/* Upload, chain and readback of one image, timed one by one. */
+static GPUStatus benchLatency(BenchOutput *output, const BenchOptions *options,
+                              uint32_t size, GPUColorFormat format, GPUFilterChain *chain,
+                              uint8_t *pixels, uint8_t *result)
+{
+    double latencies[BENCH_MAX_ITERATIONS];
+    GPUTexture texture;
+    GPUFramebuffer framebuffer;
+    GPUStatus status = gpuCreateTexture(&texture);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    status = gpuCreateFramebuffer(size, size, &framebuffer);
+    
+    uint32_t iterations = 0;
+    double start = benchGetTime(), elapsed = 0.0;
+    while (status == GPUStatusOK && !benchCaseDone(iterations, elapsed, options->secondsPerCase)) {
+        double imageStart = benchGetTime();
+        status = gpuUploadImageToTexture(size, size, format, pixels, &texture);
+        if (status == GPUStatusOK) {
+            status = gpuRunFilterChain(chain, &texture, &framebuffer);
+        }
+        if (status == GPUStatusOK) {
+            status = gpuGetFramebufferContents(&framebuffer, result, format);
+        }
+        double now = benchGetTime();
+        latencies[iterations++] = now - imageStart;
+        elapsed = now - start;
+    }
+    gpuDestroyFramebuffer(&framebuffer);
+    gpuDestroyTexture(&texture);
+    
+    if (status == GPUStatusOK) {
+        double total = 0.0;
+        for (uint32_t i = 0; i < iterations; i++) {
+            total += latencies[i];
+        }
+        qsort(latencies, iterations, sizeof(double), benchCompareDoubles);
+        benchBeginRecord(output, "latency", size);
+        fprintf(output->file, ", \"format\": \"%s\", \"passes\": %u, \"iterations\": %u, "
+                "\"meanMs\": %.3f, \"p50Ms\": %.3f, \"p90Ms\": %.3f, \"p99Ms\": %.3f, \"maxMs\": %.3f}",
+                benchFormatName(format), chain->passCount, iterations, total / iterations * 1e3,
+                benchPercentile(latencies, iterations, 0.5) * 1e3,
+                benchPercentile(latencies, iterations, 0.9) * 1e3,
+                benchPercentile(latencies, iterations, 0.99) * 1e3,
+                latencies[iterations - 1] * 1e3);
+    }
+    return status;
+}
+
+static void benchReportFailure(const char *test, uint32_t size, const char *detail, GPUStatus status)
+{
+    fprintf(stderr, "Skipped %s at %ux%u%s%s: status %d.\n", test, size, size,
+            detail != NULL ? " " : "", detail != NULL ? detail : "", status);
+}
+
+static void benchWriteString(FILE *file, const char *string)
+{
+    fputc('"', file);
+    for (; string != NULL && *string != '\0'; string++) {
+        if (*string == '"' || *string == '\\') {
+            fputc('\\', file);
+        }
+        if ((unsigned char)*string >= 0x20) {
+            fputc(*string, file);
+        }
+    }
+    fputc('"', file);
+}
+
+static void benchRunSize(BenchOutput *output, const BenchOptions *options, uint32_t size)
+{
+    size_t byteCount = (size_t)size * size * 4;
+    uint8_t *pixels = malloc(byteCount);
+    uint8_t *result = malloc(byteCount);
+    if (pixels == NULL || result == NULL) {
+        fprintf(stderr, "Skipped %ux%u: out of memory.\n", size, size);
+        free(pixels);
+        free(result);
+        return;
+    }
+    uint32_t seed = 1;
+    for (size_t i = 0; i < byteCount; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        pixels[i] = (uint8_t)(seed >> 24);
+    }
+    
+    GPUTexture input;
+    GPUStatus status = gpuCreateTextureFromImage(size, size, GPUColorFormatRGBA, pixels, &input);
+    if (status != GPUStatusOK) {
+        benchReportFailure("all tests", size, NULL, status);
+        free(pixels);
+        free(result);
+        return;
+    }
+    
+    for (uint32_t i = 0; i < options->formatCount; i++) {
+        GPUColorFormat format = options->formats[i];
+        fprintf(stderr, "%ux%u %s: upload, readback\n", size, size, benchFormatName(format));
+        if ((status = benchUpload(output, options, size, format, pixels)) != GPUStatusOK) {
+            benchReportFailure("upload", size, benchFormatName(format), status);
+        }
+        if ((status = benchReadback(output, options, size, format, &input, result)) != GPUStatusOK) {
+            benchReportFailure("readback", size, benchFormatName(format), status);
+        }
+    }
+    
+    for (uint32_t i = 0; i < options->chainLengthCount; i++) {
+        GPUFilterChain chain;
+        status = benchCompileChain(options->chainLengths[i], &chain);
+        if (status != GPUStatusOK) {
+            benchReportFailure("chain", size, "compile", status);
+            continue;
+        }
+        fprintf(stderr, "%ux%u %u passes: chain, latency\n", size, size, chain.passCount);
+        if ((status = benchChain(output, options, size, &chain, &input)) != GPUStatusOK) {
+            benchReportFailure("chain", size, NULL, status);
+        }
+        for (uint32_t j = 0; j < options->formatCount; j++) {
+            GPUColorFormat format = options->formats[j];
+            if ((status = benchLatency(output, options, size, format, &chain, pixels, result)) != GPUStatusOK) {
+                benchReportFailure("latency", size, benchFormatName(format), status);
+            }
+        }
+        gpuDestroyFilterChain(&chain);
+    }
+    
+    gpuDestroyTexture(&input);
+    free(pixels);
+    free(result);
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options;
+    if (!benchParseOptions(argc, argv, &options)) {
+        return 2;
+    }
+    
+    GPUHeadlessContext context;
+    if (gpuCreateHeadlessContext(&context) != GPUStatusOK) {
+        return 1;
+    }
+    gpuConfigureRenderingPipeline();
+    
+    BenchOutput output = { stdout, 0 };
+    if (options.outputPath != NULL) {
+        output.file = fopen(options.outputPath, "w");
+        if (output.file == NULL) {
+            fprintf(stderr, "Failed to open %s.\n", options.outputPath);
+            gpuDestroyHeadlessContext(&context);
+            return 1;
+        }
+    }
+    
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    
+    fprintf(output.file, "{\n  \"vendor\": ");
+    benchWriteString(output.file, (const char *)glGetString(GL_VENDOR));
+    fprintf(output.file, ",\n  \"renderer\": ");
+    benchWriteString(output.file, (const char *)glGetString(GL_RENDERER));
+    fprintf(output.file, ",\n  \"version\": ");
+    benchWriteString(output.file, (const char *)glGetString(GL_VERSION));
+    fprintf(output.file, ",\n  \"secondsPerCase\": %.3f,\n  \"results\": [", options.secondsPerCase);
+    
+    for (uint32_t i = 0; i < options.sizeCount; i++) {
+        if (options.sizes[i] > (uint32_t)maxTextureSize) {
+            fprintf(stderr, "Skipped %ux%u: larger than GL_MAX_TEXTURE_SIZE %d.\n",
+                    options.sizes[i], options.sizes[i], maxTextureSize);
+            continue;
+        }
+        benchRunSize(&output, &options, options.sizes[i]);
+    }
+    
+    fprintf(output.file, "\n  ]\n}\n");
+    if (output.file != stdout) {
+        fclose(output.file);
+    }
+    gpuDestroyHeadlessContext(&context);
+    
+    return 0;
+}
@@ -21,23 +21,38 @@
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
 
+// strdup() and clock_gettime() are POSIX, not C99.
+#define _POSIX_C_SOURCE 200809L
+
 #include "gpufilter.h"
 
+#include <ctype.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#if GPU_HAVE_HEADLESS_CONTEXT
+#include <pthread.h>
+#endif
+
+// State that belongs to the current context is kept per thread, since each
+// thread has its own current context.
+#define GPU_THREAD_LOCAL __thread
+
+// A single triangle covering the viewport. The clipped-away corners cost
+// nothing, and there is no diagonal seam shaded twice as with a quad.
 static const GLfloat vertices[] = {
     -1.0f, -1.0f,
-    1.0f, -1.0f,
-    -1.0f,  1.0f,
-    1.0f,  1.0f,
+    3.0f, -1.0f,
+    -1.0f,  3.0f,
 };
 
 static const GLfloat UVs[] = {
     0.0f, 0.0f,
-    1.0f, 0.0f,
-    0.0f, 1.0f,
-    1.0f, 1.0f,
+    2.0f, 0.0f,
+    0.0f, 2.0f,
 };
 
-#if !TARGET_OS_IPHONE
+#if !GPU_OPENGL_ES
 const char *kGPUDefaultVertexShaderCode = SHADER_STRING
 (
  attribute vec4 inputPosition;
@@ -62,7 +77,7 @@ const char *kGPUDefaultFragmentShaderCode = SHADER_STRING
      gl_FragColor = gl_FragColor.rgba;
  }
  );
-#elif TARGET_OS_IPHONE
+#else
 const char *kGPUDefaultVertexShaderCode = SHADER_STRING
 (
  attribute vec4 inputPosition;
@@ -87,220 +102,4628 @@ const char *kGPUDefaultFragmentShaderCode = SHADER_STRING
      gl_FragColor = gl_FragColor.rgba;
  }
  );
+#endif
+
+#if !GPU_OPENGL_ES
+const char *kGPUCoreVertexShaderCode = "#version 330 core\n" SHADER_STRING
+(
+ in vec4 inputPosition;
+ in vec4 inputUV;
+ 
+ out vec2 uv;
+ 
+ void main() {
+     gl_Position = inputPosition;
+     uv = inputUV.xy;
+ }
+ );
+
+const char *kGPUCoreFragmentShaderCode = "#version 330 core\n" SHADER_STRING
+(
+ in vec2 uv;
+ 
+ uniform sampler2D inputTexture;
+ 
+ out vec4 fragColor;
+ 
+ void main() {
+     fragColor = texture(inputTexture, uv);
+ }
+ );
 #else
-#error This file is only meant for OS X or iOS.
+const char *kGPUCoreVertexShaderCode = "#version 300 es\n" SHADER_STRING
+(
+ in vec4 inputPosition;
+ in vec4 inputUV;
+ 
+ out vec2 uv;
+ 
+ void main() {
+     gl_Position = inputPosition;
+     uv = inputUV.xy;
+ }
+ );
+
+const char *kGPUCoreFragmentShaderCode = "#version 300 es\n" SHADER_STRING
+(
+ precision highp float;
+ 
+ in vec2 uv;
+ 
+ uniform sampler2D inputTexture;
+ 
+ out vec4 fragColor;
+ 
+ void main() {
+     fragColor = texture(inputTexture, uv);
+ }
+ );
 #endif
 
 #pragma mark Forward Declarations
 
 static int gpuCompileShader(GLuint *shader, GLenum type, const char *sourceCode, void (*logFunc)(const char *log));
+static int gpuCheckShaderCompiled(GLuint shader, void (*logFunc)(const char *log));
 static int gpuLinkProgram(GLuint program);
+static int gpuCheckProgramLinked(GLuint program);
 static GLenum gpuColorFormatToGLFormat(GPUColorFormat colorFormat);
+static int gpuExtensionListContains(const char *extensions, const char *name);
+static GPUStatus gpuEnsureTextureStorage(uint32_t width, uint32_t height, GLenum internalFormat, GLenum format, GLenum type, GPUTexture *texture);
+static void gpuGetTextureStorageFormat(GPUColorFormat colorFormat, GLenum *internalFormat, GLenum *format);
+static int gpuGetPixelFormatInfo(GPUPixelFormat pixelFormat, GLenum *internalFormat, GLenum *format, GLenum *type);
+static void gpuGetReadbackFormat(GPUFramebuffer *framebuffer, GPUColorFormat colorFormat, GLenum *format, GLenum *type, uint32_t *bytesPerPixel);
+static int gpuNeedsReadbackRepack(GLenum format, GLenum type);
+static GLenum gpuGetRepackReadType(GLenum type);
+static uint32_t gpuGetReadbackPixelSize(GLenum format, GLenum type);
+static void gpuRepackReadback(const uint8_t *source, uint8_t *destination, size_t pixelCount, GLenum format, GLenum type);
+static GPUStatus gpuReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixelData);
+static GPUStatus gpuAllocateFramebuffer(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat, GPUFramebuffer *framebuffer);
+static GPUStatus gpuEnsureFramebuffer(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat,
+                                      GPUTextureFilter filter, GPUFramebuffer *framebuffer);
+static GPUStatus gpuReadFramebufferRegion(GPUFramebuffer *framebuffer,
+                                          uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                          GPUColorFormat colorFormat, uint8_t *outputData,
+                                          size_t outputBytesPerRow, uint8_t **scratch);
+static void gpuBindAdditionalTextures(GPUProgram *program);
 
-#pragma mark - Render Image
+#if (GPU_OPENGL_ES && GPU_HAVE_GL3) || defined(GL_VERSION_4_2)
+#define GPU_HAVE_TEXTURE_STORAGE 1
+#endif
+#if !GPU_OPENGL_ES && defined(GL_VERSION_4_4)
+#define GPU_HAVE_BUFFER_STORAGE 1
+#endif
+#if (GPU_OPENGL_ES && GPU_HAVE_GL3) || defined(GL_VERSION_4_1)
+#define GPU_HAVE_PROGRAM_BINARY 1
+#endif
+#if (!GPU_OPENGL_ES && defined(GL_VERSION_3_3)) || \
+    (GPU_OPENGL_ES && GPU_HAVE_GL3 && GPU_HAVE_HEADLESS_CONTEXT && defined(GL_EXT_disjoint_timer_query))
+#define GPU_HAVE_TIMER_QUERY 1
+#endif
 
-GPUStatus gpuConfigureRenderingPipeline(void)
+/* What the current context supports beyond the compile-time baseline. */
+typedef struct GPUCapabilities {
+    int detected;
+    int majorVersion;
+    int minorVersion;
+    int textureStorage;
+    int bufferStorage;
+    int programBinary;
+    int parallelShaderCompile;
+    int textureArrays;
+    int layeredRendering;
+    int floatLinear;
+    int floatBlend;
+    int timerQuery;
+} GPUCapabilities;
+
+static const GPUCapabilities *gpuGetCapabilities(void);
+static GPUStatus gpuReflectParameters(GPUProgram *program);
+static int32_t gpuFindParameter(GPUProgram *program, const char *name, size_t length);
+static GPUStatus gpuCheckParameterHandle(GPUParameterHandle *handle);
+static uint32_t gpuHashString(const char *string, size_t length);
+static uint64_t gpuHashBytes64(uint64_t hash, const void *data, size_t length);
+static double gpuGetTime(void);
+static void gpuFlushParameters(GPUProgram *program);
+static void gpuAssignSamplerUnits(GPUProgram *program);
+static GPUStatus gpuCompileInternalProgram(const char *fragmentShaderCode, GPUProgram *program);
+static int gpuIsPixelFormatFilterable(GPUPixelFormat pixelFormat);
+static uint64_t gpuNextTextureGeneration(void);
+#if GPU_HAVE_HEADLESS_CONTEXT
+static void gpuStopCompileThreadSharing(EGLContext context);
+#endif
+
+#if GPU_ENABLE_STATS
+typedef enum GPUStatsCategory {
+    GPUStatsCategoryUpload = 0,
+    GPUStatsCategoryReadback = 1,
+    GPUStatsCategoryReadbackWait = 2,
+    GPUStatsCategoryCompile = 3
+} GPUStatsCategory;
+
+static void gpuRecordCPUTiming(GPUStatsCategory category, double start, uint64_t bytes);
+static void gpuBeginDrawTiming(void);
+static void gpuEndDrawTiming(void);
+static void gpuReleaseTimerQueries(void);
+static void gpuReleaseStatsEvents(void);
+static void gpuSetStatsPass(const char *label, uint32_t index);
+
+// Instrumentation hooks, which vanish with their arguments when disabled.
+#define GPU_STATS_START(start) double start = gpuGetTime()
+#define GPU_STATS_RECORD(category, start, bytes) gpuRecordCPUTiming(category, start, bytes)
+#define GPU_STATS_BEGIN_DRAW() gpuBeginDrawTiming()
+#define GPU_STATS_END_DRAW() gpuEndDrawTiming()
+#define GPU_STATS_RELEASE_QUERIES() gpuReleaseTimerQueries()
+#define GPU_STATS_RELEASE_EVENTS() gpuReleaseStatsEvents()
+#define GPU_STATS_SET_PASS(label, index) gpuSetStatsPass(label, index)
+#else
+#define GPU_STATS_START(start)
+#define GPU_STATS_RECORD(category, start, bytes)
+#define GPU_STATS_BEGIN_DRAW()
+#define GPU_STATS_END_DRAW()
+#define GPU_STATS_RELEASE_QUERIES()
+#define GPU_STATS_RELEASE_EVENTS()
+#define GPU_STATS_SET_PASS(label, index)
+#endif
+
+typedef enum GPUValueType {
+    GPUValueTypeFloat = 0,
+    GPUValueTypeInt = 1,
+    GPUValueTypeUnsignedInt = 2,
+    GPUValueTypeBool = 3
+} GPUValueType;
+
+#if GPU_HAVE_HEADLESS_CONTEXT
+#pragma mark - Headless Context
+
+static EGLDisplay gpuGetHeadlessDisplay(void)
 {
-    glDisable(GL_CULL_FACE);
-    glDisable(GL_DEPTH_TEST);
+    const char *clientExtensions = eglQueryString(EGL_NO_DISPLAY, EGL_EXTENSIONS);
+    if (clientExtensions == NULL) {
+        return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
     
-    GLuint positionAttribute = 0;
-    glVertexAttribPointer(positionAttribute, 2, GL_FLOAT, 0, 0, vertices);
-    glEnableVertexAttribArray(positionAttribute);
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay == NULL) {
+        return eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    }
     
-    GLuint uvAttribute = 1;
-	glVertexAttribPointer(uvAttribute, 2, GL_FLOAT, 0, 0, UVs);
-    glEnableVertexAttribArray(uvAttribute);
+    // Prefer a real GPU device, which is the only headless path on drivers
+    // that lack Mesa's surfaceless platform.
+    if (gpuExtensionListContains(clientExtensions, "EGL_EXT_platform_device")) {
+        PFNEGLQUERYDEVICESEXTPROC queryDevices =
+            (PFNEGLQUERYDEVICESEXTPROC)eglGetProcAddress("eglQueryDevicesEXT");
+        EGLDeviceEXT devices[8];
+        EGLint deviceCount = 0;
+        if (queryDevices != NULL && queryDevices(8, devices, &deviceCount) && deviceCount > 0) {
+            EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[0], NULL);
+            if (display != EGL_NO_DISPLAY) {
+                return display;
+            }
+        }
+    }
     
-    return GPUStatusOK;
+    if (gpuExtensionListContains(clientExtensions, "EGL_MESA_platform_surfaceless")) {
+        EGLDisplay display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+        if (display != EGL_NO_DISPLAY) {
+            return display;
+        }
+    }
+    
+    return eglGetDisplay(EGL_DEFAULT_DISPLAY);
 }
 
-GPUStatus gpuRenderTextureToFramebufferUsingProgram(GPUTexture *texture,
-                                                    GPUFramebuffer *framebuffer,
-                                                    GPUProgram *program)
+/* Creates a context on an initialized display, sharing objects with
+   shareContext unless it is EGL_NO_CONTEXT, and makes it current on the
+   calling thread. */
+static GPUStatus gpuCreateEGLContextOnDisplay(EGLDisplay display, EGLContext shareContext,
+                                              EGLContext *context, EGLSurface *surface)
 {
-    if (!texture->valid) {
-        return GPUStatusInvalidTexture;
-    }
-    if (!framebuffer->valid) {
-        return GPUStatusInvalidFramebuffer;
+#if GPU_OPENGL_ES
+    EGLenum api = EGL_OPENGL_ES_API;
+    EGLint renderableType = EGL_OPENGL_ES2_BIT;
+    const EGLint contextAttributes[] = { EGL_CONTEXT_CLIENT_VERSION, 3, EGL_NONE };
+#elif GPU_USE_CORE_PROFILE
+    EGLenum api = EGL_OPENGL_API;
+    EGLint renderableType = EGL_OPENGL_BIT;
+    const EGLint contextAttributes[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 3,
+        EGL_CONTEXT_MINOR_VERSION, 3,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+#else
+    EGLenum api = EGL_OPENGL_API;
+    EGLint renderableType = EGL_OPENGL_BIT;
+    const EGLint contextAttributes[] = { EGL_NONE };
+#endif
+    
+    if (!eglBindAPI(api)) {
+        return GPUStatusFailedToCreateContext;
     }
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    
+    const char *displayExtensions = eglQueryString(display, EGL_EXTENSIONS);
+    int surfaceless = gpuExtensionListContains(displayExtensions, "EGL_KHR_surfaceless_context");
+    int configless = gpuExtensionListContains(displayExtensions, "EGL_KHR_no_config_context");
+    
+    // Rendering only ever targets framebuffer objects, so no config is
+    // needed unless we have to fall back to a dummy pbuffer surface.
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    if (!surfaceless || !configless) {
+        const EGLint configAttributes[] = {
+            EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+            EGL_RENDERABLE_TYPE, renderableType,
+            EGL_RED_SIZE, 8,
+            EGL_GREEN_SIZE, 8,
+            EGL_BLUE_SIZE, 8,
+            EGL_ALPHA_SIZE, 8,
+            EGL_NONE
+        };
+        EGLint configCount = 0;
+        if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0) {
+            return GPUStatusFailedToCreateContext;
+        }
     }
     
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->framebufferId);
-    glViewport(0, 0, framebuffer->texture.width, framebuffer->texture.height);
+    EGLContext eglContext = eglCreateContext(display, config, shareContext, contextAttributes);
+    if (eglContext == EGL_NO_CONTEXT) {
+        return GPUStatusFailedToCreateContext;
+    }
     
-    glUseProgram(program->programId);
-    glUniform1i(program->textureUniformLocation, 0);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture->textureId);
+    EGLSurface eglSurface = EGL_NO_SURFACE;
+    if (!surfaceless) {
+        const EGLint surfaceAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        eglSurface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+        if (eglSurface == EGL_NO_SURFACE) {
+            eglDestroyContext(display, eglContext);
+            return GPUStatusFailedToCreateContext;
+        }
+    }
     
-    for (int i = 0; i < 7; i++) {
-        if (program->additionalTextures[i].textureShouldBeUsed) {
-            glUniform1i(program->additionalTextures[i].uniformLocation, i + 1);
-            glActiveTexture(GL_TEXTURE0 + i + 1);
-            glBindTexture(GL_TEXTURE_2D, program->additionalTextures[i].texture.textureId);
+    if (!eglMakeCurrent(display, eglSurface, eglSurface, eglContext)) {
+        if (eglSurface != EGL_NO_SURFACE) {
+            eglDestroySurface(display, eglSurface);
         }
+        eglDestroyContext(display, eglContext);
+        return GPUStatusFailedToCreateContext;
     }
     
-    glActiveTexture(GL_TEXTURE0);
-    glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-
+    *context = eglContext;
+    *surface = eglSurface;
+    
     return GPUStatusOK;
 }
 
-GPUStatus gpuRenderFramebufferToFramebufferUsingProgram(GPUFramebuffer *source,
-                                                        GPUFramebuffer *target,
-                                                        GPUProgram *program)
+// A platform display is one handle for the whole process, and terminating
+// it ends every context on it, so it is only terminated once the last
+// headless context using it is destroyed.
+static pthread_mutex_t headlessDisplayMutex = PTHREAD_MUTEX_INITIALIZER;
+static EGLDisplay headlessDisplay = EGL_NO_DISPLAY;
+static uint32_t headlessDisplayUsers;
+
+static int gpuRetainHeadlessDisplay(EGLDisplay display)
 {
-    return gpuRenderTextureToFramebufferUsingProgram(&source->texture, target, program);
+    pthread_mutex_lock(&headlessDisplayMutex);
+    int initialized = headlessDisplayUsers > 0 && headlessDisplay == display;
+    if (!initialized) {
+        EGLint major, minor;
+        initialized = eglInitialize(display, &major, &minor);
+        // Another display keeps its own initialization; only ours is counted.
+        if (initialized && headlessDisplayUsers == 0) {
+            headlessDisplay = display;
+        }
+    }
+    if (initialized && headlessDisplay == display) {
+        headlessDisplayUsers++;
+    }
+    pthread_mutex_unlock(&headlessDisplayMutex);
+    
+    return initialized;
 }
 
-#pragma mark - Framebuffer
+static void gpuReleaseHeadlessDisplay(EGLDisplay display)
+{
+    pthread_mutex_lock(&headlessDisplayMutex);
+    if (headlessDisplay == display && headlessDisplayUsers > 0) {
+        if (--headlessDisplayUsers == 0) {
+            eglTerminate(display);
+            headlessDisplay = EGL_NO_DISPLAY;
+        }
+    }
+    pthread_mutex_unlock(&headlessDisplayMutex);
+}
 
-GPUStatus gpuCreateFramebuffer(uint32_t width, uint32_t height, GPUFramebuffer *framebuffer)
+static GPUStatus gpuCreateEGLContext(GPUHeadlessContext *context)
 {
-    memset(framebuffer, 0, sizeof(GPUFramebuffer));
+    EGLDisplay display = gpuGetHeadlessDisplay();
+    if (display == EGL_NO_DISPLAY) {
+        return GPUStatusFailedToCreateContext;
+    }
     
-    framebuffer->texture.width = width;
-    framebuffer->texture.height = height;
+    if (!gpuRetainHeadlessDisplay(display)) {
+        return GPUStatusFailedToCreateContext;
+    }
     
-    glGenFramebuffers(1, &framebuffer->framebufferId);
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->framebufferId);
+    EGLContext eglContext;
+    EGLSurface surface;
+    GPUStatus status = gpuCreateEGLContextOnDisplay(display, EGL_NO_CONTEXT, &eglContext, &surface);
+    if (status != GPUStatusOK) {
+        gpuReleaseHeadlessDisplay(display);
+        return status;
+    }
     
-    glGenTextures(1, &framebuffer->texture.textureId);
-    glBindTexture(GL_TEXTURE_2D, framebuffer->texture.textureId);
+    context->backend = GPUHeadlessBackendEGL;
+    context->display = display;
+    context->context = eglContext;
+    context->surface = surface;
     
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    return GPUStatusOK;
+}
+
+#if GPU_USE_OSMESA && !GPU_OPENGL_ES
+static GPUStatus gpuCreateOSMesaContext(GPUHeadlessContext *context)
+{
+    OSMesaContext osmesaContext = OSMesaCreateContextExt(OSMESA_RGBA, 0, 0, 0, NULL);
+    if (osmesaContext == NULL) {
+        return GPUStatusFailedToCreateContext;
+    }
     
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA,
-                 GL_UNSIGNED_BYTE, NULL);
-    glBindRenderbuffer(GL_RENDERBUFFER, 0);
-    glBindTexture(GL_TEXTURE_2D, 0);
+    // OSMesa insists on a color buffer even though we only render to
+    // framebuffer objects, so give it a single pixel.
+    void *buffer = malloc(4);
+    if (buffer == NULL) {
+        OSMesaDestroyContext(osmesaContext);
+        return GPUStatusOutOfMemory;
+    }
     
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebuffer->texture.textureId, 0);
-    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
-        fprintf(stderr, "Failed to make complete framebuffer object %x\n", glCheckFramebufferStatus(GL_FRAMEBUFFER));
-        return GPUStatusFailedToMakeFramebufferObjectError;
+    if (!OSMesaMakeCurrent(osmesaContext, buffer, GL_UNSIGNED_BYTE, 1, 1)) {
+        free(buffer);
+        OSMesaDestroyContext(osmesaContext);
+        return GPUStatusFailedToCreateContext;
     }
     
-    framebuffer->valid = 1;
-    framebuffer->texture.valid = 1;
+    context->backend = GPUHeadlessBackendOSMesa;
+    context->osmesaContext = osmesaContext;
+    context->osmesaBuffer = buffer;
     
     return GPUStatusOK;
 }
+#endif
 
-void gpuDestroyFramebuffer(GPUFramebuffer *framebuffer)
+GPUStatus gpuCreateHeadlessContext(GPUHeadlessContext *context)
 {
-    if (framebuffer->valid) {
-        framebuffer->valid = 0;
-        framebuffer->texture.valid = 0;
-        glDeleteFramebuffers(1, &framebuffer->framebufferId);
-        glDeleteTextures(1, &framebuffer->texture.textureId);
+    // Timer queries belong to the context that was current so far.
+    GPU_STATS_RELEASE_QUERIES();
+    memset(context, 0, sizeof(GPUHeadlessContext));
+    context->display = EGL_NO_DISPLAY;
+    context->context = EGL_NO_CONTEXT;
+    context->surface = EGL_NO_SURFACE;
+    
+    GPUStatus status = gpuCreateEGLContext(context);
+#if GPU_USE_OSMESA && !GPU_OPENGL_ES
+    if (status != GPUStatusOK) {
+        status = gpuCreateOSMesaContext(context);
+    }
+#endif
+    if (status != GPUStatusOK) {
+        fprintf(stderr, "Failed to create headless GL context.\n");
+        return status;
     }
+    
+    context->valid = 1;
+    gpuInvalidateStateCache();
+    
+    return GPUStatusOK;
 }
 
-uint32_t gpuGetFramebufferSizeInBytes(GPUFramebuffer *framebuffer)
+GPUStatus gpuMakeHeadlessContextCurrent(GPUHeadlessContext *context)
 {
-    return 4 * framebuffer->texture.width * framebuffer->texture.height;
+    if (!context->valid) {
+        return GPUStatusFailedToCreateContext;
+    }
+    GPU_STATS_RELEASE_QUERIES();
+    
+    switch (context->backend) {
+        case GPUHeadlessBackendEGL:
+            if (!eglMakeCurrent(context->display, context->surface, context->surface, context->context)) {
+                return GPUStatusFailedToCreateContext;
+            }
+            gpuInvalidateStateCache();
+            return GPUStatusOK;
+#if GPU_USE_OSMESA && !GPU_OPENGL_ES
+        case GPUHeadlessBackendOSMesa:
+            if (!OSMesaMakeCurrent((OSMesaContext)context->osmesaContext, context->osmesaBuffer, GL_UNSIGNED_BYTE, 1, 1)) {
+                return GPUStatusFailedToCreateContext;
+            }
+            gpuInvalidateStateCache();
+            return GPUStatusOK;
+#endif
+        default:
+            return GPUStatusFailedToCreateContext;
+    }
 }
 
-GPUStatus gpuGetFramebufferContents(GPUFramebuffer *framebuffer,
-                                    uint8_t *rgbaData,
-                                    GPUColorFormat colorFormat)
+void gpuDestroyHeadlessContext(GPUHeadlessContext *context)
 {
-    if (!framebuffer->valid) {
-        return GPUStatusInvalidFramebuffer;
+    if (!context->valid) {
+        return;
     }
+    context->valid = 0;
+    gpuInvalidateStateCache();
+    GPU_STATS_RELEASE_QUERIES();
+    GPU_STATS_RELEASE_EVENTS();
     
-    GLenum pixelFormat = gpuColorFormatToGLFormat(colorFormat);
-    
-    glFlush();
-    glFinish();
-    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer->framebufferId);
-    glReadPixels(0, 0, framebuffer->texture.width, framebuffer->texture.height, pixelFormat, GL_UNSIGNED_BYTE, rgbaData);
-    if (glGetError() != GL_NO_ERROR) {
-        return GPUStatusUnknownError;
+    if (context->backend == GPUHeadlessBackendEGL) {
+        // The compile thread may have been started for this context.
+        gpuStopCompileThreadSharing(context->context);
+        eglMakeCurrent(context->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (context->surface != EGL_NO_SURFACE) {
+            eglDestroySurface(context->display, context->surface);
+        }
+        eglDestroyContext(context->display, context->context);
+        gpuReleaseHeadlessDisplay(context->display);
     }
-    
-    return GPUStatusOK;
+#if GPU_USE_OSMESA && !GPU_OPENGL_ES
+    if (context->backend == GPUHeadlessBackendOSMesa) {
+        OSMesaDestroyContext((OSMesaContext)context->osmesaContext);
+        free(context->osmesaBuffer);
+    }
+#endif
 }
 
-#pragma mark - Texture
+#pragma mark - Executor
 
-GPUStatus gpuCreateTexture(GPUTexture *texture)
+typedef struct GPUExecutorJob {
+    GPUStatus (*run)(void *userData, uint32_t workerIndex);
+    void (*completion)(void *userData, GPUStatus status);
+    void *userData;
+} GPUExecutorJob;
+
+#define GPU_EXECUTOR_PARAMETER_SLOTS 64
+
+typedef struct GPUExecutorWorker {
+    struct GPUExecutorState *state;
+    uint32_t index;
+    int started;
+    pthread_t thread;
+    // Which parameter version of which program this worker's context last
+    // applied, by program serial. A collision only costs a reapply.
+    struct {
+        uint64_t serial;
+        uint64_t version;
+    } appliedParameters[GPU_EXECUTOR_PARAMETER_SLOTS];
+    // gpuGetStats() on the worker after its last job, guarded by the mutex.
+    GPUStats stats;
+    // A ring of queued jobs. The worker takes them from the front, other
+    // workers steal from the back.
+    GPUExecutorJob *jobs;
+    uint32_t jobCapacity;
+    uint32_t jobHead;
+    uint32_t jobCount;
+} GPUExecutorWorker;
+
+// Everything below the mutex is guarded by it.
+typedef struct GPUExecutorState {
+    pthread_mutex_t mutex;
+    pthread_cond_t jobQueued;
+    pthread_cond_t workerChanged;
+    EGLDisplay display;
+    EGLContext shareContext;
+    uint64_t poolBudgetInBytes;
+    uint32_t workerCount;
+    uint32_t startedCount;
+    uint32_t failedCount;
+    uint32_t nextWorker;
+    uint32_t unfinishedJobs;
+    int stopping;
+    GPUExecutorStats stats;
+    GPUExecutorWorker workers[];
+} GPUExecutorState;
+
+static GPU_THREAD_LOCAL GPUExecutorWorker *currentWorker;
+
+static void gpuAddStats(GPUStats *sum, const GPUStats *stats)
 {
-    memset(texture, 0, sizeof(GPUTexture));
-    
-    glActiveTexture(GL_TEXTURE0);
-    glGenTextures(1, &texture->textureId);
-    glBindTexture(GL_TEXTURE_2D, texture->textureId);
-    
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    sum->draws += stats->draws;
+    sum->timedDraws += stats->timedDraws;
+    sum->droppedTimings += stats->droppedTimings;
+    sum->gpuSeconds += stats->gpuSeconds;
+    sum->uploads += stats->uploads;
+    sum->bytesUploaded += stats->bytesUploaded;
+    sum->uploadSeconds += stats->uploadSeconds;
+    sum->readbacks += stats->readbacks;
+    sum->bytesRead += stats->bytesRead;
+    sum->readbackSeconds += stats->readbackSeconds;
+    sum->compiles += stats->compiles;
+    sum->compileSeconds += stats->compileSeconds;
+}
+
+static GPUStatus gpuPushExecutorJob(GPUExecutorWorker *worker, const GPUExecutorJob *job)
+{
+    if (worker->jobCount == worker->jobCapacity) {
+        uint32_t capacity = worker->jobCapacity == 0 ? 16 : worker->jobCapacity * 2;
+        GPUExecutorJob *jobs = malloc(capacity * sizeof(GPUExecutorJob));
+        if (jobs == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        for (uint32_t i = 0; i < worker->jobCount; i++) {
+            jobs[i] = worker->jobs[(worker->jobHead + i) % worker->jobCapacity];
+        }
+        free(worker->jobs);
+        worker->jobs = jobs;
+        worker->jobCapacity = capacity;
+        worker->jobHead = 0;
+    }
     
-    texture->valid = 1;
-    texture->width = 0;
-    texture->height = 0;
+    worker->jobs[(worker->jobHead + worker->jobCount) % worker->jobCapacity] = *job;
+    worker->jobCount++;
     
     return GPUStatusOK;
 }
 
-void gpuDestroyTexture(GPUTexture *texture)
+/* Takes the worker's next job, or steals the last queued job of the worker
+   with the most. Returns 0 if no jobs are queued. */
+static int gpuTakeExecutorJob(GPUExecutorState *state, GPUExecutorWorker *worker, GPUExecutorJob *job)
 {
-    if (texture->valid) {
-        texture->valid = 0;
-        glDeleteTextures(1, &texture->textureId);
+    if (worker->jobCount > 0) {
+        *job = worker->jobs[worker->jobHead];
+        worker->jobHead = (worker->jobHead + 1) % worker->jobCapacity;
+        worker->jobCount--;
+        return 1;
+    }
+    
+    GPUExecutorWorker *victim = NULL;
+    for (uint32_t i = 0; i < state->workerCount; i++) {
+        if (state->workers[i].jobCount > 0 && (victim == NULL || state->workers[i].jobCount > victim->jobCount)) {
+            victim = &state->workers[i];
+        }
     }
+    if (victim == NULL) {
+        return 0;
+    }
+    victim->jobCount--;
+    *job = victim->jobs[(victim->jobHead + victim->jobCount) % victim->jobCapacity];
+    state->stats.jobsStolen++;
+    
+    return 1;
 }
 
+static void *gpuExecutorWorkerMain(void *argument)
+{
+    GPUExecutorWorker *worker = argument;
+    GPUExecutorState *state = worker->state;
+    
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+    GPUResourcePool pool;
+    GPUStatus status = gpuCreateEGLContextOnDisplay(state->display, state->shareContext, &context, &surface);
+    if (status == GPUStatusOK) {
+        gpuInvalidateStateCache();
+        gpuConfigureRenderingPipeline();
+        gpuCreateResourcePool(state->poolBudgetInBytes, &pool);
+        gpuSetCurrentResourcePool(&pool);
+        currentWorker = worker;
+    }
+    
+    pthread_mutex_lock(&state->mutex);
+    if (status == GPUStatusOK) {
+        state->startedCount++;
+    } else {
+        state->failedCount++;
+    }
+    pthread_cond_broadcast(&state->workerChanged);
+    
+    while (status == GPUStatusOK) {
+        GPUExecutorJob job;
+        int found;
+        while (!(found = gpuTakeExecutorJob(state, worker, &job)) && !state->stopping) {
+            pthread_cond_wait(&state->jobQueued, &state->mutex);
+        }
+        if (!found) {
+            break;
+        }
+        pthread_mutex_unlock(&state->mutex);
+        
+        GPUStatus jobStatus = job.run(job.userData, worker->index);
+        // What the job rendered must be complete before another context
+        // uses it.
+        glFinish();
+        if (job.completion != NULL) {
+            job.completion(job.userData, jobStatus);
+        }
+        GPUStats stats;
+        gpuGetStats(&stats);
+        
+        pthread_mutex_lock(&state->mutex);
+        worker->stats = stats;
+        state->unfinishedJobs--;
+        state->stats.jobsRun++;
+        pthread_cond_broadcast(&state->workerChanged);
+    }
+    pthread_mutex_unlock(&state->mutex);
+    
+    if (status == GPUStatusOK) {
+        currentWorker = NULL;
+        gpuSetCurrentResourcePool(NULL);
+        gpuDestroyResourcePool(&pool);
+        GPU_STATS_RELEASE_QUERIES();
+        GPU_STATS_RELEASE_EVENTS();
+        
+        // Buffers outlive the context in the share group, unlike the
+        // vertex array gpuConfigureRenderingPipeline() made.
+        GLint vertexBuffer = 0;
+        glGetVertexAttribiv(0, GL_VERTEX_ATTRIB_ARRAY_BUFFER_BINDING, &vertexBuffer);
+        if (vertexBuffer != 0) {
+            GLuint buffer = (GLuint)vertexBuffer;
+            glDeleteBuffers(1, &buffer);
+        }
+        
+        eglMakeCurrent(state->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (surface != EGL_NO_SURFACE) {
+            eglDestroySurface(state->display, surface);
+        }
+        eglDestroyContext(state->display, context);
+    }
+    eglReleaseThread();
+    
+    return NULL;
+}
 
-GPUStatus gpuUploadImageToTexture(uint32_t width, uint32_t height, GPUColorFormat colorFormat, uint8_t *pixelData, GPUTexture *texture)
+GPUStatus gpuCreateExecutor(uint32_t workerCount, uint64_t poolBudgetInBytes, GPUExecutor *executor)
 {
-    if (!texture->valid) {
-        return GPUStatusInvalidTexture;
+    memset(executor, 0, sizeof(GPUExecutor));
+    
+    if (eglGetCurrentContext() == EGL_NO_CONTEXT) {
+        fprintf(stderr, "An executor needs a current EGL context to share objects with.\n");
+        return GPUStatusFailedToCreateContext;
+    }
+    if (workerCount == 0) {
+        long coreCount = sysconf(_SC_NPROCESSORS_ONLN);
+        workerCount = coreCount > 0 ? (uint32_t)coreCount : 1;
     }
     
-    texture->width = width;
-    texture->height = height;
+    GPUExecutorState *state = calloc(1, sizeof(GPUExecutorState) + workerCount * sizeof(GPUExecutorWorker));
+    if (state == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    pthread_mutex_init(&state->mutex, NULL);
+    pthread_cond_init(&state->jobQueued, NULL);
+    pthread_cond_init(&state->workerChanged, NULL);
+    state->display = eglGetCurrentDisplay();
+    state->shareContext = eglGetCurrentContext();
+    state->poolBudgetInBytes = poolBudgetInBytes;
+    state->workerCount = workerCount;
     
-    GLenum pixelFormat = gpuColorFormatToGLFormat(colorFormat);
+    executor->state = state;
+    executor->workerCount = workerCount;
+    executor->valid = 1;
     
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, texture->textureId);
-    glTexImage2D(GL_TEXTURE_2D, 0, pixelFormat, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, pixelData);
-    if (glGetError() != GL_NO_ERROR) {
-        return GPUStatusUnknownError;
+    // Objects made so far must be complete before the workers use them.
+    glFinish();
+    
+    uint32_t startedCount = 0;
+    for (uint32_t i = 0; i < workerCount; i++) {
+        GPUExecutorWorker *worker = &state->workers[i];
+        worker->state = state;
+        worker->index = i;
+        worker->started = pthread_create(&worker->thread, NULL, gpuExecutorWorkerMain, worker) == 0;
+        startedCount += worker->started;
+    }
+    
+    pthread_mutex_lock(&state->mutex);
+    while (state->startedCount + state->failedCount < startedCount) {
+        pthread_cond_wait(&state->workerChanged, &state->mutex);
+    }
+    int failed = state->failedCount > 0 || startedCount < workerCount;
+    pthread_mutex_unlock(&state->mutex);
+    
+    if (failed) {
+        fprintf(stderr, "Failed to start executor workers.\n");
+        gpuDestroyExecutor(executor);
+        return GPUStatusFailedToCreateContext;
     }
     
     return GPUStatusOK;
 }
 
-GPUStatus gpuCreateTextureFromImage(uint32_t width, uint32_t height, GPUColorFormat colorFormat, uint8_t *pixelData, GPUTexture *texture)
+void gpuDestroyExecutor(GPUExecutor *executor)
 {
-    GPUStatus status = GPUStatusOK;
+    if (!executor->valid) {
+        return;
+    }
+    executor->valid = 0;
     
-    status = gpuCreateTexture(texture);
+    GPUExecutorState *state = executor->state;
+    pthread_mutex_lock(&state->mutex);
+    state->stopping = 1;
+    pthread_cond_broadcast(&state->jobQueued);
+    pthread_mutex_unlock(&state->mutex);
     
-    if (status == GPUStatusOK) {
-        status = gpuUploadImageToTexture(width, height, colorFormat, pixelData, texture);
+    // Queued jobs are finished before the workers exit.
+    for (uint32_t i = 0; i < state->workerCount; i++) {
+        if (state->workers[i].started) {
+            pthread_join(state->workers[i].thread, NULL);
+        }
+        free(state->workers[i].jobs);
     }
     
-    return status;
+    pthread_cond_destroy(&state->workerChanged);
+    pthread_cond_destroy(&state->jobQueued);
+    pthread_mutex_destroy(&state->mutex);
+    free(state);
+    executor->state = NULL;
 }
 
-GPUStatus gpuCreateBlankTexture(uint32_t width, uint32_t height, GPUTexture *texture)
+GPUStatus gpuSubmitExecutorJob(GPUExecutor *executor,
+                               GPUStatus (*run)(void *userData, uint32_t workerIndex),
+                               void (*completion)(void *userData, GPUStatus status),
+                               void *userData)
 {
-    uint8_t *dummyBuffer = malloc(width * height * 4);
-    if (dummyBuffer == NULL) {
-        return GPUStatusOutOfMemory;
+    if (!executor->valid || run == NULL) {
+        return GPUStatusInvalidExecutor;
+    }
+    
+    GPUExecutorState *state = executor->state;
+    GPUExecutorJob job = { run, completion, userData };
+    
+    pthread_mutex_lock(&state->mutex);
+    GPUExecutorWorker *worker = currentWorker;
+    if (worker == NULL || worker->state != state) {
+        worker = &state->workers[state->nextWorker];
+        state->nextWorker = (state->nextWorker + 1) % state->workerCount;
+    }
+    GPUStatus status = gpuPushExecutorJob(worker, &job);
+    if (status == GPUStatusOK) {
+        state->unfinishedJobs++;
+        // Any idle worker may take it.
+        pthread_cond_broadcast(&state->jobQueued);
+    }
+    pthread_mutex_unlock(&state->mutex);
+    
+    return status;
+}
+
+GPUStatus gpuWaitForExecutor(GPUExecutor *executor)
+{
+    if (!executor->valid) {
+        return GPUStatusInvalidExecutor;
+    }
+    
+    GPUExecutorState *state = executor->state;
+    if (currentWorker != NULL && currentWorker->state == state) {
+        return GPUStatusInvalidExecutor;
+    }
+    
+    pthread_mutex_lock(&state->mutex);
+    while (state->unfinishedJobs > 0) {
+        pthread_cond_wait(&state->workerChanged, &state->mutex);
+    }
+    pthread_mutex_unlock(&state->mutex);
+    
+    return GPUStatusOK;
+}
+
+void gpuGetExecutorStats(GPUExecutor *executor, GPUExecutorStats *stats)
+{
+    memset(stats, 0, sizeof(GPUExecutorStats));
+    if (!executor->valid) {
+        return;
+    }
+    
+    GPUExecutorState *state = executor->state;
+    pthread_mutex_lock(&state->mutex);
+    *stats = state->stats;
+    for (uint32_t i = 0; i < state->workerCount; i++) {
+        gpuAddStats(&stats->workerStats, &state->workers[i].stats);
+    }
+    pthread_mutex_unlock(&state->mutex);
+}
+#endif
+
+#pragma mark - State Cache
+
+#define GPU_STATE_CACHE_UNITS 8
+#define GPU_STATE_UNKNOWN 0xFFFFFFFFu
+
+/* The bindings the render path last made on the current context. Any of
+   them may be GPU_STATE_UNKNOWN, which never matches. */
+typedef struct GPUStateCache {
+    int valid;
+    GLuint framebuffer;
+    GLuint program;
+    GLuint viewportWidth;
+    GLuint viewportHeight;
+    GLuint activeUnit;
+    GLuint textures[GPU_STATE_CACHE_UNITS];
+    GLuint textureArrays[GPU_STATE_CACHE_UNITS];
+} GPUStateCache;
+
+static GPU_THREAD_LOCAL GPUStateCache stateCache;
+static GPU_THREAD_LOCAL GPUStateCacheStats stateCacheStats;
+
+void gpuInvalidateStateCache(void)
+{
+    memset(&stateCache, 0xFF, sizeof(GPUStateCache));
+    stateCache.valid = 1;
+}
+
+void gpuGetStateCacheStats(GPUStateCacheStats *stats)
+{
+    *stats = stateCacheStats;
+}
+
+/* Returns 1 if the cached value differs and has been updated, in which
+   case the caller issues the GL call. */
+static int gpuUpdateCachedState(GLuint *cached, GLuint value)
+{
+    if (!stateCache.valid) {
+        gpuInvalidateStateCache();
+    }
+    if (*cached == value) {
+        stateCacheStats.elided++;
+        return 0;
+    }
+    *cached = value;
+    stateCacheStats.issued++;
+    return 1;
+}
+
+static void gpuBindFramebuffer(GLuint framebufferId)
+{
+    if (gpuUpdateCachedState(&stateCache.framebuffer, framebufferId)) {
+        glBindFramebuffer(GL_FRAMEBUFFER, framebufferId);
+    }
+}
+
+static void gpuUseProgram(GLuint programId)
+{
+    if (gpuUpdateCachedState(&stateCache.program, programId)) {
+        glUseProgram(programId);
+    }
+}
+
+/* Always covers the whole framebuffer, so only the size is tracked. */
+static void gpuSetViewport(uint32_t width, uint32_t height)
+{
+    if (!stateCache.valid) {
+        gpuInvalidateStateCache();
+    }
+    if (stateCache.viewportWidth == width && stateCache.viewportHeight == height) {
+        stateCacheStats.elided++;
+        return;
+    }
+    stateCache.viewportWidth = width;
+    stateCache.viewportHeight = height;
+    stateCacheStats.issued++;
+    glViewport(0, 0, width, height);
+}
+
+static void gpuActiveTexture(uint32_t unit)
+{
+    if (gpuUpdateCachedState(&stateCache.activeUnit, unit)) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+    }
+}
+
+/* Binds the texture to the unit, which is only made active if the binding
+   changes. target is GL_TEXTURE_2D or GL_TEXTURE_2D_ARRAY. */
+static void gpuBindTexture(uint32_t unit, GLenum target, GLuint textureId)
+{
+    if (!stateCache.valid) {
+        gpuInvalidateStateCache();
+    }
+    GLuint *cached = target == GL_TEXTURE_2D ? &stateCache.textures[unit] : &stateCache.textureArrays[unit];
+    if (gpuUpdateCachedState(cached, textureId)) {
+        gpuActiveTexture(unit);
+        glBindTexture(target, textureId);
+    }
+}
+
+/* Binds the texture to unit 0 and makes that unit active, for calls that
+   operate on the bound texture. */
+static void gpuSelectTexture(GLenum target, GLuint textureId)
+{
+    gpuBindTexture(0, target, textureId);
+    gpuActiveTexture(0);
+}
+
+/* Deleting a bound object unbinds it, and its name may be reused. */
+static void gpuDeleteTexture(GLuint textureId)
+{
+    if (stateCache.valid) {
+        for (uint32_t unit = 0; unit < GPU_STATE_CACHE_UNITS; unit++) {
+            if (stateCache.textures[unit] == textureId) {
+                stateCache.textures[unit] = 0;
+            }
+            if (stateCache.textureArrays[unit] == textureId) {
+                stateCache.textureArrays[unit] = 0;
+            }
+        }
+    }
+    glDeleteTextures(1, &textureId);
+}
+
+static void gpuDeleteFramebuffer(GLuint framebufferId)
+{
+    if (stateCache.valid && stateCache.framebuffer == framebufferId) {
+        stateCache.framebuffer = 0;
+    }
+    glDeleteFramebuffers(1, &framebufferId);
+}
+
+static void gpuDeleteProgram(GLuint programId)
+{
+    // A current program stays in use until another one replaces it.
+    if (stateCache.valid && stateCache.program == programId) {
+        stateCache.program = GPU_STATE_UNKNOWN;
+    }
+    glDeleteProgram(programId);
+}
+
+#pragma mark - Render Image
+
+GPUStatus gpuConfigureRenderingPipeline(void)
+{
+    glDisable(GL_CULL_FACE);
+    glDisable(GL_DEPTH_TEST);
+    
+    // Core profiles need a vertex array object and buffer-backed
+    // attributes, and a buffer saves copying the vertices on every draw.
+#if GPU_HAVE_GL3
+    GLuint vertexArray;
+    glGenVertexArrays(1, &vertexArray);
+    glBindVertexArray(vertexArray);
+#endif
+    GLuint vertexBuffer;
+    glGenBuffers(1, &vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(vertices) + sizeof(UVs), NULL, GL_STATIC_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(vertices), sizeof(UVs), UVs);
+    
+    GLuint positionAttribute = 0;
+    glVertexAttribPointer(positionAttribute, 2, GL_FLOAT, 0, 0, (const void *)0);
+    glEnableVertexAttribArray(positionAttribute);
+    
+    GLuint uvAttribute = 1;
+    glVertexAttribPointer(uvAttribute, 2, GL_FLOAT, 0, 0, (const void *)sizeof(vertices));
+    glEnableVertexAttribArray(uvAttribute);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuRenderTextureToFramebufferUsingProgram(GPUTexture *texture,
+                                                    GPUFramebuffer *framebuffer,
+                                                    GPUProgram *program)
+{
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (!program->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    gpuSetViewport(framebuffer->texture.width, framebuffer->texture.height);
+    
+    gpuUseProgram(program->programId);
+    gpuFlushParameters(program);
+    gpuBindTexture(0, GL_TEXTURE_2D, texture->textureId);
+    
+    gpuBindAdditionalTextures(program);
+    GPU_STATS_BEGIN_DRAW();
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    GPU_STATS_END_DRAW();
+    framebuffer->texture.generation = gpuNextTextureGeneration();
+
+    return GPUStatusOK;
+}
+
+/* Binds the program's second to eighth texture. Their sampler units were
+   assigned when the program was linked. */
+static void gpuBindAdditionalTextures(GPUProgram *program)
+{
+    for (int i = 0; i < 7; i++) {
+        if (program->additionalTextures[i].textureShouldBeUsed) {
+            gpuBindTexture(i + 1, GL_TEXTURE_2D, program->additionalTextures[i].texture.textureId);
+        }
+    }
+}
+
+GPUStatus gpuRenderTextureToFramebufferRegionUsingProgram(GPUTexture *texture,
+                                                          GPUFramebuffer *framebuffer,
+                                                          GPUProgram *program,
+                                                          const GPURect *region)
+{
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (!program->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    uint32_t width = framebuffer->texture.width;
+    uint32_t height = framebuffer->texture.height;
+    if (region->x >= width || region->y >= height || region->width == 0 || region->height == 0) {
+        return GPUStatusOK;
+    }
+    uint32_t regionWidth = width - region->x < region->width ? width - region->x : region->width;
+    uint32_t regionHeight = height - region->y < region->height ? height - region->y : region->height;
+    
+    // The fullscreen triangle is clipped to the scissor box before any
+    // fragments are shaded, so only the region costs anything.
+    glEnable(GL_SCISSOR_TEST);
+    glScissor((GLint)region->x, (GLint)region->y, (GLsizei)regionWidth, (GLsizei)regionHeight);
+    GPUStatus status = gpuRenderTextureToFramebufferUsingProgram(texture, framebuffer, program);
+    glDisable(GL_SCISSOR_TEST);
+    
+    return status;
+}
+
+GPUStatus gpuRenderFramebufferToFramebufferUsingProgram(GPUFramebuffer *source,
+                                                        GPUFramebuffer *target,
+                                                        GPUProgram *program)
+{
+    return gpuRenderTextureToFramebufferUsingProgram(&source->texture, target, program);
+}
+
+#pragma mark - Framebuffer
+
+static GPU_THREAD_LOCAL GPUResourcePool *currentResourcePool;
+
+GPUStatus gpuCreateFramebuffer(uint32_t width, uint32_t height, GPUFramebuffer *framebuffer)
+{
+    return gpuCreateFramebufferWithFormat(width, height, GPUPixelFormatRGBA8, framebuffer);
+}
+
+GPUStatus gpuCreateFramebufferWithFormat(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat, GPUFramebuffer *framebuffer)
+{
+    if (currentResourcePool != NULL) {
+        return gpuAcquirePooledFramebufferWithFormat(currentResourcePool, width, height, pixelFormat, framebuffer);
+    }
+    return gpuAllocateFramebuffer(width, height, pixelFormat, framebuffer);
+}
+
+static GPUStatus gpuAllocateFramebuffer(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat, GPUFramebuffer *framebuffer)
+{
+    memset(framebuffer, 0, sizeof(GPUFramebuffer));
+    
+    GLenum internalFormat, format, type;
+    if (!gpuGetPixelFormatInfo(pixelFormat, &internalFormat, &format, &type)) {
+        return GPUStatusUnsupportedFormat;
+    }
+    
+    framebuffer->texture.width = width;
+    framebuffer->texture.height = height;
+    framebuffer->texture.pixelFormat = pixelFormat;
+    
+    glGenFramebuffers(1, &framebuffer->framebufferId);
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    
+    glGenTextures(1, &framebuffer->texture.textureId);
+    gpuSelectTexture(GL_TEXTURE_2D, framebuffer->texture.textureId);
+    
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+    glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format,
+                 type, NULL);
+    framebuffer->texture.storageFormat = internalFormat;
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, framebuffer->texture.textureId, 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Failed to make complete framebuffer object %x\n", glCheckFramebufferStatus(GL_FRAMEBUFFER));
+        gpuDeleteFramebuffer(framebuffer->framebufferId);
+        gpuDeleteTexture(framebuffer->texture.textureId);
+        return GPUStatusFailedToMakeFramebufferObjectError;
+    }
+    
+    framebuffer->valid = 1;
+    framebuffer->texture.valid = 1;
+    framebuffer->texture.generation = gpuNextTextureGeneration();
+    
+    return GPUStatusOK;
+}
+
+/* Keeps an internal framebuffer at the given size, format and filtering,
+   recreating it only when the size or format changes. */
+static GPUStatus gpuEnsureFramebuffer(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat,
+                                      GPUTextureFilter filter, GPUFramebuffer *framebuffer)
+{
+    if (framebuffer->valid && (framebuffer->texture.width != width || framebuffer->texture.height != height ||
+                               framebuffer->texture.pixelFormat != pixelFormat)) {
+        gpuDestroyFramebuffer(framebuffer);
+    }
+    if (!framebuffer->valid) {
+        GPUStatus status = gpuCreateFramebufferWithFormat(width, height, pixelFormat, framebuffer);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    if (framebuffer->texture.filter != filter) {
+        gpuSetTextureFiltering(&framebuffer->texture, filter);
+    }
+    return GPUStatusOK;
+}
+
+void gpuDestroyFramebuffer(GPUFramebuffer *framebuffer)
+{
+    if (framebuffer->valid && framebuffer->pool != NULL) {
+        gpuReleasePooledFramebuffer(framebuffer->pool, framebuffer);
+        return;
+    }
+    if (framebuffer->valid) {
+        framebuffer->valid = 0;
+        framebuffer->texture.valid = 0;
+        gpuDeleteFramebuffer(framebuffer->framebufferId);
+        gpuDeleteTexture(framebuffer->texture.textureId);
+    }
+}
+
+uint32_t gpuGetPixelFormatSize(GPUPixelFormat pixelFormat)
+{
+    switch (pixelFormat) {
+        case GPUPixelFormatR8: return 1;
+        case GPUPixelFormatRG8: return 2;
+        case GPUPixelFormatRGBA16F: return 8;
+        case GPUPixelFormatRGBA32F: return 16;
+        default: return 4;
+    }
+}
+
+uint32_t gpuGetFramebufferSizeInBytes(GPUFramebuffer *framebuffer)
+{
+    return gpuGetPixelFormatSize(framebuffer->texture.pixelFormat) * framebuffer->texture.width * framebuffer->texture.height;
+}
+
+/* gpuGetFramebufferSizeInBytes() without the 4 GB wrap, for budgets. */
+static uint64_t gpuGetTextureByteCount(const GPUTexture *texture)
+{
+    return (uint64_t)gpuGetPixelFormatSize(texture->pixelFormat) * texture->width * texture->height;
+}
+
+GPUStatus gpuGetFramebufferContents(GPUFramebuffer *framebuffer,
+                                    uint8_t *rgbaData,
+                                    GPUColorFormat colorFormat)
+{
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    GLenum pixelFormat, type;
+    uint32_t bytesPerPixel;
+    gpuGetReadbackFormat(framebuffer, colorFormat, &pixelFormat, &type, &bytesPerPixel);
+    
+    GPU_STATS_START(start);
+    glFlush();
+    glFinish();
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    GPUStatus status = gpuReadPixels(0, 0, framebuffer->texture.width, framebuffer->texture.height, pixelFormat, type, rgbaData);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryReadback, start,
+                     (uint64_t)bytesPerPixel * framebuffer->texture.width * framebuffer->texture.height);
+    
+    return status;
+}
+
+GPUStatus gpuGetFramebufferRegionContents(GPUFramebuffer *framebuffer,
+                                          const GPURect *region,
+                                          uint8_t *pixelData, size_t bytesPerRow,
+                                          GPUColorFormat colorFormat)
+{
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (region->x > framebuffer->texture.width || region->width > framebuffer->texture.width - region->x ||
+        region->y > framebuffer->texture.height || region->height > framebuffer->texture.height - region->y) {
+        return GPUStatusInvalidArgument;
+    }
+    if (region->width == 0 || region->height == 0) {
+        return GPUStatusOK;
+    }
+    
+    uint8_t *scratch = NULL;
+    GPUStatus status = gpuReadFramebufferRegion(framebuffer, region->x, region->y, region->width, region->height,
+                                                colorFormat, pixelData, bytesPerRow, &scratch);
+    free(scratch);
+    
+    return status;
+}
+
+#pragma mark - Resource Pool
+
+GPUStatus gpuCreateResourcePool(uint64_t budgetInBytes, GPUResourcePool *pool)
+{
+    memset(pool, 0, sizeof(GPUResourcePool));
+    pool->budgetInBytes = budgetInBytes;
+    pool->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+static void gpuFreePoolEntry(GPUResourcePool *pool, uint32_t index)
+{
+    GPUResourcePoolEntry *entry = &pool->entries[index];
+    if (entry->isTexture) {
+        gpuDeleteTexture(entry->framebuffer.texture.textureId);
+    } else {
+        gpuDeleteFramebuffer(entry->framebuffer.framebufferId);
+        gpuDeleteTexture(entry->framebuffer.texture.textureId);
+    }
+    pool->stats.idleBytes -= entry->sizeInBytes;
+    pool->stats.idleResources--;
+    pool->entries[index] = pool->entries[--pool->entryCount];
+}
+
+void gpuDestroyResourcePool(GPUResourcePool *pool)
+{
+    if (!pool->valid) {
+        return;
+    }
+    if (currentResourcePool == pool) {
+        currentResourcePool = NULL;
+    }
+    if (pool->lentFramebuffers != 0) {
+        fprintf(stderr, "Destroying a resource pool with %u framebuffers still acquired from it.\n", pool->lentFramebuffers);
+    }
+    gpuTrimResourcePool(pool, 0);
+    free(pool->entries);
+    pool->entries = NULL;
+    pool->entryCapacity = 0;
+    pool->valid = 0;
+}
+
+void gpuSetResourcePoolBudget(GPUResourcePool *pool, uint64_t budgetInBytes)
+{
+    pool->budgetInBytes = budgetInBytes;
+    gpuTrimResourcePool(pool, budgetInBytes);
+}
+
+void gpuTrimResourcePool(GPUResourcePool *pool, uint64_t targetInBytes)
+{
+    while (pool->stats.idleBytes > targetInBytes && pool->entryCount > 0) {
+        uint32_t oldest = 0;
+        for (uint32_t i = 1; i < pool->entryCount; i++) {
+            if (pool->entries[i].lastUse < pool->entries[oldest].lastUse) {
+                oldest = i;
+            }
+        }
+        gpuFreePoolEntry(pool, oldest);
+        pool->stats.evictions++;
+    }
+}
+
+void gpuGetResourcePoolStats(GPUResourcePool *pool, GPUResourcePoolStats *stats)
+{
+    *stats = pool->stats;
+}
+
+void gpuSetCurrentResourcePool(GPUResourcePool *pool)
+{
+    currentResourcePool = pool;
+}
+
+/* Takes the most recently released idle resource of the given kind. */
+static int gpuTakePoolEntry(GPUResourcePool *pool, uint32_t isTexture, uint32_t width, uint32_t height,
+                            uint32_t storageFormat, GPUFramebuffer *framebuffer)
+{
+    int32_t found = -1;
+    for (uint32_t i = 0; i < pool->entryCount; i++) {
+        GPUResourcePoolEntry *entry = &pool->entries[i];
+        if (entry->isTexture == isTexture &&
+            entry->framebuffer.texture.width == width &&
+            entry->framebuffer.texture.height == height &&
+            entry->framebuffer.texture.storageFormat == storageFormat &&
+            (found < 0 || entry->lastUse > pool->entries[found].lastUse)) {
+            found = (int32_t)i;
+        }
+    }
+    if (found < 0) {
+        pool->stats.misses++;
+        return 0;
+    }
+    
+    *framebuffer = pool->entries[found].framebuffer;
+    framebuffer->texture.generation = gpuNextTextureGeneration();
+    pool->stats.idleBytes -= pool->entries[found].sizeInBytes;
+    pool->stats.idleResources--;
+    pool->entries[found] = pool->entries[--pool->entryCount];
+    pool->stats.hits++;
+    
+    return 1;
+}
+
+static void gpuPutPoolEntry(GPUResourcePool *pool, uint32_t isTexture, GPUFramebuffer *framebuffer)
+{
+    uint64_t sizeInBytes = gpuGetTextureByteCount(&framebuffer->texture);
+    
+    if (pool->valid && sizeInBytes <= pool->budgetInBytes && pool->entryCount == pool->entryCapacity) {
+        uint32_t capacity = pool->entryCapacity == 0 ? 16 : pool->entryCapacity * 2;
+        GPUResourcePoolEntry *entries = realloc(pool->entries, capacity * sizeof(GPUResourcePoolEntry));
+        if (entries != NULL) {
+            pool->entries = entries;
+            pool->entryCapacity = capacity;
+        }
+    }
+    
+    if (!pool->valid || sizeInBytes > pool->budgetInBytes || pool->entryCount == pool->entryCapacity) {
+        if (!isTexture) {
+            gpuDeleteFramebuffer(framebuffer->framebufferId);
+        }
+        gpuDeleteTexture(framebuffer->texture.textureId);
+        pool->stats.evictions++;
+        return;
+    }
+    
+    // Whoever takes it next expects a fresh texture's nearest sampling.
+    if (framebuffer->texture.filter != GPUTextureFilterNearest) {
+        gpuSetTextureFiltering(&framebuffer->texture, GPUTextureFilterNearest);
+    }
+    
+    GPUResourcePoolEntry *entry = &pool->entries[pool->entryCount++];
+    entry->framebuffer = *framebuffer;
+    entry->isTexture = isTexture;
+    entry->sizeInBytes = sizeInBytes;
+    entry->lastUse = ++pool->clock;
+    pool->stats.idleBytes += sizeInBytes;
+    pool->stats.idleResources++;
+    
+    gpuTrimResourcePool(pool, pool->budgetInBytes);
+}
+
+GPUStatus gpuAcquirePooledFramebuffer(GPUResourcePool *pool,
+                                      uint32_t width, uint32_t height,
+                                      GPUFramebuffer *framebuffer)
+{
+    return gpuAcquirePooledFramebufferWithFormat(pool, width, height, GPUPixelFormatRGBA8, framebuffer);
+}
+
+GPUStatus gpuAcquirePooledFramebufferWithFormat(GPUResourcePool *pool,
+                                                uint32_t width, uint32_t height,
+                                                GPUPixelFormat pixelFormat,
+                                                GPUFramebuffer *framebuffer)
+{
+    if (!pool->valid) {
+        return GPUStatusInvalidResourcePool;
+    }
+    
+    GLenum internalFormat, format, type;
+    if (!gpuGetPixelFormatInfo(pixelFormat, &internalFormat, &format, &type)) {
+        return GPUStatusUnsupportedFormat;
+    }
+    
+    if (!gpuTakePoolEntry(pool, 0, width, height, internalFormat, framebuffer)) {
+        GPUStatus status = gpuAllocateFramebuffer(width, height, pixelFormat, framebuffer);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    
+    framebuffer->valid = 1;
+    framebuffer->texture.valid = 1;
+    framebuffer->pool = pool;
+    pool->lentFramebuffers++;
+    
+    return GPUStatusOK;
+}
+
+void gpuReleasePooledFramebuffer(GPUResourcePool *pool, GPUFramebuffer *framebuffer)
+{
+    if (!framebuffer->valid) {
+        return;
+    }
+    framebuffer->valid = 0;
+    framebuffer->texture.valid = 0;
+    if (framebuffer->pool == pool && pool->lentFramebuffers > 0) {
+        pool->lentFramebuffers--;
+    }
+    framebuffer->pool = NULL;
+    gpuPutPoolEntry(pool, 0, framebuffer);
+}
+
+GPUStatus gpuAcquirePooledTexture(GPUResourcePool *pool,
+                                  uint32_t width, uint32_t height,
+                                  GPUColorFormat colorFormat,
+                                  GPUTexture *texture)
+{
+    if (!pool->valid) {
+        return GPUStatusInvalidResourcePool;
+    }
+    
+    GLenum internalFormat, format;
+    gpuGetTextureStorageFormat(colorFormat, &internalFormat, &format);
+    
+    GPUFramebuffer entry;
+    if (gpuTakePoolEntry(pool, 1, width, height, internalFormat, &entry)) {
+        *texture = entry.texture;
+        texture->valid = 1;
+        return GPUStatusOK;
+    }
+    
+    GPUStatus status = gpuCreateTexture(texture);
+    if (status == GPUStatusOK) {
+        status = gpuEnsureTextureStorage(width, height, internalFormat, format, GL_UNSIGNED_BYTE, texture);
+    }
+    
+    return status;
+}
+
+void gpuReleasePooledTexture(GPUResourcePool *pool, GPUTexture *texture)
+{
+    if (!texture->valid) {
+        return;
+    }
+    texture->valid = 0;
+    
+    GPUFramebuffer entry;
+    memset(&entry, 0, sizeof(GPUFramebuffer));
+    entry.texture = *texture;
+    gpuPutPoolEntry(pool, 1, &entry);
+}
+
+#pragma mark - Filter Graph
+
+GPUStatus gpuCreateFilterGraph(GPUFilterGraph *graph)
+{
+    memset(graph, 0, sizeof(GPUFilterGraph));
+    graph->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+static void gpuReleaseFilterGraphBuffers(GPUFilterGraph *graph)
+{
+    for (uint32_t i = 0; i < graph->bufferCount; i++) {
+        gpuDestroyFramebuffer(&graph->buffers[i]);
+    }
+    free(graph->buffers);
+    graph->buffers = NULL;
+    graph->bufferCount = 0;
+    graph->compiled = 0;
+}
+
+void gpuDestroyFilterGraph(GPUFilterGraph *graph)
+{
+    if (graph->valid) {
+        graph->valid = 0;
+        gpuReleaseFilterGraphBuffers(graph);
+        free(graph->nodes);
+        graph->nodes = NULL;
+        graph->nodeCount = 0;
+        graph->nodeCapacity = 0;
+    }
+}
+
+GPUFilterSource gpuFilterSourceFromTexture(GPUTexture *texture)
+{
+    GPUFilterSource source = { -1, texture };
+    return source;
+}
+
+GPUFilterSource gpuFilterSourceFromNode(int32_t node)
+{
+    GPUFilterSource source = { node, NULL };
+    return source;
+}
+
+/* Sources may only refer to nodes before the one reading them, which keeps
+   the graph acyclic and the node order a valid execution order. */
+static int gpuIsValidFilterSource(GPUFilterGraph *graph, int32_t node, GPUFilterSource source)
+{
+    if (source.node < 0) {
+        return source.texture != NULL;
+    }
+    return source.node < node && (uint32_t)source.node < graph->nodeCount;
+}
+
+GPUStatus gpuAddFilterGraphNode(GPUFilterGraph *graph, GPUProgram *program,
+                                GPUFilterSource input,
+                                uint32_t width, uint32_t height,
+                                int32_t *node)
+{
+    return gpuAddFilterGraphNodeWithFormat(graph, program, input, width, height, GPUPixelFormatRGBA8, node);
+}
+
+GPUStatus gpuAddFilterGraphNodeWithFormat(GPUFilterGraph *graph, GPUProgram *program,
+                                          GPUFilterSource input,
+                                          uint32_t width, uint32_t height,
+                                          GPUPixelFormat pixelFormat,
+                                          int32_t *node)
+{
+    if (!graph->valid || !gpuIsValidFilterSource(graph, (int32_t)graph->nodeCount, input)) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    if (!program->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    if (graph->nodeCount == graph->nodeCapacity) {
+        uint32_t capacity = graph->nodeCapacity == 0 ? 8 : graph->nodeCapacity * 2;
+        GPUFilterNode *nodes = realloc(graph->nodes, capacity * sizeof(GPUFilterNode));
+        if (nodes == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        graph->nodes = nodes;
+        graph->nodeCapacity = capacity;
+    }
+    
+    GPUFilterNode *filterNode = &graph->nodes[graph->nodeCount];
+    memset(filterNode, 0, sizeof(GPUFilterNode));
+    filterNode->program = program;
+    filterNode->inputs[0] = input;
+    for (int i = 1; i < 8; i++) {
+        filterNode->inputs[i] = gpuFilterSourceFromTexture(NULL);
+    }
+    filterNode->width = width;
+    filterNode->height = height;
+    filterNode->pixelFormat = pixelFormat;
+    filterNode->buffer = -1;
+    
+    *node = (int32_t)graph->nodeCount++;
+    graph->compiled = 0;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuSetFilterGraphNodeTexture(GPUFilterGraph *graph, int32_t node,
+                                       uint32_t unit, GPUFilterSource source)
+{
+    if (!graph->valid || node < 0 || (uint32_t)node >= graph->nodeCount ||
+        unit < 1 || unit > 7 || !gpuIsValidFilterSource(graph, node, source)) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    
+    graph->nodes[node].inputs[unit] = source;
+    graph->compiled = 0;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuSetFilterGraphNodeCallback(GPUFilterGraph *graph, int32_t node,
+                                        void (*prepare)(GPUProgram *program, void *userData),
+                                        void *userData)
+{
+    if (!graph->valid || node < 0 || (uint32_t)node >= graph->nodeCount) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    
+    graph->nodes[node].prepare = prepare;
+    graph->nodes[node].userData = userData;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuMarkFilterGraphOutput(GPUFilterGraph *graph, int32_t node)
+{
+    if (!graph->valid || node < 0 || (uint32_t)node >= graph->nodeCount) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    
+    graph->nodes[node].isOutput = 1;
+    graph->compiled = 0;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuCompileFilterGraph(GPUFilterGraph *graph)
+{
+    if (!graph->valid) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    
+    gpuReleaseFilterGraphBuffers(graph);
+    
+    // Walk backwards from the outputs to find the last reader of every
+    // node. Outputs live until the end; nodes nobody reads are dead.
+    int32_t end = (int32_t)graph->nodeCount;
+    for (int32_t i = end - 1; i >= 0; i--) {
+        GPUFilterNode *node = &graph->nodes[i];
+        node->buffer = -1;
+        node->lastUse = node->isOutput ? end : -1;
+    }
+    for (int32_t i = end - 1; i >= 0; i--) {
+        GPUFilterNode *node = &graph->nodes[i];
+        if (node->lastUse < 0) {
+            continue;
+        }
+        for (int k = 0; k < 8; k++) {
+            int32_t source = node->inputs[k].node;
+            if (source >= 0 && graph->nodes[source].lastUse < i) {
+                graph->nodes[source].lastUse = i;
+            }
+        }
+    }
+    
+    // Interval allocation in execution order. A buffer becomes free once
+    // the step after its owner's last reader begins, so a node never
+    // renders into a buffer it is also sampling from.
+    uint32_t *bufferWidths = malloc(3 * graph->nodeCount * sizeof(uint32_t) + 1);
+    int32_t *bufferOwners = malloc(graph->nodeCount * sizeof(int32_t) + 1);
+    if (bufferWidths == NULL || bufferOwners == NULL) {
+        free(bufferWidths);
+        free(bufferOwners);
+        return GPUStatusOutOfMemory;
+    }
+    uint32_t *bufferHeights = bufferWidths + graph->nodeCount;
+    uint32_t *bufferFormats = bufferHeights + graph->nodeCount;
+    uint32_t bufferCount = 0;
+    
+    for (int32_t i = 0; i < end; i++) {
+        GPUFilterNode *node = &graph->nodes[i];
+        if (node->lastUse < 0) {
+            continue;
+        }
+        
+        int32_t buffer = -1;
+        for (uint32_t b = 0; b < bufferCount; b++) {
+            int32_t owner = bufferOwners[b];
+            if ((owner < 0 || graph->nodes[owner].lastUse < i) &&
+                bufferWidths[b] == node->width && bufferHeights[b] == node->height &&
+                bufferFormats[b] == (uint32_t)node->pixelFormat) {
+                buffer = (int32_t)b;
+                break;
+            }
+        }
+        if (buffer < 0) {
+            buffer = (int32_t)bufferCount++;
+            bufferWidths[buffer] = node->width;
+            bufferHeights[buffer] = node->height;
+            bufferFormats[buffer] = (uint32_t)node->pixelFormat;
+        }
+        bufferOwners[buffer] = i;
+        node->buffer = buffer;
+    }
+    free(bufferOwners);
+    
+    GPUStatus status = GPUStatusOK;
+    graph->buffers = calloc(bufferCount > 0 ? bufferCount : 1, sizeof(GPUFramebuffer));
+    if (graph->buffers == NULL) {
+        status = GPUStatusOutOfMemory;
+    }
+    for (uint32_t b = 0; status == GPUStatusOK && b < bufferCount; b++) {
+        status = gpuCreateFramebufferWithFormat(bufferWidths[b], bufferHeights[b],
+                                                (GPUPixelFormat)bufferFormats[b], &graph->buffers[b]);
+        graph->bufferCount = b + 1;
+    }
+    free(bufferWidths);
+    
+    if (status != GPUStatusOK) {
+        gpuReleaseFilterGraphBuffers(graph);
+        return status;
+    }
+    
+    graph->compiled = 1;
+    
+    return GPUStatusOK;
+}
+
+static GPUTexture *gpuResolveFilterSource(GPUFilterGraph *graph, GPUFilterSource source)
+{
+    if (source.node < 0) {
+        return source.texture;
+    }
+    return &graph->buffers[graph->nodes[source.node].buffer].texture;
+}
+
+GPUStatus gpuRunFilterGraph(GPUFilterGraph *graph)
+{
+    if (!graph->valid) {
+        return GPUStatusInvalidFilterGraph;
+    }
+    if (!graph->compiled) {
+        GPUStatus status = gpuCompileFilterGraph(graph);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    
+    for (uint32_t i = 0; i < graph->nodeCount; i++) {
+        GPUFilterNode *node = &graph->nodes[i];
+        if (node->buffer < 0) {
+            continue;
+        }
+        
+        GPUProgram *program = node->program;
+        GPUTexture *input = gpuResolveFilterSource(graph, node->inputs[0]);
+        
+        // The program may be shared between nodes, so the node's texture
+        // bindings only apply while it renders.
+        GPUProgram savedProgram = *program;
+        for (int k = 1; k < 8; k++) {
+            if (node->inputs[k].node >= 0 || node->inputs[k].texture != NULL) {
+                program->additionalTextures[k - 1].textureShouldBeUsed = 1;
+                program->additionalTextures[k - 1].texture = *gpuResolveFilterSource(graph, node->inputs[k]);
+            }
+        }
+        if (node->prepare != NULL) {
+            node->prepare(program, node->userData);
+        }
+        
+        GPU_STATS_SET_PASS("graph node", i);
+        GPUStatus status = gpuRenderTextureToFramebufferUsingProgram(input, &graph->buffers[node->buffer], program);
+        GPU_STATS_SET_PASS(NULL, 0);
+        memcpy(program->additionalTextures, savedProgram.additionalTextures, sizeof(program->additionalTextures));
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    
+    return GPUStatusOK;
+}
+
+GPUFramebuffer *gpuGetFilterGraphOutput(GPUFilterGraph *graph, int32_t node)
+{
+    if (!graph->valid || !graph->compiled || node < 0 || (uint32_t)node >= graph->nodeCount ||
+        !graph->nodes[node].isOutput) {
+        return NULL;
+    }
+    return &graph->buffers[graph->nodes[node].buffer];
+}
+
+#pragma mark - Filter Chain
+
+typedef struct GPUStringBuilder {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} GPUStringBuilder;
+
+static void gpuAppendString(GPUStringBuilder *builder, const char *string, size_t length)
+{
+    if (builder->failed) {
+        return;
+    }
+    if (builder->length + length + 1 > builder->capacity) {
+        size_t capacity = builder->capacity == 0 ? 1024 : builder->capacity;
+        while (builder->length + length + 1 > capacity) {
+            capacity *= 2;
+        }
+        char *data = realloc(builder->data, capacity);
+        if (data == NULL) {
+            builder->failed = 1;
+            return;
+        }
+        builder->data = data;
+        builder->capacity = capacity;
+    }
+    memcpy(builder->data + builder->length, string, length);
+    builder->length += length;
+    builder->data[builder->length] = '\0';
+}
+
+static void gpuAppendCString(GPUStringBuilder *builder, const char *string)
+{
+    gpuAppendString(builder, string, strlen(string));
+}
+
+typedef enum GPUTokenType {
+    GPUTokenSpace = 0,
+    GPUTokenIdentifier = 1,
+    GPUTokenNumber = 2,
+    GPUTokenDirective = 3,
+    GPUTokenSymbol = 4
+} GPUTokenType;
+
+typedef struct GPUToken {
+    GPUTokenType type;
+    const char *start;
+    uint32_t length;
+} GPUToken;
+
+/* Splits GLSL source into tokens. Comments count as white space. */
+static int32_t gpuTokenizeShader(const char *source, GPUToken **tokens)
+{
+    uint32_t count = 0;
+    uint32_t capacity = 256;
+    *tokens = malloc(capacity * sizeof(GPUToken));
+    if (*tokens == NULL) {
+        return -1;
+    }
+    
+    const char *p = source;
+    while (*p != '\0') {
+        const char *start = p;
+        GPUTokenType type;
+        if (isspace((unsigned char)*p)) {
+            while (isspace((unsigned char)*p)) {
+                p++;
+            }
+            type = GPUTokenSpace;
+        } else if (p[0] == '/' && p[1] == '/') {
+            while (*p != '\0' && *p != '\n') {
+                p++;
+            }
+            type = GPUTokenSpace;
+        } else if (p[0] == '/' && p[1] == '*') {
+            p += 2;
+            while (*p != '\0' && !(p[0] == '*' && p[1] == '/')) {
+                p++;
+            }
+            p += *p != '\0' ? 2 : 0;
+            type = GPUTokenSpace;
+        } else if (*p == '#') {
+            while (*p != '\0' && *p != '\n') {
+                p += (p[0] == '\\' && p[1] == '\n') ? 2 : 1;
+            }
+            type = GPUTokenDirective;
+        } else if (isalpha((unsigned char)*p) || *p == '_') {
+            while (isalnum((unsigned char)*p) || *p == '_') {
+                p++;
+            }
+            type = GPUTokenIdentifier;
+        } else if (isdigit((unsigned char)*p) || (p[0] == '.' && isdigit((unsigned char)p[1]))) {
+            while (isalnum((unsigned char)*p) || *p == '.' ||
+                   ((*p == '+' || *p == '-') && (p[-1] == 'e' || p[-1] == 'E'))) {
+                p++;
+            }
+            type = GPUTokenNumber;
+        } else {
+            p++;
+            type = GPUTokenSymbol;
+        }
+        
+        if (count == capacity) {
+            capacity *= 2;
+            GPUToken *grown = realloc(*tokens, capacity * sizeof(GPUToken));
+            if (grown == NULL) {
+                free(*tokens);
+                *tokens = NULL;
+                return -1;
+            }
+            *tokens = grown;
+        }
+        (*tokens)[count].type = type;
+        (*tokens)[count].start = start;
+        (*tokens)[count].length = (uint32_t)(p - start);
+        count++;
+    }
+    
+    return (int32_t)count;
+}
+
+static int gpuTokenIs(const GPUToken *token, const char *string)
+{
+    return token->type != GPUTokenSpace &&
+           strlen(string) == token->length && memcmp(token->start, string, token->length) == 0;
+}
+
+static uint32_t gpuSkipSpace(const GPUToken *tokens, uint32_t count, uint32_t index)
+{
+    while (index < count && tokens[index].type == GPUTokenSpace) {
+        index++;
+    }
+    return index;
+}
+
+/* Matches "texture2D(texture, uv)" starting at index and returns the index
+   just past it, or 0. */
+static uint32_t gpuMatchPointwiseSample(const GPUToken *tokens, uint32_t count, uint32_t index)
+{
+    static const char *pattern[] = { "texture2D", "(", "texture", ",", "uv", ")" };
+    for (int i = 0; i < 6; i++) {
+        index = gpuSkipSpace(tokens, count, index);
+        if (index >= count || !gpuTokenIs(&tokens[index], pattern[i])) {
+            return 0;
+        }
+        index++;
+    }
+    return index;
+}
+
+typedef struct GPUShaderItem {
+    uint32_t start;
+    uint32_t end;
+} GPUShaderItem;
+
+/* Names declared at global scope, found as identifiers outside any
+   brackets that are followed by one of ( ; = [ , { and are not part of an
+   initializer. */
+static void gpuCollectDeclaredNames(const GPUToken *tokens, uint32_t count, GPUShaderItem item,
+                                    const GPUToken **names, uint32_t *nameCount)
+{
+    int depth = 0;
+    int inInitializer = 0;
+    for (uint32_t i = item.start; i < item.end; i++) {
+        const GPUToken *token = &tokens[i];
+        if (token->type == GPUTokenSymbol) {
+            char c = token->start[0];
+            if (c == '(' || c == '[' || c == '{') {
+                depth++;
+            } else if (c == ')' || c == ']' || c == '}') {
+                depth--;
+            } else if (c == '=' && depth == 0) {
+                inInitializer = 1;
+            } else if (c == ',' && depth == 0) {
+                inInitializer = 0;
+            }
+            continue;
+        }
+        if (token->type != GPUTokenIdentifier || depth != 0 || inInitializer ||
+            gpuTokenIs(token, "layout") || gpuTokenIs(token, "main")) {
+            continue;
+        }
+        uint32_t next = gpuSkipSpace(tokens, count, i + 1);
+        if (next < item.end && tokens[next].type == GPUTokenSymbol &&
+            strchr("(;=[,{", tokens[next].start[0]) != NULL) {
+            names[(*nameCount)++] = token;
+        }
+    }
+}
+
+static int gpuIsDeclaredName(const GPUToken *token, const GPUToken **names, uint32_t nameCount)
+{
+    for (uint32_t i = 0; i < nameCount; i++) {
+        if (names[i]->length == token->length && memcmp(names[i]->start, token->start, token->length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Emits tokens with the stage's global names prefixed. Inside main() the
+   input sample, gl_FragColor and bare returns are rewritten to work on the
+   stage function's color. Returns 0 if the code is not pointwise. */
+static int gpuEmitStageTokens(GPUStringBuilder *builder, const GPUToken *tokens, uint32_t count,
+                              uint32_t start, uint32_t end, const GPUToken **names, uint32_t nameCount,
+                              uint32_t stageIndex, int inMain)
+{
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "stage%u_", stageIndex);
+    
+    int afterDot = 0;
+    for (uint32_t i = start; i < end; i++) {
+        const GPUToken *token = &tokens[i];
+        if (token->type != GPUTokenIdentifier || afterDot) {
+            gpuAppendString(builder, token->start, token->length);
+            if (token->type != GPUTokenSpace) {
+                afterDot = gpuTokenIs(token, ".");
+            }
+            continue;
+        }
+        
+        if (gpuTokenIs(token, "discard") || gpuTokenIs(token, "gl_FragData") ||
+            gpuTokenIs(token, "gl_FragDepth") || gpuTokenIs(token, "texture") ||
+            (!inMain && gpuTokenIs(token, "gl_FragColor"))) {
+            return 0;
+        }
+        
+        uint32_t next;
+        if (inMain && (next = gpuMatchPointwiseSample(tokens, end, i)) != 0) {
+            gpuAppendCString(builder, "gpuInput");
+            i = next - 1;
+        } else if (inMain && gpuTokenIs(token, "gl_FragColor")) {
+            gpuAppendCString(builder, "gpuColor");
+        } else if (inMain && gpuTokenIs(token, "return") &&
+                   (next = gpuSkipSpace(tokens, end, i + 1)) < end && gpuTokenIs(&tokens[next], ";")) {
+            gpuAppendCString(builder, "return gpuColor");
+        } else if (gpuIsDeclaredName(token, names, nameCount)) {
+            gpuAppendCString(builder, prefix);
+            gpuAppendString(builder, token->start, token->length);
+        } else {
+            gpuAppendString(builder, token->start, token->length);
+        }
+    }
+    (void)count;
+    
+    return 1;
+}
+
+/* Rewrites a pointwise fragment shader into globals plus a function
+   "vec4 gpuStage<index>(vec4 gpuInput)". Returns NULL if the shader does
+   not qualify for fusion. */
+static char *gpuRewritePointwiseStage(const char *source, uint32_t stageIndex)
+{
+    GPUToken *tokens = NULL;
+    int32_t tokenCount = gpuTokenizeShader(source, &tokens);
+    if (tokenCount < 0) {
+        return NULL;
+    }
+    uint32_t count = (uint32_t)tokenCount;
+    
+    GPUShaderItem *items = malloc((count + 1) * sizeof(GPUShaderItem));
+    const GPUToken **names = malloc((count + 1) * sizeof(GPUToken *));
+    GPUStringBuilder builder = { NULL, 0, 0, 0 };
+    int fusable = items != NULL && names != NULL;
+    int foundMain = 0;
+    uint32_t itemCount = 0;
+    uint32_t nameCount = 0;
+    
+    // Split into top-level declarations and directives. A declaration ends
+    // with a semicolon, or with the closing brace of a function body.
+    for (uint32_t i = 0; fusable && i < count; ) {
+        if (tokens[i].type == GPUTokenSpace || tokens[i].type == GPUTokenDirective) {
+            items[itemCount].start = i;
+            items[itemCount++].end = ++i;
+            continue;
+        }
+        uint32_t end = i;
+        int depth = 0;
+        int isFunction = 0;
+        int sawBrace = 0;
+        for (; end < count; end++) {
+            if (gpuTokenIs(&tokens[end], "(") && !sawBrace) {
+                isFunction = 1;
+            } else if (gpuTokenIs(&tokens[end], "{")) {
+                sawBrace = 1;
+                depth++;
+            } else if (gpuTokenIs(&tokens[end], "}")) {
+                if (--depth == 0 && isFunction) {
+                    end++;
+                    break;
+                }
+            } else if (gpuTokenIs(&tokens[end], ";") && depth == 0) {
+                end++;
+                break;
+            }
+        }
+        items[itemCount].start = i;
+        items[itemCount++].end = end;
+        i = end;
+    }
+    
+    // Classify declarations; drop the ones the fused shader provides.
+    for (uint32_t n = 0; fusable && n < itemCount; n++) {
+        GPUShaderItem *item = &items[n];
+        const GPUToken *first = &tokens[item->start];
+        if (first->type == GPUTokenSpace) {
+            continue;
+        }
+        if (first->type == GPUTokenDirective) {
+            // Only legacy GLSL is rewritten; the core variants differ.
+            const char *p = first->start + 1;
+            while (*p == ' ' || *p == '\t') {
+                p++;
+            }
+            if (strncmp(p, "version", 7) == 0) {
+                fusable = atoi(p + 7) < 130;
+                item->end = item->start;
+            }
+            continue;
+        }
+        if (gpuTokenIs(first, "precision")) {
+            continue;
+        }
+        
+        int isUniform = 0, isVarying = 0, isSampler = 0;
+        for (uint32_t i = item->start; i < item->end; i++) {
+            const GPUToken *token = &tokens[i];
+            if (token->type == GPUTokenSymbol && strchr("({=", token->start[0]) != NULL) {
+                break;
+            }
+            isUniform |= gpuTokenIs(token, "uniform");
+            isVarying |= gpuTokenIs(token, "varying") || gpuTokenIs(token, "in") || gpuTokenIs(token, "attribute");
+            isSampler |= token->type == GPUTokenIdentifier && token->length > 7 && strncmp(token->start, "sampler", 7) == 0;
+        }
+        
+        uint32_t firstName = nameCount;
+        gpuCollectDeclaredNames(tokens, count, *item, names, &nameCount);
+        int declaresUV = nameCount == firstName + 1 && gpuTokenIs(names[firstName], "uv");
+        int declaresTexture = nameCount == firstName + 1 && gpuTokenIs(names[firstName], "texture");
+        
+        if (isVarying) {
+            fusable = declaresUV;
+            nameCount = firstName;
+            item->end = item->start;
+        } else if (isUniform && isSampler) {
+            fusable = declaresTexture;
+            nameCount = firstName;
+            item->end = item->start;
+        }
+    }
+    
+    for (uint32_t n = 0; fusable && n < itemCount; n++) {
+        GPUShaderItem *item = &items[n];
+        
+        uint32_t nameIndex = gpuSkipSpace(tokens, item->end, item->start);
+        uint32_t brace = nameIndex;
+        while (brace < item->end && !gpuTokenIs(&tokens[brace], "(") && !gpuTokenIs(&tokens[brace], "{")) {
+            nameIndex = tokens[brace].type == GPUTokenIdentifier ? brace : nameIndex;
+            brace++;
+        }
+        int isMain = brace < item->end && gpuTokenIs(&tokens[brace], "(") && gpuTokenIs(&tokens[nameIndex], "main");
+        
+        if (!isMain) {
+            fusable = gpuEmitStageTokens(&builder, tokens, count, item->start, item->end, names, nameCount, stageIndex, 0);
+            if (tokens[item->start].type == GPUTokenDirective) {
+                gpuAppendCString(&builder, "\n");
+            }
+            continue;
+        }
+        
+        uint32_t bodyStart = brace;
+        while (bodyStart < item->end && !gpuTokenIs(&tokens[bodyStart], "{")) {
+            bodyStart++;
+        }
+        if (bodyStart >= item->end || foundMain) {
+            fusable = 0;
+            break;
+        }
+        foundMain = 1;
+        
+        char header[96];
+        snprintf(header, sizeof(header), "vec4 gpuStage%u(vec4 gpuInput)\n{\n    vec4 gpuColor = gpuInput;\n", stageIndex);
+        gpuAppendCString(&builder, header);
+        fusable = gpuEmitStageTokens(&builder, tokens, count, bodyStart + 1, item->end - 1, names, nameCount, stageIndex, 1);
+        gpuAppendCString(&builder, "\n    return gpuColor;\n}\n");
+    }
+    
+    free(tokens);
+    free(items);
+    free(names);
+    
+    if (!fusable || !foundMain || builder.failed) {
+        free(builder.data);
+        return NULL;
+    }
+    
+    return builder.data;
+}
+
+static char *gpuBuildFusedShader(char **stageCode, uint32_t first, uint32_t end)
+{
+    GPUStringBuilder builder = { NULL, 0, 0, 0 };
+    
+#if GPU_OPENGL_ES
+    gpuAppendCString(&builder, "precision highp float;\nvarying highp vec2 uv;\n");
+#else
+    gpuAppendCString(&builder, "varying vec2 uv;\n");
+#endif
+    gpuAppendCString(&builder, "uniform sampler2D texture;\n");
+    
+    for (uint32_t i = first; i < end; i++) {
+        gpuAppendCString(&builder, stageCode[i]);
+    }
+    
+    gpuAppendCString(&builder, "void main()\n{\n    vec4 gpuColor = texture2D(texture, uv);\n");
+    for (uint32_t i = first; i < end; i++) {
+        char call[64];
+        snprintf(call, sizeof(call), "    gpuColor = gpuStage%u(gpuColor);\n", i);
+        gpuAppendCString(&builder, call);
+    }
+    gpuAppendCString(&builder, "    gl_FragColor = gpuColor;\n}\n");
+    
+    if (builder.failed) {
+        free(builder.data);
+        return NULL;
+    }
+    
+    return builder.data;
+}
+
+GPUStatus gpuCompileFilterChain(const GPUFilterStage *stages, uint32_t stageCount,
+                                GPUFilterChain *chain,
+                                void (*logFunc)(const char *log))
+{
+    memset(chain, 0, sizeof(GPUFilterChain));
+    
+    if (stageCount == 0) {
+        return GPUStatusUnknownError;
+    }
+    
+    chain->passes = calloc(stageCount, sizeof(GPUProgram));
+    chain->stagePasses = calloc(stageCount, sizeof(uint32_t));
+    char **stageCode = calloc(stageCount, sizeof(char *));
+    if (chain->passes == NULL || chain->stagePasses == NULL || stageCode == NULL) {
+        free(chain->passes);
+        free(chain->stagePasses);
+        free(stageCode);
+        return GPUStatusOutOfMemory;
+    }
+    chain->valid = 1;
+    
+    for (uint32_t i = 0; i < stageCount; i++) {
+        if (stages[i].pointwise) {
+            stageCode[i] = gpuRewritePointwiseStage(stages[i].fragmentShaderCode, i);
+        }
+    }
+    
+    // A fused pass that fails to compile is not retried with fewer stages:
+    // the rest of the chain is compiled one pass per stage instead.
+    GPUStatus status = GPUStatusOK;
+    uint32_t fuse = 1;
+    for (uint32_t i = 0; i < stageCount && status == GPUStatusOK; ) {
+        uint32_t end = i + 1;
+        while (fuse && stageCode[i] != NULL && end < stageCount && stageCode[end] != NULL) {
+            end++;
+        }
+        
+        GPUProgram *pass = &chain->passes[chain->passCount];
+        if (end - i > 1) {
+            char *fusedCode = gpuBuildFusedShader(stageCode, i, end);
+            status = fusedCode == NULL ? GPUStatusOutOfMemory : gpuCompileProgram(kGPUDefaultVertexShaderCode, fusedCode, pass, logFunc);
+            free(fusedCode);
+            if (status != GPUStatusOK) {
+                fprintf(stderr, "Failed to compile fused filter chain pass, compiling stages separately.\n");
+                fuse = 0;
+                end = i + 1;
+            }
+        }
+        if (end - i == 1) {
+            status = gpuCompileProgram(kGPUDefaultVertexShaderCode, stages[i].fragmentShaderCode, pass, logFunc);
+        }
+        
+        for (uint32_t k = i; k < end; k++) {
+            chain->stagePasses[k] = chain->passCount;
+        }
+        chain->passCount++;
+        i = end;
+    }
+    
+    for (uint32_t i = 0; i < stageCount; i++) {
+        free(stageCode[i]);
+    }
+    free(stageCode);
+    
+    chain->stageCount = stageCount;
+    if (status != GPUStatusOK) {
+        gpuDestroyFilterChain(chain);
+        return status;
+    }
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyFilterChain(GPUFilterChain *chain)
+{
+    if (!chain->valid) {
+        return;
+    }
+    chain->valid = 0;
+    
+    for (uint32_t i = 0; i < chain->passCount; i++) {
+        gpuDestroyProgram(&chain->passes[i]);
+    }
+    gpuDestroyFramebuffer(&chain->buffers[0]);
+    gpuDestroyFramebuffer(&chain->buffers[1]);
+    if (chain->retainedBuffers != NULL) {
+        for (uint32_t i = 0; i + 1 < chain->passCount; i++) {
+            gpuDestroyFramebuffer(&chain->retainedBuffers[i]);
+        }
+        free(chain->retainedBuffers);
+        chain->retainedBuffers = NULL;
+    }
+    free(chain->passes);
+    free(chain->stagePasses);
+    chain->passes = NULL;
+    chain->stagePasses = NULL;
+}
+
+static int gpuIsFusedFilterChainStage(GPUFilterChain *chain, uint32_t stage)
+{
+    uint32_t pass = chain->stagePasses[stage];
+    return (stage > 0 && chain->stagePasses[stage - 1] == pass) ||
+           (stage + 1 < chain->stageCount && chain->stagePasses[stage + 1] == pass);
+}
+
+GPUStatus gpuGetFilterChainParameterHandle(GPUFilterChain *chain, uint32_t stage,
+                                           const char *name,
+                                           GPUParameterHandle *handle)
+{
+    if (!chain->valid || stage >= chain->stageCount) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    GPUProgram *program = &chain->passes[chain->stagePasses[stage]];
+    if (!gpuIsFusedFilterChainStage(chain, stage)) {
+        return gpuGetParameterHandle(program, name, handle);
+    }
+    
+    char fusedName[256];
+    if (snprintf(fusedName, sizeof(fusedName), "stage%u_%s", stage, name) >= (int)sizeof(fusedName)) {
+        return GPUStatusNoSuchParameter;
+    }
+    
+    return gpuGetParameterHandle(program, fusedName, handle);
+}
+
+GPUProgram *gpuGetFilterChainProgram(GPUFilterChain *chain, uint32_t stage)
+{
+    if (!chain->valid || stage >= chain->stageCount) {
+        return NULL;
+    }
+    return &chain->passes[chain->stagePasses[stage]];
+}
+
+GPUStatus gpuRunFilterChain(GPUFilterChain *chain, GPUTexture *input,
+                            GPUFramebuffer *output)
+{
+    if (!chain->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!output->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    // The retained intermediates are not updated here.
+    chain->retainedValid = 0;
+    
+    // Intermediates ping-pong between two framebuffers of the output size
+    // and format, so float outputs keep their range between passes.
+    uint32_t width = output->texture.width;
+    uint32_t height = output->texture.height;
+    uint32_t bufferCount = chain->passCount > 2 ? 2 : chain->passCount - 1;
+    for (uint32_t i = 0; i < bufferCount; i++) {
+        GPUStatus status = gpuEnsureFramebuffer(width, height, output->texture.pixelFormat,
+                                                GPUTextureFilterNearest, &chain->buffers[i]);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    
+    GPUTexture *source = input;
+    for (uint32_t i = 0; i < chain->passCount; i++) {
+        GPUFramebuffer *target = i + 1 == chain->passCount ? output : &chain->buffers[i % 2];
+        GPU_STATS_SET_PASS("chain pass", i);
+        GPUStatus status = gpuRenderTextureToFramebufferUsingProgram(source, target, &chain->passes[i]);
+        GPU_STATS_SET_PASS(NULL, 0);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+        source = &target->texture;
+    }
+    
+    return GPUStatusOK;
+}
+
+#pragma mark - Result Cache
+
+#define GPU_HASH_SEED 14695981039346656037ull
+
+GPUStatus gpuCreateResultCache(uint64_t budgetInBytes, GPUResultCache *cache)
+{
+    memset(cache, 0, sizeof(GPUResultCache));
+    cache->budgetInBytes = budgetInBytes;
+    cache->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+static void gpuFreeResultCacheEntry(GPUResultCache *cache, uint32_t index)
+{
+    GPUResultCacheEntry *entry = &cache->entries[index];
+    gpuDestroyFramebuffer(&entry->framebuffer);
+    free(entry->passKeys);
+    cache->stats.cachedBytes -= entry->sizeInBytes;
+    cache->stats.cachedResults--;
+    cache->entries[index] = cache->entries[--cache->entryCount];
+}
+
+void gpuDestroyResultCache(GPUResultCache *cache)
+{
+    if (!cache->valid) {
+        return;
+    }
+    cache->valid = 0;
+    
+    while (cache->entryCount > 0) {
+        gpuFreeResultCacheEntry(cache, cache->entryCount - 1);
+    }
+    free(cache->entries);
+    cache->entries = NULL;
+    cache->entryCapacity = 0;
+}
+
+/* Frees least recently used images until the cache fits its budget, but
+   never the entry at keep. */
+static void gpuTrimResultCache(GPUResultCache *cache, int32_t keep)
+{
+    while (cache->stats.cachedBytes > cache->budgetInBytes) {
+        int32_t oldest = -1;
+        for (uint32_t i = 0; i < cache->entryCount; i++) {
+            if ((int32_t)i != keep && (oldest < 0 || cache->entries[i].lastUse < cache->entries[oldest].lastUse)) {
+                oldest = (int32_t)i;
+            }
+        }
+        if (oldest < 0) {
+            return;
+        }
+        // The last entry moves into the freed slot.
+        if (keep == (int32_t)cache->entryCount - 1) {
+            keep = oldest;
+        }
+        gpuFreeResultCacheEntry(cache, (uint32_t)oldest);
+        cache->stats.evictions++;
+    }
+}
+
+void gpuSetResultCacheBudget(GPUResultCache *cache, uint64_t budgetInBytes)
+{
+    cache->budgetInBytes = budgetInBytes;
+    gpuTrimResultCache(cache, -1);
+}
+
+void gpuGetResultCacheStats(GPUResultCache *cache, GPUResultCacheStats *stats)
+{
+    *stats = cache->stats;
+}
+
+/* Whether the entry was rendered from exactly what the probe describes. */
+static int gpuIsSameResult(const GPUResultCacheEntry *entry, const GPUResultCacheEntry *probe)
+{
+    return entry->key == probe->key &&
+           entry->inputGeneration == probe->inputGeneration &&
+           entry->width == probe->width && entry->height == probe->height &&
+           entry->pixelFormat == probe->pixelFormat &&
+           entry->passCount == probe->passCount &&
+           memcmp(entry->passKeys, probe->passKeys, 2 * probe->passCount * sizeof(uint64_t)) == 0;
+}
+
+static int gpuFindCachedResult(GPUResultCache *cache, const GPUResultCacheEntry *probe, GPUFramebuffer *output)
+{
+    for (uint32_t i = 0; i < cache->entryCount; i++) {
+        if (gpuIsSameResult(&cache->entries[i], probe)) {
+            cache->entries[i].lastUse = ++cache->clock;
+            *output = cache->entries[i].framebuffer;
+            cache->stats.hits++;
+            return 1;
+        }
+    }
+    cache->stats.misses++;
+    return 0;
+}
+
+/* Takes ownership of the probe's pass keys and of the framebuffer, which
+   holds the image the probe describes. */
+static GPUStatus gpuAddCachedResult(GPUResultCache *cache, const GPUResultCacheEntry *probe, GPUFramebuffer *framebuffer)
+{
+    if (cache->entryCount == cache->entryCapacity) {
+        uint32_t capacity = cache->entryCapacity == 0 ? 16 : cache->entryCapacity * 2;
+        GPUResultCacheEntry *entries = realloc(cache->entries, capacity * sizeof(GPUResultCacheEntry));
+        if (entries == NULL) {
+            free(probe->passKeys);
+            gpuDestroyFramebuffer(framebuffer);
+            return GPUStatusOutOfMemory;
+        }
+        cache->entries = entries;
+        cache->entryCapacity = capacity;
+    }
+    
+    GPUResultCacheEntry *entry = &cache->entries[cache->entryCount++];
+    *entry = *probe;
+    entry->framebuffer = *framebuffer;
+    entry->sizeInBytes = gpuGetTextureByteCount(&framebuffer->texture);
+    entry->lastUse = ++cache->clock;
+    cache->stats.cachedBytes += entry->sizeInBytes;
+    cache->stats.cachedResults++;
+    
+    gpuTrimResultCache(cache, (int32_t)cache->entryCount - 1);
+    
+    return GPUStatusOK;
+}
+
+/* Describes rendering the input through passCount programs in a probe
+   entry, whose pass keys the caller frees unless it adds the entry. */
+static GPUStatus gpuGetResultKey(GPUTexture *input, uint32_t width, uint32_t height, GPUPixelFormat pixelFormat,
+                                 GPUProgram *programs, uint32_t passCount, GPUResultCacheEntry *probe)
+{
+    memset(probe, 0, sizeof(GPUResultCacheEntry));
+    probe->passKeys = malloc(2 * passCount * sizeof(uint64_t));
+    if (probe->passKeys == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    probe->inputGeneration = input->generation;
+    probe->width = width;
+    probe->height = height;
+    probe->pixelFormat = pixelFormat;
+    probe->passCount = passCount;
+    for (uint32_t i = 0; i < passCount; i++) {
+        probe->passKeys[2 * i] = programs[i].serial;
+        probe->passKeys[2 * i + 1] = gpuGetProgramStateHash(&programs[i]);
+    }
+    
+    uint64_t key = gpuHashBytes64(GPU_HASH_SEED, &input->generation, sizeof(input->generation));
+    key = gpuHashBytes64(key, &width, sizeof(width));
+    key = gpuHashBytes64(key, &height, sizeof(height));
+    key = gpuHashBytes64(key, &pixelFormat, sizeof(pixelFormat));
+    probe->key = gpuHashBytes64(key, probe->passKeys, 2 * passCount * sizeof(uint64_t));
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuRenderTextureCached(GPUResultCache *cache, GPUTexture *texture,
+                                 GPUProgram *program, uint32_t width, uint32_t height,
+                                 GPUFramebuffer *output)
+{
+    return gpuRenderTextureCachedWithFormat(cache, texture, program, width, height, GPUPixelFormatRGBA8, output);
+}
+
+GPUStatus gpuRenderTextureCachedWithFormat(GPUResultCache *cache, GPUTexture *texture,
+                                           GPUProgram *program, uint32_t width, uint32_t height,
+                                           GPUPixelFormat pixelFormat, GPUFramebuffer *output)
+{
+    if (!cache->valid) {
+        return GPUStatusInvalidResultCache;
+    }
+    if (!program->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPUResultCacheEntry probe;
+    GPUStatus status = gpuGetResultKey(texture, width, height, pixelFormat, program, 1, &probe);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    if (gpuFindCachedResult(cache, &probe, output)) {
+        free(probe.passKeys);
+        return GPUStatusOK;
+    }
+    
+    GPUFramebuffer framebuffer;
+    status = gpuCreateFramebufferWithFormat(width, height, pixelFormat, &framebuffer);
+    if (status == GPUStatusOK) {
+        status = gpuRenderTextureToFramebufferUsingProgram(texture, &framebuffer, program);
+        if (status != GPUStatusOK) {
+            gpuDestroyFramebuffer(&framebuffer);
+        }
+    }
+    if (status == GPUStatusOK) {
+        *output = framebuffer;
+        status = gpuAddCachedResult(cache, &probe, &framebuffer);
+    } else {
+        free(probe.passKeys);
+    }
+    
+    return status;
+}
+
+GPUStatus gpuRunFilterChainCached(GPUResultCache *cache, GPUFilterChain *chain,
+                                  GPUTexture *input, uint32_t width, uint32_t height,
+                                  GPUFramebuffer *output)
+{
+    return gpuRunFilterChainCachedWithFormat(cache, chain, input, width, height, GPUPixelFormatRGBA8, output);
+}
+
+GPUStatus gpuRunFilterChainCachedWithFormat(GPUResultCache *cache, GPUFilterChain *chain,
+                                            GPUTexture *input, uint32_t width, uint32_t height,
+                                            GPUPixelFormat pixelFormat, GPUFramebuffer *output)
+{
+    if (!cache->valid) {
+        return GPUStatusInvalidResultCache;
+    }
+    if (!chain->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!input->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPUResultCacheEntry probe;
+    GPUStatus status = gpuGetResultKey(input, width, height, pixelFormat, chain->passes, chain->passCount, &probe);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    if (gpuFindCachedResult(cache, &probe, output)) {
+        free(probe.passKeys);
+        return GPUStatusOK;
+    }
+    
+    GPUFramebuffer framebuffer;
+    status = gpuCreateFramebufferWithFormat(width, height, pixelFormat, &framebuffer);
+    if (status == GPUStatusOK) {
+        status = gpuRunFilterChain(chain, input, &framebuffer);
+        if (status != GPUStatusOK) {
+            gpuDestroyFramebuffer(&framebuffer);
+        }
+    }
+    if (status == GPUStatusOK) {
+        *output = framebuffer;
+        status = gpuAddCachedResult(cache, &probe, &framebuffer);
+    } else {
+        free(probe.passKeys);
+    }
+    
+    return status;
+}
+
+/* Grows the region by radius on every side, clipped to the image. Empty
+   regions stay empty. */
+static GPURect gpuExpandRect(GPURect rect, uint32_t radius, uint32_t width, uint32_t height)
+{
+    if (rect.width == 0 || rect.height == 0) {
+        rect.width = 0;
+        rect.height = 0;
+        return rect;
+    }
+    uint64_t right = (uint64_t)rect.x + rect.width + radius;
+    uint64_t bottom = (uint64_t)rect.y + rect.height + radius;
+    right = right < width ? right : width;
+    bottom = bottom < height ? bottom : height;
+    rect.x = rect.x > radius ? rect.x - radius : 0;
+    rect.y = rect.y > radius ? rect.y - radius : 0;
+    rect.x = rect.x < right ? rect.x : (uint32_t)right;
+    rect.y = rect.y < bottom ? rect.y : (uint32_t)bottom;
+    rect.width = (uint32_t)right - rect.x;
+    rect.height = (uint32_t)bottom - rect.y;
+    return rect;
+}
+
+GPUStatus gpuRunFilterChainRegion(GPUFilterChain *chain, GPUTexture *input,
+                                  GPUFramebuffer *output, const GPURect *dirty,
+                                  GPURect *updated)
+{
+    if (!chain->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!output->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    uint32_t width = output->texture.width;
+    uint32_t height = output->texture.height;
+    if (chain->retainedBuffers == NULL && chain->passCount > 1) {
+        chain->retainedBuffers = calloc(chain->passCount - 1, sizeof(GPUFramebuffer));
+        if (chain->retainedBuffers == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+    }
+    
+    // Every pass keeps its own image, so what lies outside the redrawn
+    // regions is still the last run's.
+    int full = !chain->retainedValid || chain->retainedOutputId != output->framebufferId;
+    for (uint32_t i = 0; i + 1 < chain->passCount; i++) {
+        GPUFramebuffer *buffer = &chain->retainedBuffers[i];
+        full |= !buffer->valid || buffer->texture.width != width || buffer->texture.height != height ||
+                buffer->texture.pixelFormat != output->texture.pixelFormat;
+        GPUStatus status = gpuEnsureFramebuffer(width, height, output->texture.pixelFormat,
+                                                GPUTextureFilterNearest, buffer);
+        if (status != GPUStatusOK) {
+            chain->retainedValid = 0;
+            return status;
+        }
+    }
+    
+    GPURect region = { 0, 0, width, height };
+    if (!full) {
+        region = gpuExpandRect(*dirty, 0, width, height);
+    }
+    
+    GPUStatus status = GPUStatusOK;
+    GPUTexture *source = input;
+    for (uint32_t i = 0; i < chain->passCount && status == GPUStatusOK; i++) {
+        GPUFramebuffer *target = i + 1 == chain->passCount ? output : &chain->retainedBuffers[i];
+        region = gpuExpandRect(region, chain->passes[i].haloRadius, width, height);
+        GPU_STATS_SET_PASS("chain pass", i);
+        status = gpuRenderTextureToFramebufferRegionUsingProgram(source, target, &chain->passes[i], &region);
+        GPU_STATS_SET_PASS(NULL, 0);
+        source = &target->texture;
+    }
+    
+    chain->retainedValid = status == GPUStatusOK;
+    chain->retainedOutputId = output->framebufferId;
+    if (updated != NULL) {
+        *updated = region;
+    }
+    
+    return status;
+}
+
+#pragma mark - Convolution
+
+// Taps are passed as (offset, weight) pairs, two to a vec4.
+#define GPU_MAX_CONVOLUTION_PAIRS 32
+
+static const char *kGPUConvolutionFragmentShaderCode = SHADER_STRING
+(
+ varying vec2 uv;
+ 
+ uniform sampler2D texture;
+ uniform vec2 gpuTexelStep;
+ uniform float gpuCenterWeight;
+ uniform int gpuPairCount;
+ uniform vec4 gpuTaps[16];
+ 
+ void main() {
+     vec4 sum = gpuCenterWeight * texture2D(texture, uv);
+     for (int i = 0; i < 16; i++) {
+         if (2 * i >= gpuPairCount) {
+             break;
+         }
+         vec4 taps = gpuTaps[i];
+         sum += taps.y * (texture2D(texture, uv + taps.x * gpuTexelStep) + texture2D(texture, uv - taps.x * gpuTexelStep));
+         sum += taps.w * (texture2D(texture, uv + taps.z * gpuTexelStep) + texture2D(texture, uv - taps.z * gpuTexelStep));
+     }
+     gl_FragColor = sum;
+ }
+ );
+
+// Averages four linearly filtered fetches around each output texel. Half a
+// source texel out they cover the 2x2 texels underneath, three quarters
+// out they make the smoother [1 3 3 1] tent.
+static const char *kGPUDownsampleFragmentShaderCode = SHADER_STRING
+(
+ varying vec2 uv;
+ 
+ uniform sampler2D texture;
+ uniform vec2 gpuSampleOffset;
+ 
+ void main() {
+     vec2 d = gpuSampleOffset;
+     gl_FragColor = 0.25 * (texture2D(texture, uv + vec2(-d.x, -d.y)) + texture2D(texture, uv + vec2(d.x, -d.y)) +
+                            texture2D(texture, uv + vec2(-d.x, d.y)) + texture2D(texture, uv + vec2(d.x, d.y)));
+ }
+ );
+
+static GPUStatus gpuCreateConvolutionPrograms(GPUConvolution *convolution)
+{
+    GPUStatus status = gpuCompileInternalProgram(kGPUConvolutionFragmentShaderCode, &convolution->program);
+    if (status == GPUStatusOK) {
+        status = gpuCompileInternalProgram(kGPUDownsampleFragmentShaderCode, &convolution->downsampleProgram);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuCompileProgram(kGPUDefaultVertexShaderCode, kGPUDefaultFragmentShaderCode, &convolution->upsampleProgram, NULL);
+    }
+    if (status != GPUStatusOK) {
+        gpuDestroyProgram(&convolution->program);
+        gpuDestroyProgram(&convolution->downsampleProgram);
+        return status;
+    }
+    
+    convolution->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuCreateConvolution(const float *weights, uint32_t radius, GPUConvolution *convolution)
+{
+    memset(convolution, 0, sizeof(GPUConvolution));
+    
+    if (radius == 0 || radius > GPU_MAX_CONVOLUTION_RADIUS) {
+        return GPUStatusInvalidKernel;
+    }
+    
+    convolution->kernelType = GPUKernelTypeCustom;
+    convolution->radius = radius;
+    memcpy(convolution->weights, weights, (radius + 1) * sizeof(float));
+    
+    return gpuCreateConvolutionPrograms(convolution);
+}
+
+GPUStatus gpuCreateGaussianConvolution(float sigma, GPUConvolution *convolution)
+{
+    memset(convolution, 0, sizeof(GPUConvolution));
+    
+    if (!(sigma > 0.0f)) {
+        return GPUStatusInvalidKernel;
+    }
+    
+    convolution->kernelType = GPUKernelTypeGaussian;
+    convolution->sigma = sigma;
+    convolution->radius = (uint32_t)ceilf(3.0f * sigma);
+    
+    return gpuCreateConvolutionPrograms(convolution);
+}
+
+GPUStatus gpuCreateBoxConvolution(uint32_t radius, GPUConvolution *convolution)
+{
+    memset(convolution, 0, sizeof(GPUConvolution));
+    
+    if (radius == 0) {
+        return GPUStatusInvalidKernel;
+    }
+    
+    convolution->kernelType = GPUKernelTypeBox;
+    convolution->radius = radius;
+    
+    return gpuCreateConvolutionPrograms(convolution);
+}
+
+void gpuDestroyConvolution(GPUConvolution *convolution)
+{
+    if (!convolution->valid) {
+        return;
+    }
+    convolution->valid = 0;
+    
+    for (uint32_t i = 0; i <= GPU_MAX_CONVOLUTION_LEVELS; i++) {
+        gpuDestroyFramebuffer(&convolution->buffers[i]);
+    }
+    gpuDestroyProgram(&convolution->program);
+    gpuDestroyProgram(&convolution->downsampleProgram);
+    gpuDestroyProgram(&convolution->upsampleProgram);
+}
+
+/* One side of the kernel, weights[0] being the center, as it applies at
+   a resolution reduced by scale. Returns the radius. */
+static uint32_t gpuGetConvolutionWeights(GPUConvolution *convolution, uint32_t scale, float *weights)
+{
+    if (convolution->kernelType == GPUKernelTypeCustom) {
+        memcpy(weights, convolution->weights, (convolution->radius + 1) * sizeof(float));
+        return convolution->radius;
+    }
+    
+    uint32_t radius;
+    if (convolution->kernelType == GPUKernelTypeGaussian) {
+        float sigma = convolution->sigma / scale;
+        radius = (uint32_t)ceilf(3.0f * sigma);
+        for (uint32_t i = 0; i <= radius; i++) {
+            weights[i] = expf(-(float)(i * i) / (2.0f * sigma * sigma));
+        }
+    } else {
+        radius = (convolution->radius + scale / 2) / scale;
+        radius = radius > 0 ? radius : 1;
+        for (uint32_t i = 0; i <= radius; i++) {
+            weights[i] = 1.0f;
+        }
+    }
+    
+    float sum = weights[0];
+    for (uint32_t i = 1; i <= radius; i++) {
+        sum += 2.0f * weights[i];
+    }
+    for (uint32_t i = 0; i <= radius; i++) {
+        weights[i] /= sum;
+    }
+    
+    return radius;
+}
+
+/* Turns one side of the kernel into (offset, weight) pairs. With linear
+   filtering two neighbouring taps of the same sign become one fetch
+   between them, weighted so the texture unit blends them exactly. */
+static uint32_t gpuGetConvolutionTaps(const float *weights, uint32_t radius, int linear, float *taps)
+{
+    uint32_t pairCount = 0;
+    for (uint32_t i = 1; i <= radius; i++) {
+        float weight = weights[i];
+        float next = i < radius ? weights[i + 1] : 0.0f;
+        if (linear && i < radius && weight * next > 0.0f) {
+            taps[pairCount * 2] = (i * weight + (i + 1) * next) / (weight + next);
+            taps[pairCount * 2 + 1] = weight + next;
+            i++;
+        } else {
+            taps[pairCount * 2] = (float)i;
+            taps[pairCount * 2 + 1] = weight;
+        }
+        pairCount++;
+    }
+    return pairCount;
+}
+
+static GPUStatus gpuRunConvolutionPass(GPUConvolution *convolution, GPUTexture *source, GPUFramebuffer *target,
+                                       float stepX, float stepY, float centerWeight, uint32_t pairCount, const float *taps)
+{
+    GPUProgram *program = &convolution->program;
+    GPUStatus status = gpuSet2FloatsForProgram("gpuTexelStep", stepX / source->width, stepY / source->height, program);
+    if (status == GPUStatusOK) {
+        status = gpuSetFloatForProgram("gpuCenterWeight", centerWeight, program);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuSetIntForProgram("gpuPairCount", (int32_t)pairCount, program);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuSetVector4ArrayForProgram("gpuTaps", GPU_MAX_CONVOLUTION_PAIRS / 2, taps, program);
+    }
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuRenderTextureToFramebufferUsingProgram(source, target, program);
+}
+
+GPUStatus gpuRunConvolution(GPUConvolution *convolution, GPUTexture *input, GPUFramebuffer *output)
+{
+    if (!convolution->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!input->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    if (!output->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    GPUPixelFormat pixelFormat = output->texture.pixelFormat;
+    int linear = gpuIsPixelFormatFilterable(input->pixelFormat) && gpuIsPixelFormatFilterable(pixelFormat);
+    
+    // Large kernels run on a downsampled copy, where they are small.
+    uint32_t levelCount = 0;
+    while ((convolution->radius + (1u << levelCount) - 1) >> levelCount > GPU_MAX_CONVOLUTION_RADIUS) {
+        levelCount++;
+    }
+    if (levelCount > GPU_MAX_CONVOLUTION_LEVELS) {
+        return GPUStatusInvalidKernel;
+    }
+    if (levelCount > 0 && !linear) {
+        return GPUStatusUnsupportedFormat;
+    }
+    
+    uint32_t width = output->texture.width;
+    uint32_t height = output->texture.height;
+    GPUStatus status = GPUStatusOK;
+    GPUTexture *source = input;
+    for (uint32_t level = 1; level <= levelCount && status == GPUStatusOK; level++) {
+        width = (width + 1) / 2;
+        height = (height + 1) / 2;
+        status = gpuEnsureFramebuffer(width, height, pixelFormat, GPUTextureFilterLinear, &convolution->buffers[level]);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuEnsureFramebuffer(width, height, pixelFormat, GPUTextureFilterLinear, &convolution->buffers[0]);
+    }
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    GPUTextureFilter inputFilter = input->filter;
+    if (linear) {
+        gpuSetTextureFiltering(input, GPUTextureFilterLinear);
+    }
+    
+    for (uint32_t level = 1; level <= levelCount && status == GPUStatusOK; level++) {
+        GPUFramebuffer *target = &convolution->buffers[level];
+        status = gpuSet2FloatsForProgram("gpuSampleOffset", 0.5f / source->width, 0.5f / source->height, &convolution->downsampleProgram);
+        if (status == GPUStatusOK) {
+            status = gpuRenderTextureToFramebufferUsingProgram(source, target, &convolution->downsampleProgram);
+        }
+        source = &target->texture;
+    }
+    
+    float weights[GPU_MAX_CONVOLUTION_RADIUS + 1];
+    float taps[GPU_MAX_CONVOLUTION_PAIRS * 2] = { 0.0f };
+    uint32_t radius = gpuGetConvolutionWeights(convolution, 1u << levelCount, weights);
+    uint32_t pairCount = gpuGetConvolutionTaps(weights, radius, linear, taps);
+    
+    GPUFramebuffer *blurred = levelCount > 0 ? &convolution->buffers[levelCount] : output;
+    if (status == GPUStatusOK) {
+        status = gpuRunConvolutionPass(convolution, source, &convolution->buffers[0], 1.0f, 0.0f, weights[0], pairCount, taps);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuRunConvolutionPass(convolution, &convolution->buffers[0].texture, blurred, 0.0f, 1.0f, weights[0], pairCount, taps);
+    }
+    if (status == GPUStatusOK && levelCount > 0) {
+        status = gpuRenderTextureToFramebufferUsingProgram(&blurred->texture, output, &convolution->upsampleProgram);
+    }
+    
+    if (linear && inputFilter != GPUTextureFilterLinear) {
+        gpuSetTextureFiltering(input, inputFilter);
+    }
+    
+    return status;
+}
+
+#pragma mark - Pyramid
+
+#if GPU_HAVE_GL3
+/* Limits sampling to one level, so that the others can be rendered into
+   while it is read. */
+static void gpuSelectPyramidLevel(GPUPyramid *pyramid, uint32_t level)
+{
+    if (pyramid->sampledLevel == level) {
+        return;
+    }
+    gpuSelectTexture(GL_TEXTURE_2D, pyramid->textureId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, (GLint)level);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, (GLint)level);
+    pyramid->sampledLevel = level;
+}
+
+GPUStatus gpuCreatePyramid(uint32_t width, uint32_t height, uint32_t levelCount,
+                           GPUPixelFormat pixelFormat, GPUPyramid *pyramid)
+{
+    memset(pyramid, 0, sizeof(GPUPyramid));
+    
+    GLenum internalFormat, format, type;
+    if (!gpuGetPixelFormatInfo(pixelFormat, &internalFormat, &format, &type) ||
+        !gpuIsPixelFormatFilterable(pixelFormat)) {
+        return GPUStatusUnsupportedFormat;
+    }
+#if GPU_OPENGL_ES
+    // Levels other than the first can only be rendered into since ES 3.
+    if (gpuGetCapabilities()->majorVersion < 3) {
+        return GPUStatusUnsupportedFormat;
+    }
+#endif
+    if (width == 0 || height == 0 || levelCount == 0 || levelCount > GPU_MAX_PYRAMID_LEVELS) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    // The chain ends at 1x1.
+    while (levelCount > 1 && (width >> (levelCount - 1)) == 0 && (height >> (levelCount - 1)) == 0) {
+        levelCount--;
+    }
+    
+    GPUStatus status = gpuCompileInternalProgram(kGPUDownsampleFragmentShaderCode, &pyramid->downsampleProgram);
+    if (status == GPUStatusOK) {
+        status = gpuCompileProgram(kGPUDefaultVertexShaderCode, kGPUDefaultFragmentShaderCode, &pyramid->upsampleProgram, NULL);
+    }
+    if (status != GPUStatusOK) {
+        gpuDestroyProgram(&pyramid->downsampleProgram);
+        return status;
+    }
+    
+    glGenTextures(1, &pyramid->textureId);
+    gpuSelectTexture(GL_TEXTURE_2D, pyramid->textureId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    
+    uint32_t immutable = 0;
+#if GPU_HAVE_TEXTURE_STORAGE
+    if (gpuGetCapabilities()->textureStorage && internalFormat != format) {
+        glTexStorage2D(GL_TEXTURE_2D, (GLsizei)levelCount, internalFormat, width, height);
+        immutable = 1;
+    } else
+#endif
+    {
+        for (uint32_t level = 0; level < levelCount; level++) {
+            uint32_t levelWidth = width >> level > 0 ? width >> level : 1;
+            uint32_t levelHeight = height >> level > 0 ? height >> level : 1;
+            glTexImage2D(GL_TEXTURE_2D, (GLint)level, internalFormat, levelWidth, levelHeight, 0, format, type, NULL);
+        }
+    }
+    
+    if (glGetError() != GL_NO_ERROR) {
+        gpuDeleteTexture(pyramid->textureId);
+        gpuDestroyProgram(&pyramid->downsampleProgram);
+        gpuDestroyProgram(&pyramid->upsampleProgram);
+        return GPUStatusUnknownError;
+    }
+    
+    pyramid->pixelFormat = pixelFormat;
+    pyramid->valid = 1;
+    
+    for (uint32_t level = 0; level < levelCount; level++) {
+        GPUFramebuffer *framebuffer = &pyramid->levels[level];
+        framebuffer->texture.textureId = pyramid->textureId;
+        framebuffer->texture.width = width >> level > 0 ? width >> level : 1;
+        framebuffer->texture.height = height >> level > 0 ? height >> level : 1;
+        framebuffer->texture.storageFormat = internalFormat;
+        framebuffer->texture.immutable = immutable;
+        framebuffer->texture.pixelFormat = pixelFormat;
+        framebuffer->texture.filter = GPUTextureFilterLinear;
+        framebuffer->texture.generation = gpuNextTextureGeneration();
+        
+        glGenFramebuffers(1, &framebuffer->framebufferId);
+        gpuBindFramebuffer(framebuffer->framebufferId);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, pyramid->textureId, (GLint)level);
+        if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+            fprintf(stderr, "Failed to make complete framebuffer object %x\n", glCheckFramebufferStatus(GL_FRAMEBUFFER));
+            gpuDeleteFramebuffer(framebuffer->framebufferId);
+            gpuDestroyPyramid(pyramid);
+            return GPUStatusFailedToMakeFramebufferObjectError;
+        }
+        
+        framebuffer->valid = 1;
+        framebuffer->texture.valid = 1;
+        pyramid->levelCount = level + 1;
+    }
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyPyramid(GPUPyramid *pyramid)
+{
+    if (!pyramid->valid) {
+        return;
+    }
+    pyramid->valid = 0;
+    
+    for (uint32_t level = 0; level < pyramid->levelCount; level++) {
+        pyramid->levels[level].valid = 0;
+        pyramid->levels[level].texture.valid = 0;
+        gpuDeleteFramebuffer(pyramid->levels[level].framebufferId);
+    }
+    gpuDeleteTexture(pyramid->textureId);
+    gpuDestroyProgram(&pyramid->downsampleProgram);
+    gpuDestroyProgram(&pyramid->upsampleProgram);
+}
+
+GPUTexture *gpuGetPyramidLevelTexture(GPUPyramid *pyramid, uint32_t level)
+{
+    if (!pyramid->valid || level >= pyramid->levelCount) {
+        return NULL;
+    }
+    gpuSelectPyramidLevel(pyramid, level);
+    return &pyramid->levels[level].texture;
+}
+
+GPUFramebuffer *gpuGetPyramidLevelFramebuffer(GPUPyramid *pyramid, uint32_t level)
+{
+    if (!pyramid->valid || level >= pyramid->levelCount) {
+        return NULL;
+    }
+    return &pyramid->levels[level];
+}
+
+/* Blends level + 1, upsampled, into level. */
+static GPUStatus gpuBlendPyramidLevels(GPUPyramid *pyramid, uint32_t level)
+{
+    GPUTexture *source = gpuGetPyramidLevelTexture(pyramid, level + 1);
+    return gpuRenderTextureToFramebufferUsingProgram(source, &pyramid->levels[level], &pyramid->upsampleProgram);
+}
+
+GPUStatus gpuBuildPyramid(GPUTexture *input, GPUPyramidType type, GPUPyramid *pyramid)
+{
+    if (!pyramid->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (!input->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    // Laplacian levels are signed and are built and collapsed by blending.
+    if (type == GPUPyramidTypeLaplacian &&
+        !(pyramid->pixelFormat == GPUPixelFormatRGBA16F ||
+          (pyramid->pixelFormat == GPUPixelFormatRGBA32F && gpuGetCapabilities()->floatBlend))) {
+        return GPUStatusUnsupportedFormat;
+    }
+    
+    GPUStatus status = gpuRenderTextureToFramebufferUsingProgram(input, &pyramid->levels[0], &pyramid->upsampleProgram);
+    
+    for (uint32_t level = 1; level < pyramid->levelCount && status == GPUStatusOK; level++) {
+        GPUTexture *source = gpuGetPyramidLevelTexture(pyramid, level - 1);
+        status = gpuSet2FloatsForProgram("gpuSampleOffset", 0.75f / source->width, 0.75f / source->height, &pyramid->downsampleProgram);
+        if (status == GPUStatusOK) {
+            status = gpuRenderTextureToFramebufferUsingProgram(source, &pyramid->levels[level], &pyramid->downsampleProgram);
+        }
+    }
+    
+    if (type == GPUPyramidTypeLaplacian) {
+        // Bottom up, so the level subtracted is still the Gaussian one. The
+        // last level keeps the low frequencies.
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glBlendEquation(GL_FUNC_REVERSE_SUBTRACT);
+        for (uint32_t level = 0; level + 1 < pyramid->levelCount && status == GPUStatusOK; level++) {
+            status = gpuBlendPyramidLevels(pyramid, level);
+        }
+        glBlendEquation(GL_FUNC_ADD);
+        glDisable(GL_BLEND);
+    }
+    
+    pyramid->type = status == GPUStatusOK ? type : GPUPyramidTypeGaussian;
+    
+    return status;
+}
+
+GPUStatus gpuCollapsePyramid(GPUPyramid *pyramid)
+{
+    if (!pyramid->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (pyramid->type != GPUPyramidTypeLaplacian) {
+        return GPUStatusOK;
+    }
+    
+    // Top down, adding each reconstructed level to the details below it.
+    GPUStatus status = GPUStatusOK;
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    for (uint32_t level = pyramid->levelCount - 1; level > 0 && status == GPUStatusOK; level--) {
+        status = gpuBlendPyramidLevels(pyramid, level - 1);
+    }
+    glDisable(GL_BLEND);
+    
+    pyramid->type = GPUPyramidTypeGaussian;
+    
+    return status;
+}
+#else
+GPUStatus gpuCreatePyramid(uint32_t width, uint32_t height, uint32_t levelCount,
+                           GPUPixelFormat pixelFormat, GPUPyramid *pyramid)
+{
+    memset(pyramid, 0, sizeof(GPUPyramid));
+    return GPUStatusUnsupportedFormat;
+}
+
+void gpuDestroyPyramid(GPUPyramid *pyramid)
+{
+}
+
+GPUTexture *gpuGetPyramidLevelTexture(GPUPyramid *pyramid, uint32_t level)
+{
+    return NULL;
+}
+
+GPUFramebuffer *gpuGetPyramidLevelFramebuffer(GPUPyramid *pyramid, uint32_t level)
+{
+    return NULL;
+}
+
+GPUStatus gpuBuildPyramid(GPUTexture *input, GPUPyramidType type, GPUPyramid *pyramid)
+{
+    return GPUStatusUnsupportedFormat;
+}
+
+GPUStatus gpuCollapsePyramid(GPUPyramid *pyramid)
+{
+    return GPUStatusUnsupportedFormat;
+}
+#endif
+
+#pragma mark - Reduction
+
+#define GPU_REDUCTION_FACTOR 4
+
+// Combines the up to 4x4 source texels under each output texel. The first
+// pass also applies gpuScale, which turns a sum into a mean.
+static const char *kGPUReductionFragmentShaderCode = SHADER_STRING
+(
+ varying vec2 uv;
+ 
+ uniform sampler2D texture;
+ uniform vec2 gpuSourceSize;
+ uniform float gpuScale;
+ 
+ void main() {
+     vec2 origin = floor(gl_FragCoord.xy) * 4.0;
+     vec4 result = gpuScale * texture2D(texture, (origin + 0.5) / gpuSourceSize);
+     for (int j = 0; j < 4; j++) {
+         for (int i = 0; i < 4; i++) {
+             vec2 position = origin + vec2(float(i), float(j));
+             if ((i > 0 || j > 0) && position.x < gpuSourceSize.x && position.y < gpuSourceSize.y) {
+                 result = GPU_REDUCE(result, gpuScale * texture2D(texture, (position + 0.5) / gpuSourceSize));
+             }
+         }
+     }
+     gl_FragColor = result;
+ }
+ );
+
+GPUStatus gpuCreateReduction(GPUReductionOperation operation, GPUReduction *reduction)
+{
+    memset(reduction, 0, sizeof(GPUReduction));
+    
+    const char *define;
+    switch (operation) {
+        case GPUReductionOperationMin: define = "#define GPU_REDUCE(a, b) min(a, b)\n"; break;
+        case GPUReductionOperationMax: define = "#define GPU_REDUCE(a, b) max(a, b)\n"; break;
+        case GPUReductionOperationSum:
+        case GPUReductionOperationMean: define = "#define GPU_REDUCE(a, b) ((a) + (b))\n"; break;
+        default: return GPUStatusInvalidProgram;
+    }
+    
+    size_t length = strlen(define) + strlen(kGPUReductionFragmentShaderCode) + 1;
+    char *code = malloc(length);
+    if (code == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    snprintf(code, length, "%s%s", define, kGPUReductionFragmentShaderCode);
+    
+    GPUStatus status = gpuCompileInternalProgram(code, &reduction->program);
+    free(code);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    reduction->operation = operation;
+    reduction->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyReduction(GPUReduction *reduction)
+{
+    if (!reduction->valid) {
+        return;
+    }
+    reduction->valid = 0;
+    
+    for (uint32_t level = 0; level < GPU_MAX_REDUCTION_LEVELS; level++) {
+        gpuDestroyFramebuffer(&reduction->levels[level]);
+    }
+    gpuDestroyProgram(&reduction->program);
+}
+
+GPUStatus gpuRunReduction(GPUReduction *reduction, GPUTexture *input)
+{
+    if (!reduction->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!input->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPUProgram *program = &reduction->program;
+    float scale = 1.0f;
+    if (reduction->operation == GPUReductionOperationMean) {
+        scale = 1.0f / ((float)input->width * (float)input->height);
+    }
+    
+    // Float levels keep sums exact well beyond 8 bits.
+    GPUStatus status = GPUStatusOK;
+    GPUTexture *source = input;
+    uint32_t level = 0;
+    do {
+        if (level == GPU_MAX_REDUCTION_LEVELS) {
+            return GPUStatusInvalidTexture;
+        }
+        GPUFramebuffer *target = &reduction->levels[level];
+        uint32_t width = (source->width + GPU_REDUCTION_FACTOR - 1) / GPU_REDUCTION_FACTOR;
+        uint32_t height = (source->height + GPU_REDUCTION_FACTOR - 1) / GPU_REDUCTION_FACTOR;
+        status = gpuEnsureFramebuffer(width, height, GPUPixelFormatRGBA32F, GPUTextureFilterNearest, target);
+        if (status == GPUStatusOK) {
+            status = gpuSet2FloatsForProgram("gpuSourceSize", (float)source->width, (float)source->height, program);
+        }
+        if (status == GPUStatusOK) {
+            status = gpuSetFloatForProgram("gpuScale", level == 0 ? scale : 1.0f, program);
+        }
+        if (status == GPUStatusOK) {
+            status = gpuRenderTextureToFramebufferUsingProgram(source, target, program);
+        }
+        source = &target->texture;
+        level++;
+    } while (status == GPUStatusOK && (source->width > 1 || source->height > 1));
+    
+    // Levels left over from a larger input.
+    reduction->levelCount = level;
+    for (; level < GPU_MAX_REDUCTION_LEVELS; level++) {
+        gpuDestroyFramebuffer(&reduction->levels[level]);
+    }
+    
+    return status;
+}
+
+GPUTexture *gpuGetReductionTexture(GPUReduction *reduction)
+{
+    if (!reduction->valid || reduction->levelCount == 0) {
+        return NULL;
+    }
+    return &reduction->levels[reduction->levelCount - 1].texture;
+}
+
+GPUStatus gpuGetReductionResult(GPUReduction *reduction, float result[4])
+{
+    if (!reduction->valid || reduction->levelCount == 0) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    return gpuGetFramebufferContents(&reduction->levels[reduction->levelCount - 1], (uint8_t *)result, GPUColorFormatRGBA);
+}
+
+#if GPU_HAVE_GL3
+// Every pixel is drawn as four points, one per channel, into the bin its
+// value falls in; blending adds them up.
+#if !GPU_OPENGL_ES
+static const char *kGPUHistogramVertexShaderCode = "#version 130\n" SHADER_STRING
+(
+ uniform sampler2D inputTexture;
+ uniform int gpuWidth;
+ 
+ out vec4 gpuChannelMask;
+ 
+ void main() {
+     int pixel = gl_VertexID / 4;
+     int channel = gl_VertexID - pixel * 4;
+     vec4 color = texelFetch(inputTexture, ivec2(pixel % gpuWidth, pixel / gpuWidth), 0);
+     float bin = floor(clamp(color[channel], 0.0, 1.0) * 255.0 + 0.5);
+     gl_Position = vec4((bin + 0.5) / 128.0 - 1.0, 0.0, 0.0, 1.0);
+     gl_PointSize = 1.0;
+     gpuChannelMask = vec4(equal(ivec4(0, 1, 2, 3), ivec4(channel)));
+ }
+ );
+
+static const char *kGPUHistogramFragmentShaderCode = "#version 130\n" SHADER_STRING
+(
+ in vec4 gpuChannelMask;
+ 
+ void main() {
+     gl_FragColor = gpuChannelMask;
+ }
+ );
+#else
+static const char *kGPUHistogramVertexShaderCode = "#version 300 es\n" SHADER_STRING
+(
+ uniform highp sampler2D inputTexture;
+ uniform int gpuWidth;
+ 
+ out vec4 gpuChannelMask;
+ 
+ void main() {
+     int pixel = gl_VertexID / 4;
+     int channel = gl_VertexID - pixel * 4;
+     vec4 color = texelFetch(inputTexture, ivec2(pixel % gpuWidth, pixel / gpuWidth), 0);
+     float bin = floor(clamp(color[channel], 0.0, 1.0) * 255.0 + 0.5);
+     gl_Position = vec4((bin + 0.5) / 128.0 - 1.0, 0.0, 0.0, 1.0);
+     gl_PointSize = 1.0;
+     gpuChannelMask = vec4(equal(ivec4(0, 1, 2, 3), ivec4(channel)));
+ }
+ );
+
+static const char *kGPUHistogramFragmentShaderCode = "#version 300 es\n" SHADER_STRING
+(
+ precision highp float;
+ 
+ in vec4 gpuChannelMask;
+ out vec4 gpuFragColor;
+ 
+ void main() {
+     gpuFragColor = gpuChannelMask;
+ }
+ );
+#endif
+
+GPUStatus gpuCreateHistogram(GPUHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(GPUHistogram));
+    
+    // Counts are summed by blending into a float target.
+    if (!gpuGetCapabilities()->floatBlend) {
+        return GPUStatusUnsupportedFormat;
+    }
+    
+    GPUStatus status = gpuCreateFramebufferWithFormat(GPU_HISTOGRAM_BIN_COUNT, 1, GPUPixelFormatRGBA32F, &histogram->bins);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    status = gpuCompileProgram(kGPUHistogramVertexShaderCode, kGPUHistogramFragmentShaderCode, &histogram->program, NULL);
+    if (status != GPUStatusOK) {
+        gpuDestroyFramebuffer(&histogram->bins);
+        return status;
+    }
+    
+    histogram->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyHistogram(GPUHistogram *histogram)
+{
+    if (!histogram->valid) {
+        return;
+    }
+    histogram->valid = 0;
+    
+    gpuDestroyFramebuffer(&histogram->bins);
+    gpuDestroyProgram(&histogram->program);
+}
+
+GPUStatus gpuRunHistogram(GPUHistogram *histogram, GPUTexture *input)
+{
+    if (!histogram->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!input->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    // Four points per pixel have to fit a GLsizei.
+    uint64_t pointCount = (uint64_t)input->width * input->height * 4;
+    if (pointCount > 0x7fffffff) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPUProgram *program = &histogram->program;
+    GPUStatus status = gpuSetIntForProgram("gpuWidth", (int32_t)input->width, program);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    gpuBindFramebuffer(histogram->bins.framebufferId);
+    gpuSetViewport(GPU_HISTOGRAM_BIN_COUNT, 1);
+    glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+    glClear(GL_COLOR_BUFFER_BIT);
+    
+    gpuUseProgram(program->programId);
+    gpuFlushParameters(program);
+    gpuBindTexture(0, GL_TEXTURE_2D, input->textureId);
+    
+    // The points read no attributes, so keep the fullscreen triangle's
+    // arrays from being fetched past their end.
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_ONE, GL_ONE);
+    GPU_STATS_BEGIN_DRAW();
+    glDrawArrays(GL_POINTS, 0, (GLsizei)pointCount);
+    GPU_STATS_END_DRAW();
+    glDisable(GL_BLEND);
+    histogram->bins.texture.generation = gpuNextTextureGeneration();
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    
+    return GPUStatusOK;
+}
+
+GPUTexture *gpuGetHistogramTexture(GPUHistogram *histogram)
+{
+    if (!histogram->valid) {
+        return NULL;
+    }
+    return &histogram->bins.texture;
+}
+
+GPUStatus gpuGetHistogramCounts(GPUHistogram *histogram, uint32_t counts[GPU_HISTOGRAM_BIN_COUNT * 4])
+{
+    if (!histogram->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    float bins[GPU_HISTOGRAM_BIN_COUNT * 4];
+    GPUStatus status = gpuGetFramebufferContents(&histogram->bins, (uint8_t *)bins, GPUColorFormatRGBA);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    for (uint32_t i = 0; i < GPU_HISTOGRAM_BIN_COUNT * 4; i++) {
+        counts[i] = (uint32_t)(bins[i] + 0.5f);
+    }
+    
+    return GPUStatusOK;
+}
+#else
+GPUStatus gpuCreateHistogram(GPUHistogram *histogram)
+{
+    memset(histogram, 0, sizeof(GPUHistogram));
+    return GPUStatusUnsupportedFormat;
+}
+
+void gpuDestroyHistogram(GPUHistogram *histogram)
+{
+}
+
+GPUStatus gpuRunHistogram(GPUHistogram *histogram, GPUTexture *input)
+{
+    return GPUStatusUnsupportedFormat;
+}
+
+GPUTexture *gpuGetHistogramTexture(GPUHistogram *histogram)
+{
+    return NULL;
+}
+
+GPUStatus gpuGetHistogramCounts(GPUHistogram *histogram, uint32_t counts[GPU_HISTOGRAM_BIN_COUNT * 4])
+{
+    return GPUStatusUnsupportedFormat;
+}
+#endif
+
+#pragma mark - Tiled Processing
+
+#define GPU_DEFAULT_TILE_SIZE 2048
+
+void gpuSetProgramHaloRadius(GPUProgram *program, uint32_t radius)
+{
+    program->haloRadius = radius;
+}
+
+/* Uploads a rectangle of a larger image. Rows are addressed through
+   UNPACK_ROW_LENGTH where the GL has it, otherwise copied together. */
+static GPUStatus gpuUploadImageRegion(const uint8_t *pixelData, size_t bytesPerRow,
+                                      uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                      GPUColorFormat colorFormat, uint8_t **scratch,
+                                      GPUTexture *texture)
+{
+    uint32_t bytesPerPixel = colorFormat == GPUColorFormatRGB ? 3 : 4;
+    const uint8_t *origin = pixelData + y * bytesPerRow + x * bytesPerPixel;
+    
+#if GPU_HAVE_GL3
+    if (bytesPerRow % bytesPerPixel == 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(bytesPerRow / bytesPerPixel));
+        GPUStatus status = gpuUploadImageToTexture(width, height, colorFormat, (uint8_t *)origin, texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        return status;
+    }
+#endif
+    
+    size_t rowSize = (size_t)width * bytesPerPixel;
+    if (*scratch == NULL) {
+        *scratch = malloc(rowSize * height);
+        if (*scratch == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+    }
+    for (uint32_t row = 0; row < height; row++) {
+        memcpy(*scratch + row * rowSize, origin + row * bytesPerRow, rowSize);
+    }
+    
+    return gpuUploadImageToTexture(width, height, colorFormat, *scratch, texture);
+}
+
+/* Reads a rectangle of the framebuffer into a larger image. */
+static GPUStatus gpuReadFramebufferRegion(GPUFramebuffer *framebuffer,
+                                          uint32_t x, uint32_t y, uint32_t width, uint32_t height,
+                                          GPUColorFormat colorFormat, uint8_t *outputData,
+                                          size_t outputBytesPerRow, uint8_t **scratch)
+{
+    GLenum pixelFormat, type;
+    uint32_t bytesPerPixel;
+    gpuGetReadbackFormat(framebuffer, colorFormat, &pixelFormat, &type, &bytesPerPixel);
+    
+    GPU_STATS_START(start);
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    
+#if GPU_HAVE_GL3
+    if (outputBytesPerRow % bytesPerPixel == 0 && !gpuNeedsReadbackRepack(pixelFormat, type)) {
+        glPixelStorei(GL_PACK_ROW_LENGTH, (GLint)(outputBytesPerRow / bytesPerPixel));
+        glReadPixels(x, y, width, height, pixelFormat, type, outputData);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        GPU_STATS_RECORD(GPUStatsCategoryReadback, start, (uint64_t)bytesPerPixel * width * height);
+        return glGetError() == GL_NO_ERROR ? GPUStatusOK : GPUStatusUnknownError;
+    }
+#endif
+    
+    size_t rowSize = (size_t)width * bytesPerPixel;
+    if (*scratch == NULL) {
+        *scratch = malloc(rowSize * height);
+        if (*scratch == NULL) {
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            return GPUStatusOutOfMemory;
+        }
+    }
+    GPUStatus status = gpuReadPixels(x, y, width, height, pixelFormat, type, *scratch);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryReadback, start, (uint64_t)bytesPerPixel * width * height);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    for (uint32_t row = 0; row < height; row++) {
+        memcpy(outputData + row * outputBytesPerRow, *scratch + row * rowSize, rowSize);
+    }
+    
+    return GPUStatusOK;
+}
+
+uint32_t gpuGetTileSize(uint32_t tileSize)
+{
+    GLint maxTextureSize = 0;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    if (tileSize == 0) {
+        tileSize = GPU_DEFAULT_TILE_SIZE;
+    }
+    if (maxTextureSize > 0 && tileSize > (uint32_t)maxTextureSize) {
+        tileSize = (uint32_t)maxTextureSize;
+    }
+    return tileSize;
+}
+
+/* Start of the input region for a tile whose output starts at position.
+   The region is kept inside the image, so every tile has the same size
+   and only tiles at the image border lose their halo there, where clamping
+   to the edge gives the same result as a single texture would. */
+static uint32_t gpuGetTileRegionStart(uint32_t position, uint32_t halo, uint32_t regionSize, uint32_t imageSize)
+{
+    uint32_t start = position > halo ? position - halo : 0;
+    return start + regionSize > imageSize ? imageSize - regionSize : start;
+}
+
+GPUStatus gpuRenderImageTiled(uint32_t width, uint32_t height,
+                              GPUColorFormat colorFormat,
+                              const uint8_t *pixelData, size_t bytesPerRow,
+                              GPUProgram **programs, uint32_t programCount,
+                              uint32_t tileSize,
+                              uint8_t *outputData, size_t outputBytesPerRow)
+{
+    return gpuRenderImageTiledWithFormat(width, height, colorFormat, pixelData, bytesPerRow,
+                                         programs, programCount, tileSize, GPUPixelFormatRGBA8,
+                                         outputData, outputBytesPerRow);
+}
+
+GPUStatus gpuRenderImageTiledWithFormat(uint32_t width, uint32_t height,
+                                        GPUColorFormat colorFormat,
+                                        const uint8_t *pixelData, size_t bytesPerRow,
+                                        GPUProgram **programs, uint32_t programCount,
+                                        uint32_t tileSize, GPUPixelFormat pixelFormat,
+                                        uint8_t *outputData, size_t outputBytesPerRow)
+{
+    if (programCount == 0) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    uint32_t halo = 0;
+    for (uint32_t i = 0; i < programCount; i++) {
+        if (!programs[i]->valid) {
+            return GPUStatusInvalidProgram;
+        }
+        halo += programs[i]->haloRadius;
+    }
+    
+    tileSize = gpuGetTileSize(tileSize);
+    
+    // Every tile renders a region of the same size; its inner part, the
+    // step, is what the tile contributes to the output.
+    uint32_t regionWidth = width < tileSize ? width : tileSize;
+    uint32_t regionHeight = height < tileSize ? height : tileSize;
+    if (width == 0 || height == 0 ||
+        ((regionWidth < width || regionHeight < height) && 2 * halo >= tileSize)) {
+        fprintf(stderr, "Tile size %u leaves no room inside a halo of %u pixels.\n", tileSize, halo);
+        return GPUStatusInvalidTileSize;
+    }
+    uint32_t stepX = regionWidth == width ? width : regionWidth - 2 * halo;
+    uint32_t stepY = regionHeight == height ? height : regionHeight - 2 * halo;
+    
+    GPUTexture texture;
+    GPUFramebuffer buffers[3];
+    memset(buffers, 0, sizeof(buffers));
+    uint8_t *uploadScratch = NULL;
+    uint8_t *readScratch = NULL;
+    
+    // Intermediates ping-pong between the first two buffers. The last
+    // program renders into an RGBA8 one for the 8-bit output, which can be
+    // one of those two if they are RGBA8 already.
+    GPUStatus status = gpuCreateTexture(&texture);
+    uint32_t intermediateCount = programCount > 2 ? 2 : programCount - 1;
+    for (uint32_t i = 0; i < intermediateCount && status == GPUStatusOK; i++) {
+        status = gpuCreateFramebufferWithFormat(regionWidth, regionHeight, pixelFormat, &buffers[i]);
+    }
+    GPUFramebuffer *last = &buffers[2];
+    if (pixelFormat == GPUPixelFormatRGBA8 && intermediateCount == 2) {
+        last = &buffers[(programCount - 1) % 2];
+    } else if (status == GPUStatusOK) {
+        status = gpuCreateFramebuffer(regionWidth, regionHeight, last);
+    }
+    
+    uint32_t bytesPerPixel = colorFormat == GPUColorFormatRGB ? 3 : 4;
+    for (uint32_t y = 0; y < height && status == GPUStatusOK; y += stepY) {
+        uint32_t tileHeight = height - y < stepY ? height - y : stepY;
+        uint32_t regionY = gpuGetTileRegionStart(y, halo, regionHeight, height);
+        
+        for (uint32_t x = 0; x < width && status == GPUStatusOK; x += stepX) {
+            uint32_t tileWidth = width - x < stepX ? width - x : stepX;
+            uint32_t regionX = gpuGetTileRegionStart(x, halo, regionWidth, width);
+            
+            status = gpuUploadImageRegion(pixelData, bytesPerRow, regionX, regionY,
+                                          regionWidth, regionHeight, colorFormat,
+                                          &uploadScratch, &texture);
+            
+            GPUFramebuffer *target = NULL;
+            for (uint32_t i = 0; i < programCount && status == GPUStatusOK; i++) {
+                GPUTexture *source = i == 0 ? &texture : &target->texture;
+                target = i + 1 == programCount ? last : &buffers[i % 2];
+                status = gpuRenderTextureToFramebufferUsingProgram(source, target, programs[i]);
+            }
+            
+            if (status == GPUStatusOK) {
+                status = gpuReadFramebufferRegion(target, x - regionX, y - regionY, tileWidth, tileHeight,
+                                                  colorFormat,
+                                                  outputData + y * outputBytesPerRow + x * bytesPerPixel,
+                                                  outputBytesPerRow, &readScratch);
+            }
+        }
+    }
+    
+    free(uploadScratch);
+    free(readScratch);
+    for (uint32_t i = 0; i < 3; i++) {
+        gpuDestroyFramebuffer(&buffers[i]);
+    }
+    gpuDestroyTexture(&texture);
+    
+    return status;
+}
+
+#pragma mark - Framebuffer Readback
+
+enum {
+    GPUReadbackSlotFree = 0,
+    GPUReadbackSlotPending = 1,
+    GPUReadbackSlotMapped = 2
+};
+
+GPUStatus gpuCreateReadbackRing(uint32_t depth, GPUReadbackRing *ring)
+{
+    memset(ring, 0, sizeof(GPUReadbackRing));
+    
+    if (depth == 0 || depth > GPU_MAX_READBACK_DEPTH) {
+        return GPUStatusUnknownError;
+    }
+    
+    ring->depth = depth;
+#if GPU_HAVE_GL3
+    for (uint32_t i = 0; i < depth; i++) {
+        glGenBuffers(1, &ring->slots[i].bufferId);
+    }
+#endif
+    ring->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyReadbackRing(GPUReadbackRing *ring)
+{
+    if (!ring->valid) {
+        return;
+    }
+    ring->valid = 0;
+    
+    for (uint32_t i = 0; i < ring->depth; i++) {
+#if GPU_HAVE_GL3
+        if (ring->slots[i].state == GPUReadbackSlotMapped) {
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->slots[i].bufferId);
+            glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        }
+        if (ring->slots[i].fence != NULL) {
+            glDeleteSync((GLsync)ring->slots[i].fence);
+        }
+        glDeleteBuffers(1, &ring->slots[i].bufferId);
+#else
+        free(ring->slots[i].pixelData);
+#endif
+    }
+}
+
+static GPUStatus gpuCheckReadbackTicket(GPUReadbackRing *ring, GPUReadbackTicket ticket)
+{
+    if (!ring->valid || ticket.slot >= ring->depth ||
+        ring->slots[ticket.slot].state == GPUReadbackSlotFree ||
+        ring->slots[ticket.slot].sequence != ticket.sequence) {
+        return GPUStatusInvalidReadback;
+    }
+    return GPUStatusOK;
+}
+
+GPUStatus gpuBeginFramebufferReadback(GPUFramebuffer *framebuffer,
+                                      GPUColorFormat colorFormat,
+                                      GPUReadbackRing *ring,
+                                      GPUReadbackTicket *ticket)
+{
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (!ring->valid) {
+        return GPUStatusInvalidReadback;
+    }
+    
+    uint32_t slot = ring->next;
+    if (ring->slots[slot].state != GPUReadbackSlotFree) {
+        return GPUStatusReadbackRingFull;
+    }
+    
+    GLenum pixelFormat, type;
+    uint32_t bytesPerPixel;
+    gpuGetReadbackFormat(framebuffer, colorFormat, &pixelFormat, &type, &bytesPerPixel);
+    uint32_t sizeInBytes = bytesPerPixel * framebuffer->texture.width * framebuffer->texture.height;
+    
+    GPU_STATS_START(start);
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    
+#if GPU_HAVE_GL3
+    // Pixels that have to be repacked are read as GL_RGBA and repacked in
+    // place once the buffer is mapped.
+    uint32_t bufferSize = sizeInBytes;
+    ring->slots[slot].repackFormat = 0;
+    ring->slots[slot].repackType = 0;
+    if (gpuNeedsReadbackRepack(pixelFormat, type)) {
+        ring->slots[slot].repackFormat = pixelFormat;
+        ring->slots[slot].repackType = type;
+        type = gpuGetRepackReadType(type);
+        pixelFormat = GL_RGBA;
+        bufferSize = framebuffer->texture.width * framebuffer->texture.height * (type == GL_FLOAT ? 16 : 4);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->slots[slot].bufferId);
+    if (ring->slots[slot].capacity < bufferSize) {
+        glBufferData(GL_PIXEL_PACK_BUFFER, bufferSize, NULL, GL_STREAM_READ);
+        ring->slots[slot].capacity = bufferSize;
+    }
+    glReadPixels(0, 0, framebuffer->texture.width, framebuffer->texture.height, pixelFormat, type, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (glGetError() != GL_NO_ERROR) {
+        return GPUStatusUnknownError;
+    }
+    
+    // The fence marks the point after which the copy has landed; flush so
+    // that polling makes progress without anybody waiting on it.
+    ring->slots[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+#else
+    // Without pixel buffer objects the best we can do is a plain copy.
+    if (ring->slots[slot].capacity < sizeInBytes) {
+        uint8_t *pixelData = realloc(ring->slots[slot].pixelData, sizeInBytes);
+        if (pixelData == NULL) {
+            glPixelStorei(GL_PACK_ALIGNMENT, 4);
+            return GPUStatusOutOfMemory;
+        }
+        ring->slots[slot].pixelData = pixelData;
+        ring->slots[slot].capacity = sizeInBytes;
+    }
+    GPUStatus status = gpuReadPixels(0, 0, framebuffer->texture.width, framebuffer->texture.height, pixelFormat, type, ring->slots[slot].pixelData);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+#endif
+    
+    GPU_STATS_RECORD(GPUStatsCategoryReadback, start, sizeInBytes);
+    ring->slots[slot].state = GPUReadbackSlotPending;
+    ring->slots[slot].sequence = ++ring->sequence;
+    ring->slots[slot].sizeInBytes = sizeInBytes;
+    ring->next = (slot + 1) % ring->depth;
+    
+    ticket->slot = slot;
+    ticket->sequence = ring->slots[slot].sequence;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuPollReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket)
+{
+    GPUStatus status = gpuCheckReadbackTicket(ring, ticket);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+#if GPU_HAVE_GL3
+    if (ring->slots[ticket.slot].fence != NULL) {
+        GLint syncStatus = GL_UNSIGNALED;
+        glGetSynciv((GLsync)ring->slots[ticket.slot].fence, GL_SYNC_STATUS, sizeof(syncStatus), NULL, &syncStatus);
+        if (syncStatus != GL_SIGNALED) {
+            return GPUStatusNotReady;
+        }
+    }
+#endif
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuMapReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket,
+                         const uint8_t **pixelData)
+{
+    GPUStatus status = gpuCheckReadbackTicket(ring, ticket);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+#if GPU_HAVE_GL3
+    if (ring->slots[ticket.slot].state == GPUReadbackSlotPending) {
+        GPU_STATS_START(start);
+        GLsync fence = (GLsync)ring->slots[ticket.slot].fence;
+        GLenum result;
+        do {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while (result == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        ring->slots[ticket.slot].fence = NULL;
+        if (result == GL_WAIT_FAILED) {
+            return GPUStatusUnknownError;
+        }
+        
+        GLenum repackFormat = ring->slots[ticket.slot].repackFormat;
+        GLenum repackType = ring->slots[ticket.slot].repackType;
+        uint32_t sizeInBytes = ring->slots[ticket.slot].sizeInBytes;
+        uint32_t pixelCount = repackType != 0 ? sizeInBytes / gpuGetReadbackPixelSize(repackFormat, repackType) : 0;
+        uint32_t mapSize = repackType != 0 ? pixelCount * (gpuGetRepackReadType(repackType) == GL_FLOAT ? 16 : 4) : sizeInBytes;
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->slots[ticket.slot].bufferId);
+        ring->slots[ticket.slot].pixelData = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, mapSize,
+                                                              repackType != 0 ? GL_MAP_READ_BIT | GL_MAP_WRITE_BIT : GL_MAP_READ_BIT);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        GPU_STATS_RECORD(GPUStatsCategoryReadbackWait, start, 0);
+        if (ring->slots[ticket.slot].pixelData == NULL) {
+            return GPUStatusUnknownError;
+        }
+        if (repackType != 0) {
+            gpuRepackReadback(ring->slots[ticket.slot].pixelData, ring->slots[ticket.slot].pixelData, pixelCount, repackFormat, repackType);
+        }
+        ring->slots[ticket.slot].state = GPUReadbackSlotMapped;
+    }
+#else
+    ring->slots[ticket.slot].state = GPUReadbackSlotMapped;
+#endif
+    
+    *pixelData = ring->slots[ticket.slot].pixelData;
+    
+    return GPUStatusOK;
+}
+
+void gpuUnmapReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket)
+{
+    if (gpuCheckReadbackTicket(ring, ticket) != GPUStatusOK) {
+        return;
+    }
+    
+#if GPU_HAVE_GL3
+    if (ring->slots[ticket.slot].state == GPUReadbackSlotMapped) {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, ring->slots[ticket.slot].bufferId);
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+        ring->slots[ticket.slot].pixelData = NULL;
+    }
+    if (ring->slots[ticket.slot].fence != NULL) {
+        glDeleteSync((GLsync)ring->slots[ticket.slot].fence);
+        ring->slots[ticket.slot].fence = NULL;
+    }
+#endif
+    
+    ring->slots[ticket.slot].state = GPUReadbackSlotFree;
+}
+
+#pragma mark - Packed Readback
+
+#define GPU_MAX_PACK_DOWNSAMPLE 8
+
+// Every output texel carries four consecutive bytes of a packed row.
+static const char *kGPUPackFragmentShaderCode = SHADER_STRING
+(
+ uniform sampler2D texture;
+ uniform float gpuPackFormat;
+ uniform vec2 gpuSourceSize;
+ uniform vec2 gpuOutputSize;
+ uniform float gpuDownsample;
+ uniform vec3 gpuLuma;
+ uniform vec3 gpuCb;
+ uniform vec3 gpuCr;
+ uniform vec4 gpuYUVScale;
+ 
+ vec3 gpuFetch(vec2 pixel) {
+     pixel = min(pixel, gpuOutputSize - 1.0);
+     vec3 sum = vec3(0.0);
+     for (int j = 0; j < 8; j++) {
+         if (float(j) >= gpuDownsample) {
+             break;
+         }
+         for (int i = 0; i < 8; i++) {
+             if (float(i) >= gpuDownsample) {
+                 break;
+             }
+             vec2 position = min(pixel * gpuDownsample + vec2(float(i), float(j)), gpuSourceSize - 1.0) + 0.5;
+             sum += texture2D(texture, position / gpuSourceSize).rgb;
+         }
+     }
+     return sum / (gpuDownsample * gpuDownsample);
+ }
+ 
+ float gpuRGBByte(float byteIndex, float row) {
+     float pixel = floor((byteIndex + 0.5) / 3.0);
+     float channel = byteIndex - pixel * 3.0;
+     vec3 color = gpuFetch(vec2(pixel, row));
+     return channel < 0.5 ? color.r : (channel < 1.5 ? color.g : color.b);
+ }
+ 
+ float gpuLumaByte(float pixel, float row) {
+     return dot(gpuFetch(vec2(pixel, row)), gpuLuma) * gpuYUVScale.x + gpuYUVScale.y;
+ }
+ 
+ vec2 gpuChroma(float pixel, float row) {
+     vec3 color = 0.25 * (gpuFetch(vec2(pixel, row) * 2.0) +
+                          gpuFetch(vec2(pixel, row) * 2.0 + vec2(1.0, 0.0)) +
+                          gpuFetch(vec2(pixel, row) * 2.0 + vec2(0.0, 1.0)) +
+                          gpuFetch(vec2(pixel, row) * 2.0 + vec2(1.0, 1.0)));
+     return vec2(dot(color, gpuCb), dot(color, gpuCr)) * gpuYUVScale.z + gpuYUVScale.w;
+ }
+ 
+ void main() {
+     vec2 texel = floor(gl_FragCoord.xy);
+     float byteIndex = texel.x * 4.0;
+     if (gpuPackFormat < 0.5) {
+         gl_FragColor = vec4(gpuRGBByte(byteIndex, texel.y), gpuRGBByte(byteIndex + 1.0, texel.y),
+                             gpuRGBByte(byteIndex + 2.0, texel.y), gpuRGBByte(byteIndex + 3.0, texel.y));
+     } else if (gpuPackFormat < 1.5 || texel.y < gpuOutputSize.y) {
+         gl_FragColor = vec4(gpuLumaByte(byteIndex, texel.y), gpuLumaByte(byteIndex + 1.0, texel.y),
+                             gpuLumaByte(byteIndex + 2.0, texel.y), gpuLumaByte(byteIndex + 3.0, texel.y));
+     } else {
+         float row = texel.y - gpuOutputSize.y;
+         gl_FragColor = vec4(gpuChroma(texel.x * 2.0, row), gpuChroma(texel.x * 2.0 + 1.0, row));
+     }
+ }
+ );
+
+GPUStatus gpuCreatePacker(GPUPacker *packer)
+{
+    memset(packer, 0, sizeof(GPUPacker));
+    
+    GPUStatus status = gpuCompileInternalProgram(kGPUPackFragmentShaderCode, &packer->program);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    packer->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyPacker(GPUPacker *packer)
+{
+    if (!packer->valid) {
+        return;
+    }
+    packer->valid = 0;
+    
+    gpuDestroyProgram(&packer->program);
+    gpuDestroyFramebuffer(&packer->buffer);
+    free(packer->scratch);
+    packer->scratch = NULL;
+    packer->scratchSize = 0;
+}
+
+static uint32_t gpuGetDownsampledSize(uint32_t size, uint32_t downsample)
+{
+    return downsample > 1 ? (size + downsample - 1) / downsample : size;
+}
+
+uint32_t gpuGetPackedRowSize(uint32_t width, GPUPackedFormat format, uint32_t downsample)
+{
+    width = gpuGetDownsampledSize(width, downsample);
+    switch (format) {
+        case GPUPackedFormatRGB24: return 3 * width;
+        // Chroma rows hold a U and V byte per two pixels, rounded up.
+        case GPUPackedFormatNV12: return 2 * ((width + 1) / 2);
+        default: return width;
+    }
+}
+
+uint32_t gpuGetPackedRowCount(uint32_t height, GPUPackedFormat format, uint32_t downsample)
+{
+    height = gpuGetDownsampledSize(height, downsample);
+    return format == GPUPackedFormatNV12 ? height + (height + 1) / 2 : height;
+}
+
+GPUStatus gpuReadFramebufferPacked(GPUPacker *packer, GPUFramebuffer *framebuffer,
+                                   GPUPackedFormat format, uint32_t downsample,
+                                   GPUYUVColorSpace colorSpace, GPUYUVRange range,
+                                   uint8_t *pixelData, size_t bytesPerRow)
+{
+    if (!packer->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (downsample == 0) {
+        downsample = 1;
+    }
+    if (downsample > GPU_MAX_PACK_DOWNSAMPLE) {
+        return GPUStatusInvalidArgument;
+    }
+    
+    uint32_t outputWidth = gpuGetDownsampledSize(framebuffer->texture.width, downsample);
+    uint32_t outputHeight = gpuGetDownsampledSize(framebuffer->texture.height, downsample);
+    uint32_t rowSize = gpuGetPackedRowSize(framebuffer->texture.width, format, downsample);
+    uint32_t rowCount = gpuGetPackedRowCount(framebuffer->texture.height, format, downsample);
+    if (bytesPerRow < rowSize) {
+        return GPUStatusInvalidArgument;
+    }
+    
+    // A packed row ends in a partly used texel unless it is a multiple of 4.
+    uint32_t texelWidth = (rowSize + 3) / 4;
+    GPUFramebuffer *buffer = &packer->buffer;
+    if (buffer->valid && (buffer->texture.width != texelWidth || buffer->texture.height != rowCount)) {
+        gpuDestroyFramebuffer(buffer);
+    }
+    if (!buffer->valid) {
+        GPUStatus status = gpuCreateFramebuffer(texelWidth, rowCount, buffer);
+        if (status != GPUStatusOK) {
+            return status;
+        }
+    }
+    
+    float kr = colorSpace == GPUYUVColorSpaceBT709 ? 0.2126f : 0.299f;
+    float kb = colorSpace == GPUYUVColorSpaceBT709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float cbScale = 0.5f / (1.0f - kb);
+    float crScale = 0.5f / (1.0f - kr);
+    
+    GPUProgram *program = &packer->program;
+    gpuSetFloatForProgram("gpuPackFormat", (float)format, program);
+    gpuSet2FloatsForProgram("gpuSourceSize", (float)framebuffer->texture.width, (float)framebuffer->texture.height, program);
+    gpuSet2FloatsForProgram("gpuOutputSize", (float)outputWidth, (float)outputHeight, program);
+    gpuSetFloatForProgram("gpuDownsample", (float)downsample, program);
+    gpuSet3FloatsForProgram("gpuLuma", kr, kg, kb, program);
+    gpuSet3FloatsForProgram("gpuCb", -kr * cbScale, -kg * cbScale, (1.0f - kb) * cbScale, program);
+    gpuSet3FloatsForProgram("gpuCr", (1.0f - kr) * crScale, -kg * crScale, -kb * crScale, program);
+    // Limited range puts luma in [16, 235] and chroma in [16, 240].
+    if (range == GPUYUVRangeFull) {
+        gpuSet4FloatsForProgram("gpuYUVScale", 1.0f, 0.0f, 1.0f, 128.0f / 255.0f, program);
+    } else {
+        gpuSet4FloatsForProgram("gpuYUVScale", 219.0f / 255.0f, 16.0f / 255.0f, 224.0f / 255.0f, 128.0f / 255.0f, program);
+    }
+    
+    GPUStatus status = gpuRenderTextureToFramebufferUsingProgram(&framebuffer->texture, buffer, program);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    GPU_STATS_START(start);
+    gpuBindFramebuffer(buffer->framebufferId);
+    
+#if GPU_HAVE_GL3
+    // Rows land directly at the caller's stride when it fits whole texels.
+    if (bytesPerRow % 4 == 0) {
+        glPixelStorei(GL_PACK_ROW_LENGTH, (GLint)(bytesPerRow / 4));
+        glReadPixels(0, 0, texelWidth, rowCount, GL_RGBA, GL_UNSIGNED_BYTE, pixelData);
+        glPixelStorei(GL_PACK_ROW_LENGTH, 0);
+        GPU_STATS_RECORD(GPUStatsCategoryReadback, start, (uint64_t)texelWidth * 4 * rowCount);
+        return glGetError() == GL_NO_ERROR ? GPUStatusOK : GPUStatusUnknownError;
+    }
+#endif
+    
+    size_t scratchSize = (size_t)texelWidth * 4 * rowCount;
+    if (packer->scratchSize < scratchSize) {
+        uint8_t *scratch = realloc(packer->scratch, scratchSize);
+        if (scratch == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        packer->scratch = scratch;
+        packer->scratchSize = scratchSize;
+    }
+    glReadPixels(0, 0, texelWidth, rowCount, GL_RGBA, GL_UNSIGNED_BYTE, packer->scratch);
+    GPU_STATS_RECORD(GPUStatsCategoryReadback, start, (uint64_t)texelWidth * 4 * rowCount);
+    if (glGetError() != GL_NO_ERROR) {
+        return GPUStatusUnknownError;
+    }
+    for (uint32_t row = 0; row < rowCount; row++) {
+        memcpy(pixelData + row * bytesPerRow, packer->scratch + (size_t)row * texelWidth * 4, rowSize);
+    }
+    
+    return GPUStatusOK;
+}
+
+#pragma mark - Texture
+
+static void gpuApplyTextureParameters(void)
+{
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+}
+
+void gpuSetTextureFiltering(GPUTexture *texture, GPUTextureFilter filter)
+{
+    GLint glFilter = filter == GPUTextureFilterLinear ? GL_LINEAR : GL_NEAREST;
+    gpuSelectTexture(GL_TEXTURE_2D, texture->textureId);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, glFilter);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, glFilter);
+    texture->filter = filter;
+}
+
+/* 32-bit float textures only support linear filtering with an extension
+   on OpenGL ES. */
+static int gpuIsPixelFormatFilterable(GPUPixelFormat pixelFormat)
+{
+    return pixelFormat != GPUPixelFormatRGBA32F || gpuGetCapabilities()->floatLinear;
+}
+
+/* Shared by all textures and contexts, so a generation identifies one
+   particular content of one particular texture. */
+static uint64_t textureGeneration;
+
+static uint64_t gpuNextTextureGeneration(void)
+{
+    return __atomic_add_fetch(&textureGeneration, 1, __ATOMIC_RELAXED);
+}
+
+GPUStatus gpuCreateTexture(GPUTexture *texture)
+{
+    memset(texture, 0, sizeof(GPUTexture));
+    
+    glGenTextures(1, &texture->textureId);
+    gpuSelectTexture(GL_TEXTURE_2D, texture->textureId);
+    
+    gpuApplyTextureParameters();
+    
+    texture->valid = 1;
+    texture->width = 0;
+    texture->height = 0;
+    texture->generation = gpuNextTextureGeneration();
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyTexture(GPUTexture *texture)
+{
+    if (texture->valid) {
+        texture->valid = 0;
+        gpuDeleteTexture(texture->textureId);
+    }
+}
+
+static void gpuGetTextureStorageFormat(GPUColorFormat colorFormat, GLenum *internalFormat, GLenum *format)
+{
+    *format = gpuColorFormatToGLFormat(colorFormat);
+#if !GPU_OPENGL_ES
+    *internalFormat = GL_RGBA8;
+#elif GPU_HAVE_GL3
+    switch (colorFormat) {
+        case GPUColorFormatRGB: *internalFormat = GL_RGB8; break;
+        case GPUColorFormatBGRA: *internalFormat = GL_BGRA_EXT; break;
+        default: *internalFormat = GL_RGBA8; break;
+    }
+#else
+    *internalFormat = colorFormat == GPUColorFormatRGB ? GL_RGB : GL_RGBA;
+#endif
+}
+
+/* The GL formats for a pixel format. Returns 0 if the GL cannot store it. */
+static int gpuGetPixelFormatInfo(GPUPixelFormat pixelFormat, GLenum *internalFormat, GLenum *format, GLenum *type)
+{
+    *type = GL_UNSIGNED_BYTE;
+    switch (pixelFormat) {
+        case GPUPixelFormatRGBA8:
+            gpuGetTextureStorageFormat(GPUColorFormatRGBA, internalFormat, format);
+            return 1;
+#if GPU_HAVE_GL3
+        case GPUPixelFormatR8:
+            *internalFormat = GL_R8;
+            *format = GL_RED;
+            return 1;
+        case GPUPixelFormatRG8:
+            *internalFormat = GL_RG8;
+            *format = GL_RG;
+            return 1;
+        case GPUPixelFormatRGBA16F:
+            *internalFormat = GL_RGBA16F;
+            *format = GL_RGBA;
+            *type = GL_HALF_FLOAT;
+            return 1;
+        case GPUPixelFormatRGBA32F:
+            *internalFormat = GL_RGBA32F;
+            *format = GL_RGBA;
+            *type = GL_FLOAT;
+            return 1;
+        case GPUPixelFormatRGB10A2:
+            *internalFormat = GL_RGB10_A2;
+            *format = GL_RGBA;
+            *type = GL_UNSIGNED_INT_2_10_10_10_REV;
+            return 1;
+#endif
+        default:
+            return 0;
+    }
+}
+
+static void gpuGetReadbackFormat(GPUFramebuffer *framebuffer, GPUColorFormat colorFormat, GLenum *format, GLenum *type, uint32_t *bytesPerPixel)
+{
+    GLenum internalFormat;
+    if (framebuffer->texture.pixelFormat != GPUPixelFormatRGBA8 &&
+        gpuGetPixelFormatInfo(framebuffer->texture.pixelFormat, &internalFormat, format, type)) {
+        *bytesPerPixel = gpuGetPixelFormatSize(framebuffer->texture.pixelFormat);
+        return;
+    }
+    *format = gpuColorFormatToGLFormat(colorFormat);
+    *type = GL_UNSIGNED_BYTE;
+    *bytesPerPixel = colorFormat == GPUColorFormatRGB ? 3 : 4;
+}
+
+// OpenGL ES only has to read normalized color buffers as GL_RGBA with
+// GL_UNSIGNED_BYTE, float ones as GL_RGBA with GL_FLOAT, and the bound
+// framebuffer in its implementation color read format. Anything else is
+// read as GL_RGBA and repacked. Expects the framebuffer to be bound.
+static int gpuNeedsReadbackRepack(GLenum format, GLenum type)
+{
+#if GPU_OPENGL_ES
+    if (format == GL_RGBA && (type == GL_UNSIGNED_BYTE || type == GL_FLOAT || type == GL_UNSIGNED_INT_2_10_10_10_REV)) {
+        return 0;
+    }
+    GLint readFormat = 0, readType = 0;
+    glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_FORMAT, &readFormat);
+    glGetIntegerv(GL_IMPLEMENTATION_COLOR_READ_TYPE, &readType);
+    return (GLenum)readFormat != format || (GLenum)readType != type;
+#else
+    return 0;
+#endif
+}
+
+static GLenum gpuGetRepackReadType(GLenum type)
+{
+    return type == GL_FLOAT || type == GL_HALF_FLOAT ? GL_FLOAT : GL_UNSIGNED_BYTE;
+}
+
+static uint16_t gpuFloatToHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t)((bits >> 16) & 0x8000);
+    int32_t exponent = (int32_t)((bits >> 23) & 0xff) - 127 + 15;
+    uint32_t mantissa = bits & 0x7fffff;
+    
+    if (exponent >= 31) {
+        // Overflow rounds to infinity; NaN keeps a mantissa bit.
+        return sign | 0x7c00 | (((bits >> 23) & 0xff) == 0xff && mantissa != 0 ? 0x200 : 0);
+    }
+    if (exponent <= 0) {
+        if (exponent < -10) {
+            return sign;
+        }
+        mantissa |= 0x800000;
+        uint32_t shift = (uint32_t)(14 - exponent);
+        uint32_t half = mantissa >> shift;
+        uint32_t rest = mantissa & ((1u << shift) - 1);
+        uint32_t midpoint = 1u << (shift - 1);
+        if (rest > midpoint || (rest == midpoint && (half & 1))) {
+            half++;
+        }
+        return sign | (uint16_t)half;
+    }
+    
+    uint32_t half = ((uint32_t)exponent << 10) | (mantissa >> 13);
+    uint32_t rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        // Carries into the exponent, and into infinity, as they should.
+        half++;
+    }
+    return sign | (uint16_t)half;
+}
+
+static uint32_t gpuGetReadbackPixelSize(GLenum format, GLenum type)
+{
+    uint32_t channelCount = format == GL_RGBA ? 4 : format == GL_RGB ? 3 : format == GL_RG ? 2 : 1;
+    uint32_t componentSize = type == GL_FLOAT ? 4 : type == GL_HALF_FLOAT ? 2 : 1;
+    return channelCount * componentSize;
+}
+
+// Turns GL_RGBA pixels read with gpuGetRepackReadType() into the given
+// format and type. Works in place, since no pixel grows.
+static void gpuRepackReadback(const uint8_t *source, uint8_t *destination, size_t pixelCount, GLenum format, GLenum type)
+{
+    uint32_t channelCount = format == GL_RGBA ? 4 : format == GL_RGB ? 3 : format == GL_RG ? 2 : 1;
+    
+    for (size_t i = 0; i < pixelCount; i++) {
+        for (uint32_t c = 0; c < channelCount; c++) {
+            size_t index = i * channelCount + c;
+            if (type == GL_HALF_FLOAT || type == GL_FLOAT) {
+                float value;
+                memcpy(&value, source + (i * 4 + c) * sizeof(float), sizeof(value));
+                if (type == GL_HALF_FLOAT) {
+                    uint16_t half = gpuFloatToHalf(value);
+                    memcpy(destination + index * sizeof(half), &half, sizeof(half));
+                } else {
+                    memcpy(destination + index * sizeof(value), &value, sizeof(value));
+                }
+            } else {
+                destination[index] = source[i * 4 + c];
+            }
+        }
+    }
+}
+
+// glReadPixels() into tightly packed rows, repacking where the GL cannot
+// return the format directly. Expects the framebuffer to be bound.
+static GPUStatus gpuReadPixels(GLint x, GLint y, GLsizei width, GLsizei height, GLenum format, GLenum type, void *pixelData)
+{
+    if (gpuNeedsReadbackRepack(format, type)) {
+        GLenum readType = gpuGetRepackReadType(type);
+        uint32_t componentSize = readType == GL_FLOAT ? 4 : 1;
+        size_t pixelCount = (size_t)width * height;
+        uint8_t *scratch = malloc(pixelCount * 4 * componentSize);
+        if (scratch == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        glReadPixels(x, y, width, height, GL_RGBA, readType, scratch);
+        if (glGetError() != GL_NO_ERROR) {
+            free(scratch);
+            return GPUStatusUnknownError;
+        }
+        gpuRepackReadback(scratch, pixelData, pixelCount, format, type);
+        free(scratch);
+        return GPUStatusOK;
+    }
+    
+    glReadPixels(x, y, width, height, format, type, pixelData);
+    return glGetError() == GL_NO_ERROR ? GPUStatusOK : GPUStatusUnknownError;
+}
+
+/* Leaves the texture bound to GL_TEXTURE0 with storage for the given size. */
+static GPUStatus gpuEnsureTextureStorage(uint32_t width, uint32_t height, GLenum internalFormat, GLenum format, GLenum type, GPUTexture *texture)
+{
+    if (texture->storageFormat == internalFormat && texture->width == width && texture->height == height) {
+        gpuSelectTexture(GL_TEXTURE_2D, texture->textureId);
+        return GPUStatusOK;
+    }
+    
+    // Immutable storage cannot be respecified, only replaced. The replacement
+    // is mutable so that the textureId changes at most once: a texture whose
+    // size or format changes once is likely to change again, and every copy of
+    // the GPUTexture struct still holds the old id.
+    uint32_t allowImmutable = texture->storageFormat == 0;
+    if (texture->immutable) {
+        gpuDeleteTexture(texture->textureId);
+        glGenTextures(1, &texture->textureId);
+        gpuSelectTexture(GL_TEXTURE_2D, texture->textureId);
+        gpuApplyTextureParameters();
+        if (texture->filter != GPUTextureFilterNearest) {
+            gpuSetTextureFiltering(texture, texture->filter);
+        }
+        texture->immutable = 0;
+    } else {
+        gpuSelectTexture(GL_TEXTURE_2D, texture->textureId);
+    }
+    
+#if GPU_HAVE_TEXTURE_STORAGE
+    // Only sized internal formats can be allocated with glTexStorage2D.
+    if (allowImmutable && gpuGetCapabilities()->textureStorage && internalFormat != format) {
+        glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, width, height);
+        texture->immutable = 1;
+    } else
+#endif
+    {
+        glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, NULL);
+    }
+    
+    if (glGetError() != GL_NO_ERROR) {
+        texture->storageFormat = 0;
+        return GPUStatusUnknownError;
+    }
+    
+    texture->storageFormat = internalFormat;
+    texture->width = width;
+    texture->height = height;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuUploadImageToTexture(uint32_t width, uint32_t height, GPUColorFormat colorFormat, uint8_t *pixelData, GPUTexture *texture)
+{
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPU_STATS_START(start);
+    GLenum internalFormat, pixelFormat;
+    gpuGetTextureStorageFormat(colorFormat, &internalFormat, &pixelFormat);
+    GPUStatus status = gpuEnsureTextureStorage(width, height, internalFormat, pixelFormat, GL_UNSIGNED_BYTE, texture);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    texture->pixelFormat = GPUPixelFormatRGBA8;
+    texture->generation = gpuNextTextureGeneration();
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, pixelFormat, GL_UNSIGNED_BYTE, pixelData);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryUpload, start,
+                     (uint64_t)(colorFormat == GPUColorFormatRGB ? 3 : 4) * width * height);
+    if (glGetError() != GL_NO_ERROR) {
+        return GPUStatusUnknownError;
+    }
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuUploadPixelsToTexture(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat, const void *pixelData, GPUTexture *texture)
+{
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPU_STATS_START(start);
+    GLenum internalFormat, format, type;
+    if (!gpuGetPixelFormatInfo(pixelFormat, &internalFormat, &format, &type)) {
+        return GPUStatusUnsupportedFormat;
+    }
+    GPUStatus status = gpuEnsureTextureStorage(width, height, internalFormat, format, type, texture);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    texture->pixelFormat = pixelFormat;
+    texture->generation = gpuNextTextureGeneration();
+    
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, pixelData);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryUpload, start, (uint64_t)gpuGetPixelFormatSize(pixelFormat) * width * height);
+    if (glGetError() != GL_NO_ERROR) {
+        return GPUStatusUnknownError;
+    }
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuCreateTextureFromImage(uint32_t width, uint32_t height, GPUColorFormat colorFormat, uint8_t *pixelData, GPUTexture *texture)
+{
+    GPUStatus status = GPUStatusOK;
+    
+    status = gpuCreateTexture(texture);
+    
+    if (status == GPUStatusOK) {
+        status = gpuUploadImageToTexture(width, height, colorFormat, pixelData, texture);
+    }
+    
+    return status;
+}
+
+GPUStatus gpuCreateBlankTexture(uint32_t width, uint32_t height, GPUTexture *texture)
+{
+    uint8_t *dummyBuffer = malloc(width * height * 4);
+    if (dummyBuffer == NULL) {
+        return GPUStatusOutOfMemory;
     }
     memset(dummyBuffer, 0xff, width * height * 4);
     GPUStatus status = gpuCreateTextureFromImage(width, height, GPUColorFormatRGBA, dummyBuffer, texture);
@@ -308,112 +4731,1956 @@ GPUStatus gpuCreateBlankTexture(uint32_t width, uint32_t height, GPUTexture *tex
     return status;
 }
 
-static GLenum gpuColorFormatToGLFormat(GPUColorFormat colorFormat)
+GPUStatus gpuCreateBlankTextureWithFormat(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat, GPUTexture *texture)
+{
+    uint32_t bytesPerPixel = gpuGetPixelFormatSize(pixelFormat);
+    uint8_t *dummyBuffer = malloc((size_t)width * height * bytesPerPixel);
+    if (dummyBuffer == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    
+    // All bits set is 1.0 for the normalized formats, not for float ones.
+    if (pixelFormat == GPUPixelFormatRGBA16F || pixelFormat == GPUPixelFormatRGBA32F) {
+        const uint16_t halfOne = 0x3c00;
+        const float floatOne = 1.0f;
+        for (size_t i = 0; i < (size_t)width * height * 4; i++) {
+            if (pixelFormat == GPUPixelFormatRGBA16F) {
+                memcpy(dummyBuffer + i * 2, &halfOne, 2);
+            } else {
+                memcpy(dummyBuffer + i * 4, &floatOne, 4);
+            }
+        }
+    } else {
+        memset(dummyBuffer, 0xff, (size_t)width * height * bytesPerPixel);
+    }
+    
+    GPUStatus status = gpuCreateTexture(texture);
+    if (status == GPUStatusOK) {
+        status = gpuUploadPixelsToTexture(width, height, pixelFormat, dummyBuffer, texture);
+    }
+    free(dummyBuffer);
+    return status;
+}
+
+#pragma mark - Streaming Texture Upload
+
+GPUStatus gpuCreateUploadStream(uint32_t width, uint32_t height,
+                                GPUColorFormat colorFormat, uint32_t depth,
+                                GPUUploadStream *stream)
+{
+    memset(stream, 0, sizeof(GPUUploadStream));
+    
+#if GPU_HAVE_GL3
+    if (depth == 0 || depth > GPU_MAX_UPLOAD_STREAM_DEPTH) {
+        return GPUStatusUnknownError;
+    }
+    
+    stream->width = width;
+    stream->height = height;
+    stream->colorFormat = colorFormat;
+    stream->sizeInBytes = (colorFormat == GPUColorFormatRGB ? 3 : 4) * width * height;
+    stream->depth = depth;
+    
+#if GPU_HAVE_BUFFER_STORAGE
+    stream->persistent = gpuGetCapabilities()->bufferStorage;
+#endif
+    
+    for (uint32_t i = 0; i < depth; i++) {
+        glGenBuffers(1, &stream->slots[i].bufferId);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->slots[i].bufferId);
+#if GPU_HAVE_BUFFER_STORAGE
+        if (stream->persistent) {
+            GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stream->sizeInBytes, NULL, flags);
+            stream->slots[i].pixelData = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stream->sizeInBytes, flags);
+            continue;
+        }
+#endif
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, stream->sizeInBytes, NULL, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    
+    stream->valid = 1;
+    if (glGetError() != GL_NO_ERROR) {
+        gpuDestroyUploadStream(stream);
+        return GPUStatusOutOfMemory;
+    }
+    
+    return GPUStatusOK;
+#else
+    return GPUStatusUnknownError;
+#endif
+}
+
+void gpuDestroyUploadStream(GPUUploadStream *stream)
+{
+    if (!stream->valid) {
+        return;
+    }
+    stream->valid = 0;
+    
+#if GPU_HAVE_GL3
+    for (uint32_t i = 0; i < stream->depth; i++) {
+        if (stream->slots[i].fence != NULL) {
+            glDeleteSync((GLsync)stream->slots[i].fence);
+        }
+        if (stream->slots[i].pixelData != NULL) {
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->slots[i].bufferId);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        }
+        glDeleteBuffers(1, &stream->slots[i].bufferId);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+#endif
+}
+
+GPUStatus gpuBeginStreamUpload(GPUUploadStream *stream, uint8_t **pixelData)
+{
+    if (!stream->valid || stream->mapped) {
+        return GPUStatusUnknownError;
+    }
+    
+#if GPU_HAVE_GL3
+    uint32_t slot = stream->current;
+    
+    // Wait until the upload that last used this buffer has been consumed.
+    if (stream->slots[slot].fence != NULL) {
+        GLsync fence = (GLsync)stream->slots[slot].fence;
+        GLenum result;
+        do {
+            result = glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        } while (result == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fence);
+        stream->slots[slot].fence = NULL;
+    }
+    
+    if (!stream->persistent) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->slots[slot].bufferId);
+        stream->slots[slot].pixelData = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stream->sizeInBytes,
+                                                         GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        if (stream->slots[slot].pixelData == NULL) {
+            return GPUStatusUnknownError;
+        }
+    }
+    
+    stream->mapped = 1;
+    *pixelData = stream->slots[slot].pixelData;
+    
+    return GPUStatusOK;
+#else
+    return GPUStatusUnknownError;
+#endif
+}
+
+GPUStatus gpuEndStreamUpload(GPUUploadStream *stream, GPUTexture *texture)
+{
+    if (!stream->valid || !stream->mapped) {
+        return GPUStatusUnknownError;
+    }
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+#if GPU_HAVE_GL3
+    uint32_t slot = stream->current;
+    
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream->slots[slot].bufferId);
+    if (!stream->persistent) {
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        stream->slots[slot].pixelData = NULL;
+    }
+    stream->mapped = 0;
+    
+    GPU_STATS_START(start);
+    GLenum internalFormat, format;
+    gpuGetTextureStorageFormat(stream->colorFormat, &internalFormat, &format);
+    GPUStatus status = gpuEnsureTextureStorage(stream->width, stream->height, internalFormat, format, GL_UNSIGNED_BYTE, texture);
+    if (status == GPUStatusOK) {
+        texture->pixelFormat = GPUPixelFormatRGBA8;
+        texture->generation = gpuNextTextureGeneration();
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, stream->width, stream->height,
+                        gpuColorFormatToGLFormat(stream->colorFormat), GL_UNSIGNED_BYTE, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+        GPU_STATS_RECORD(GPUStatsCategoryUpload, start, stream->sizeInBytes);
+        if (glGetError() != GL_NO_ERROR) {
+            status = GPUStatusUnknownError;
+        }
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    
+    stream->slots[slot].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    stream->current = (slot + 1) % stream->depth;
+    
+    return status;
+#else
+    return GPUStatusUnknownError;
+#endif
+}
+
+static GLenum gpuColorFormatToGLFormat(GPUColorFormat colorFormat)
+{
+    switch (colorFormat) {
+        case GPUColorFormatRGB: return GL_RGB;
+        case GPUColorFormatRGBA: return GL_RGBA;
+        case GPUColorFormatBGRA: return GL_BGRA;
+        default: return GL_RGBA;
+    };
+}
+
+#pragma mark - YUV Texture
+
+#if !GPU_OPENGL_ES
+static const char *kGPUYUVShaderPrelude = SHADER_STRING
+(
+ varying vec2 uv;
+ 
+ uniform sampler2D texture;
+ uniform sampler2D texture2;
+ uniform sampler2D texture3;
+ uniform mat3 gpuYUVMatrix;
+ uniform vec3 gpuYUVOffset;
+ uniform float gpuYUVPlanar;
+ 
+ vec4 gpuSampleYUV(vec2 position) {
+     vec3 yuv;
+     yuv.x = texture2D(texture, position).r;
+     vec4 chroma = texture2D(texture2, position);
+     yuv.yz = gpuYUVPlanar > 0.5 ? vec2(chroma.r, texture2D(texture3, position).r) : chroma.rg;
+     return vec4(clamp(gpuYUVMatrix * (yuv - gpuYUVOffset), 0.0, 1.0), 1.0);
+ }
+ );
+#else
+static const char *kGPUYUVShaderPrelude = SHADER_STRING
+(
+ precision highp float;
+ 
+ varying highp vec2 uv;
+ 
+ uniform sampler2D texture;
+ uniform sampler2D texture2;
+ uniform sampler2D texture3;
+ uniform mat3 gpuYUVMatrix;
+ uniform vec3 gpuYUVOffset;
+ uniform float gpuYUVPlanar;
+ 
+ vec4 gpuSampleYUV(vec2 position) {
+     vec3 yuv;
+     yuv.x = texture2D(texture, position).r;
+     vec4 chroma = texture2D(texture2, position);
+     yuv.yz = gpuYUVPlanar > 0.5 ? vec2(chroma.r, texture2D(texture3, position).r) : chroma.rg;
+     return vec4(clamp(gpuYUVMatrix * (yuv - gpuYUVOffset), 0.0, 1.0), 1.0);
+ }
+ );
+#endif
+
+static const char *kGPUYUVToRGBShaderCode = SHADER_STRING
+(
+ void main() {
+     gl_FragColor = gpuSampleYUV(uv);
+ }
+ );
+
+GPUStatus gpuCreateYUVTexture(GPUYUVTexture *texture)
+{
+    memset(texture, 0, sizeof(GPUYUVTexture));
+    
+    for (int i = 0; i < 3; i++) {
+        GPUStatus status = gpuCreateTexture(&texture->planes[i]);
+        if (status != GPUStatusOK) {
+            gpuDestroyYUVTexture(texture);
+            return status;
+        }
+    }
+    
+    texture->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyYUVTexture(GPUYUVTexture *texture)
+{
+    texture->valid = 0;
+    for (int i = 0; i < 3; i++) {
+        gpuDestroyTexture(&texture->planes[i]);
+    }
+}
+
+static GPUStatus gpuUploadYUVPlane(uint32_t width, uint32_t height, GPUPixelFormat pixelFormat,
+                                   const uint8_t *pixelData, size_t bytesPerRow, int linear,
+                                   GPUTexture *texture)
+{
+    uint32_t bytesPerPixel = gpuGetPixelFormatSize(pixelFormat);
+    size_t rowSize = (size_t)width * bytesPerPixel;
+    GPUStatus status;
+    
+#if GPU_HAVE_GL3
+    if (bytesPerRow % bytesPerPixel == 0) {
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)(bytesPerRow / bytesPerPixel));
+        status = gpuUploadPixelsToTexture(width, height, pixelFormat, pixelData, texture);
+        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    } else
+#endif
+    if (bytesPerRow == rowSize) {
+        status = gpuUploadPixelsToTexture(width, height, pixelFormat, pixelData, texture);
+    } else {
+        uint8_t *packed = malloc(rowSize * height);
+        if (packed == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        for (uint32_t row = 0; row < height; row++) {
+            memcpy(packed + row * rowSize, pixelData + row * bytesPerRow, rowSize);
+        }
+        status = gpuUploadPixelsToTexture(width, height, pixelFormat, packed, texture);
+        free(packed);
+    }
+    
+    // Chroma is upsampled by the texture unit.
+    if (status == GPUStatusOK && linear && texture->filter != GPUTextureFilterLinear) {
+        gpuSetTextureFiltering(texture, GPUTextureFilterLinear);
+    }
+    
+    return status;
+}
+
+GPUStatus gpuUploadYUVImageToTexture(const GPUYUVImage *image, GPUYUVTexture *texture)
+{
+    if (!texture->valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    uint32_t chromaWidth = (image->width + 1) / 2;
+    uint32_t chromaHeight = (image->height + 1) / 2;
+    
+    GPUStatus status = gpuUploadYUVPlane(image->width, image->height, GPUPixelFormatR8,
+                                         image->planes[0], image->bytesPerRow[0], 0, &texture->planes[0]);
+    if (status == GPUStatusOK && image->format == GPUYUVFormatNV12) {
+        status = gpuUploadYUVPlane(chromaWidth, chromaHeight, GPUPixelFormatRG8,
+                                   image->planes[1], image->bytesPerRow[1], 1, &texture->planes[1]);
+    } else if (status == GPUStatusOK) {
+        status = gpuUploadYUVPlane(chromaWidth, chromaHeight, GPUPixelFormatR8,
+                                   image->planes[1], image->bytesPerRow[1], 1, &texture->planes[1]);
+        if (status == GPUStatusOK) {
+            status = gpuUploadYUVPlane(chromaWidth, chromaHeight, GPUPixelFormatR8,
+                                       image->planes[2], image->bytesPerRow[2], 1, &texture->planes[2]);
+        }
+    }
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    texture->format = image->format;
+    texture->colorSpace = image->colorSpace;
+    texture->range = image->range;
+    texture->width = image->width;
+    texture->height = image->height;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuCompileYUVProgram(const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
+{
+    if (fragmentShaderCode == NULL) {
+        fragmentShaderCode = kGPUYUVToRGBShaderCode;
+    }
+    
+    size_t preludeLength = strlen(kGPUYUVShaderPrelude);
+    size_t codeLength = strlen(fragmentShaderCode);
+    char *code = malloc(preludeLength + codeLength + 2);
+    if (code == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    memcpy(code, kGPUYUVShaderPrelude, preludeLength);
+    code[preludeLength] = '\n';
+    memcpy(code + preludeLength + 1, fragmentShaderCode, codeLength + 1);
+    
+    GPUStatus status = gpuCompileProgram(kGPUDefaultVertexShaderCode, code, program, logFunc);
+    free(code);
+    
+    return status;
+}
+
+/* Column-major matrix and offset taking 8-bit Y'CbCr to R'G'B'. */
+static void gpuGetYUVConversion(GPUYUVColorSpace colorSpace, GPUYUVRange range, float matrix[9], float offset[3])
+{
+    float kr = colorSpace == GPUYUVColorSpaceBT709 ? 0.2126f : 0.299f;
+    float kb = colorSpace == GPUYUVColorSpaceBT709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    
+    // Limited range puts luma in [16, 235] and chroma in [16, 240].
+    float lumaScale = range == GPUYUVRangeFull ? 1.0f : 255.0f / 219.0f;
+    float chromaScale = range == GPUYUVRangeFull ? 1.0f : 255.0f / 224.0f;
+    offset[0] = range == GPUYUVRangeFull ? 0.0f : 16.0f / 255.0f;
+    offset[1] = 128.0f / 255.0f;
+    offset[2] = 128.0f / 255.0f;
+    
+    matrix[0] = lumaScale;
+    matrix[1] = lumaScale;
+    matrix[2] = lumaScale;
+    matrix[3] = 0.0f;
+    matrix[4] = -chromaScale * 2.0f * (1.0f - kb) * kb / kg;
+    matrix[5] = chromaScale * 2.0f * (1.0f - kb);
+    matrix[6] = chromaScale * 2.0f * (1.0f - kr);
+    matrix[7] = -chromaScale * 2.0f * (1.0f - kr) * kr / kg;
+    matrix[8] = 0.0f;
+}
+
+GPUStatus gpuRenderYUVTextureToFramebufferUsingProgram(GPUYUVTexture *texture, GPUFramebuffer *framebuffer, GPUProgram *program)
+{
+    if (!texture->valid || !texture->planes[0].valid) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    float matrix[9];
+    float offset[3];
+    gpuGetYUVConversion(texture->colorSpace, texture->range, matrix, offset);
+    
+    GPUStatus status = gpuSetMatrix3x3ForProgram("gpuYUVMatrix", matrix, program);
+    if (status == GPUStatusOK) {
+        status = gpuSet3FloatsForProgram("gpuYUVOffset", offset[0], offset[1], offset[2], program);
+    }
+    if (status == GPUStatusOK) {
+        status = gpuSetFloatForProgram("gpuYUVPlanar", texture->format == GPUYUVFormatI420 ? 1.0f : 0.0f, program);
+    }
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    gpuSetSecondTextureForProgram(&texture->planes[1], program);
+    if (texture->format == GPUYUVFormatI420) {
+        gpuSetThirdTextureForProgram(&texture->planes[2], program);
+    } else {
+        program->additionalTextures[1].textureShouldBeUsed = 0;
+    }
+    
+    return gpuRenderTextureToFramebufferUsingProgram(&texture->planes[0], framebuffer, program);
+}
+
+#pragma mark - Batch Processing
+
+enum {
+    GPUBatchModeNone = 0,
+    GPUBatchModePerLayer = 1,
+    GPUBatchModeLayered = 2
+};
+
+#if GPU_HAVE_GL3
+#if !GPU_OPENGL_ES
+static const char *kGPUBatchVertexShaderCode = "#version 130\n" SHADER_STRING
+(
+ in vec4 inputPosition;
+ in vec4 inputUV;
+ 
+ out vec2 uv;
+ flat out float gpuLayer;
+ 
+ uniform float gpuLayerIndex;
+ 
+ void main() {
+     gl_Position = inputPosition;
+     uv = inputUV.xy;
+     gpuLayer = gpuLayerIndex;
+ }
+ );
+
+// Draws instance i into layer i.
+static const char *kGPULayeredVertexShaderCode =
+    "#version 140\n"
+    "#extension GL_ARB_shader_viewport_layer_array : enable\n"
+    "#extension GL_AMD_vertex_shader_layer : enable\n" SHADER_STRING
+(
+ in vec4 inputPosition;
+ in vec4 inputUV;
+ 
+ out vec2 uv;
+ flat out float gpuLayer;
+ 
+ void main() {
+     gl_Position = inputPosition;
+     gl_Layer = gl_InstanceID;
+     uv = inputUV.xy;
+     gpuLayer = float(gl_InstanceID);
+ }
+ );
+
+static const char *kGPUBatchShaderPrelude = "#version 130\n" SHADER_STRING
+(
+ in vec2 uv;
+ flat in float gpuLayer;
+ 
+ uniform sampler2DArray gpuLayers;
+ 
+ vec4 gpuSampleLayer(vec2 position) {
+     return texture(gpuLayers, vec3(position, gpuLayer));
+ }
+ );
+#else
+static const char *kGPUBatchVertexShaderCode = "#version 300 es\n" SHADER_STRING
+(
+ in vec4 inputPosition;
+ in vec4 inputUV;
+ 
+ out vec2 uv;
+ flat out float gpuLayer;
+ 
+ uniform float gpuLayerIndex;
+ 
+ void main() {
+     gl_Position = inputPosition;
+     uv = inputUV.xy;
+     gpuLayer = gpuLayerIndex;
+ }
+ );
+
+// GLSL ES 3 has no gl_FragColor or texture2D, so map them for the
+// shader code that follows.
+static const char *kGPUBatchShaderPrelude =
+    "#version 300 es\n"
+    "#define texture2D texture\n"
+    "#define gl_FragColor gpuFragColor\n" SHADER_STRING
+(
+ precision highp float;
+ precision highp sampler2DArray;
+ 
+ out vec4 gpuFragColor;
+ 
+ in vec2 uv;
+ flat in float gpuLayer;
+ 
+ uniform sampler2DArray gpuLayers;
+ 
+ vec4 gpuSampleLayer(vec2 position) {
+     return texture(gpuLayers, vec3(position, gpuLayer));
+ }
+ );
+#endif
+
+static const char *kGPUBatchCopyShaderCode = SHADER_STRING
+(
+ void main() {
+     gl_FragColor = gpuSampleLayer(uv);
+ }
+ );
+
+GPUStatus gpuCreateTextureArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                GPUPixelFormat pixelFormat, GPUTextureArray *texture)
+{
+    memset(texture, 0, sizeof(GPUTextureArray));
+    
+    GLenum internalFormat, format, type;
+    if (!gpuGetCapabilities()->textureArrays ||
+        !gpuGetPixelFormatInfo(pixelFormat, &internalFormat, &format, &type)) {
+        return GPUStatusUnsupportedFormat;
+    }
+    if (width == 0 || height == 0 || layerCount == 0) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    glGenTextures(1, &texture->textureId);
+    gpuSelectTexture(GL_TEXTURE_2D_ARRAY, texture->textureId);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    
+#if GPU_HAVE_TEXTURE_STORAGE
+    if (gpuGetCapabilities()->textureStorage && internalFormat != format) {
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, internalFormat, width, height, layerCount);
+    } else
+#endif
+    {
+        glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, internalFormat, width, height, layerCount, 0, format, type, NULL);
+    }
+    
+    if (glGetError() != GL_NO_ERROR) {
+        gpuDeleteTexture(texture->textureId);
+        return GPUStatusUnknownError;
+    }
+    
+    texture->width = width;
+    texture->height = height;
+    texture->layerCount = layerCount;
+    texture->pixelFormat = pixelFormat;
+    texture->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyTextureArray(GPUTextureArray *texture)
+{
+    if (texture->valid) {
+        texture->valid = 0;
+        gpuDeleteTexture(texture->textureId);
+    }
+}
+
+GPUStatus gpuUploadImagesToTextureArray(uint32_t firstLayer, uint32_t layerCount,
+                                        const void *pixelData, GPUTextureArray *texture)
+{
+    if (!texture->valid || firstLayer + layerCount > texture->layerCount || firstLayer + layerCount < firstLayer) {
+        return GPUStatusInvalidTexture;
+    }
+    
+    GPU_STATS_START(start);
+    GLenum internalFormat, format, type;
+    gpuGetPixelFormatInfo(texture->pixelFormat, &internalFormat, &format, &type);
+    
+    gpuSelectTexture(GL_TEXTURE_2D_ARRAY, texture->textureId);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, firstLayer, texture->width, texture->height, layerCount,
+                    format, type, pixelData);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryUpload, start,
+                     (uint64_t)gpuGetPixelFormatSize(texture->pixelFormat) * texture->width * texture->height * layerCount);
+    if (glGetError() != GL_NO_ERROR) {
+        return GPUStatusUnknownError;
+    }
+    
+    return GPUStatusOK;
+}
+
+/* Attaches one layer, or all of them for layer -1. */
+static void gpuAttachFramebufferLayer(GPUFramebufferArray *framebuffer, int32_t layer)
+{
+    if (framebuffer->attachedLayer == layer) {
+        return;
+    }
+#if !GPU_OPENGL_ES
+    if (layer < 0) {
+        glFramebufferTexture(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, framebuffer->texture.textureId, 0);
+    } else
+#endif
+    {
+        glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, framebuffer->texture.textureId, 0, layer);
+    }
+    framebuffer->attachedLayer = layer;
+}
+
+GPUStatus gpuCreateFramebufferArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                    GPUPixelFormat pixelFormat, GPUFramebufferArray *framebuffer)
+{
+    memset(framebuffer, 0, sizeof(GPUFramebufferArray));
+    
+    GPUStatus status = gpuCreateTextureArray(width, height, layerCount, pixelFormat, &framebuffer->texture);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    glGenFramebuffers(1, &framebuffer->framebufferId);
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    
+    // Start out the way gpuCompileBatchProgram() will render into it.
+    framebuffer->attachedLayer = 0x7fffffff;
+    gpuAttachFramebufferLayer(framebuffer, gpuGetCapabilities()->layeredRendering ? -1 : 0);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+        fprintf(stderr, "Failed to make complete framebuffer object %x\n", glCheckFramebufferStatus(GL_FRAMEBUFFER));
+        gpuDeleteFramebuffer(framebuffer->framebufferId);
+        gpuDestroyTextureArray(&framebuffer->texture);
+        return GPUStatusFailedToMakeFramebufferObjectError;
+    }
+    
+    framebuffer->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+void gpuDestroyFramebufferArray(GPUFramebufferArray *framebuffer)
+{
+    if (framebuffer->valid) {
+        framebuffer->valid = 0;
+        gpuDeleteFramebuffer(framebuffer->framebufferId);
+        gpuDestroyTextureArray(&framebuffer->texture);
+    }
+}
+
+GPUStatus gpuGetFramebufferArrayContents(GPUFramebufferArray *framebuffer, void *pixelData)
+{
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    
+    GPUTextureArray *texture = &framebuffer->texture;
+    GLenum internalFormat, format, type;
+    gpuGetPixelFormatInfo(texture->pixelFormat, &internalFormat, &format, &type);
+    
+    GPU_STATS_START(start);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+#if !GPU_OPENGL_ES
+    // The whole array comes back in one transfer.
+    gpuSelectTexture(GL_TEXTURE_2D_ARRAY, texture->textureId);
+    glGetTexImage(GL_TEXTURE_2D_ARRAY, 0, format, type, pixelData);
+    GPUStatus status = glGetError() == GL_NO_ERROR ? GPUStatusOK : GPUStatusUnknownError;
+#else
+    // OpenGL ES can only read from a framebuffer, one layer at a time.
+    size_t layerSize = (size_t)gpuGetPixelFormatSize(texture->pixelFormat) * texture->width * texture->height;
+    GPUStatus status = GPUStatusOK;
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    for (uint32_t layer = 0; layer < texture->layerCount && status == GPUStatusOK; layer++) {
+        gpuAttachFramebufferLayer(framebuffer, (int32_t)layer);
+        status = gpuReadPixels(0, 0, texture->width, texture->height, format, type, (uint8_t *)pixelData + layer * layerSize);
+    }
+#endif
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    GPU_STATS_RECORD(GPUStatsCategoryReadback, start,
+                     (uint64_t)gpuGetPixelFormatSize(texture->pixelFormat) * texture->width * texture->height * texture->layerCount);
+    
+    return status;
+}
+
+GPUStatus gpuCompileBatchProgram(const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
+{
+    memset(program, 0, sizeof(GPUProgram));
+    
+    const GPUCapabilities *caps = gpuGetCapabilities();
+    if (!caps->textureArrays) {
+        return GPUStatusUnsupportedFormat;
+    }
+    if (fragmentShaderCode == NULL) {
+        fragmentShaderCode = kGPUBatchCopyShaderCode;
+    }
+    
+    size_t preludeLength = strlen(kGPUBatchShaderPrelude);
+    size_t codeLength = strlen(fragmentShaderCode);
+    char *code = malloc(preludeLength + codeLength + 2);
+    if (code == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    memcpy(code, kGPUBatchShaderPrelude, preludeLength);
+    code[preludeLength] = '\n';
+    memcpy(code + preludeLength + 1, fragmentShaderCode, codeLength + 1);
+    
+    const char *vertexShaderCode = kGPUBatchVertexShaderCode;
+    uint32_t batchMode = GPUBatchModePerLayer;
+#if !GPU_OPENGL_ES
+    if (caps->layeredRendering) {
+        vertexShaderCode = kGPULayeredVertexShaderCode;
+        batchMode = GPUBatchModeLayered;
+    }
+#endif
+    
+    GPUStatus status = gpuCompileProgram(vertexShaderCode, code, program, logFunc);
+    free(code);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    // Samplers start out on unit 0, which is where the array is bound.
+    int32_t index = gpuFindParameter(program, "gpuLayers", strlen("gpuLayers"));
+    program->textureUniformLocation = index < 0 ? -1 : program->parameters[index].location;
+    program->batchMode = batchMode;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuRenderTextureArrayToFramebufferArrayUsingProgram(GPUTextureArray *texture,
+                                                              GPUFramebufferArray *framebuffer,
+                                                              GPUProgram *program)
+{
+    if (!texture->valid || texture->layerCount < framebuffer->texture.layerCount) {
+        return GPUStatusInvalidTexture;
+    }
+    if (!framebuffer->valid) {
+        return GPUStatusInvalidFramebuffer;
+    }
+    if (!program->valid || program->batchMode == GPUBatchModeNone) {
+        return GPUStatusInvalidProgram;
+    }
+    
+    gpuBindFramebuffer(framebuffer->framebufferId);
+    gpuSetViewport(framebuffer->texture.width, framebuffer->texture.height);
+    
+    gpuUseProgram(program->programId);
+    gpuFlushParameters(program);
+    gpuBindTexture(0, GL_TEXTURE_2D_ARRAY, texture->textureId);
+    
+    gpuBindAdditionalTextures(program);
+    
+    uint32_t layerCount = framebuffer->texture.layerCount;
+    if (program->batchMode == GPUBatchModeLayered) {
+        gpuAttachFramebufferLayer(framebuffer, -1);
+        GPU_STATS_BEGIN_DRAW();
+        glDrawArraysInstanced(GL_TRIANGLES, 0, 3, layerCount);
+        GPU_STATS_END_DRAW();
+    } else {
+        for (uint32_t layer = 0; layer < layerCount; layer++) {
+            gpuAttachFramebufferLayer(framebuffer, (int32_t)layer);
+            glUniform1f(program->layerIndexLocation, (float)layer);
+            GPU_STATS_BEGIN_DRAW();
+            glDrawArrays(GL_TRIANGLES, 0, 3);
+            GPU_STATS_END_DRAW();
+        }
+    }
+    
+    return GPUStatusOK;
+}
+#else
+GPUStatus gpuCreateTextureArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                GPUPixelFormat pixelFormat, GPUTextureArray *texture)
+{
+    (void)width;
+    (void)height;
+    (void)layerCount;
+    (void)pixelFormat;
+    memset(texture, 0, sizeof(GPUTextureArray));
+    return GPUStatusUnsupportedFormat;
+}
+
+void gpuDestroyTextureArray(GPUTextureArray *texture)
+{
+    (void)texture;
+}
+
+GPUStatus gpuUploadImagesToTextureArray(uint32_t firstLayer, uint32_t layerCount,
+                                        const void *pixelData, GPUTextureArray *texture)
+{
+    (void)firstLayer;
+    (void)layerCount;
+    (void)pixelData;
+    (void)texture;
+    return GPUStatusUnsupportedFormat;
+}
+
+GPUStatus gpuCreateFramebufferArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                    GPUPixelFormat pixelFormat, GPUFramebufferArray *framebuffer)
+{
+    (void)width;
+    (void)height;
+    (void)layerCount;
+    (void)pixelFormat;
+    memset(framebuffer, 0, sizeof(GPUFramebufferArray));
+    return GPUStatusUnsupportedFormat;
+}
+
+void gpuDestroyFramebufferArray(GPUFramebufferArray *framebuffer)
+{
+    (void)framebuffer;
+}
+
+GPUStatus gpuGetFramebufferArrayContents(GPUFramebufferArray *framebuffer, void *pixelData)
+{
+    (void)framebuffer;
+    (void)pixelData;
+    return GPUStatusUnsupportedFormat;
+}
+
+GPUStatus gpuCompileBatchProgram(const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
+{
+    (void)fragmentShaderCode;
+    (void)logFunc;
+    memset(program, 0, sizeof(GPUProgram));
+    return GPUStatusUnsupportedFormat;
+}
+
+GPUStatus gpuRenderTextureArrayToFramebufferArrayUsingProgram(GPUTextureArray *texture,
+                                                              GPUFramebufferArray *framebuffer,
+                                                              GPUProgram *program)
+{
+    (void)texture;
+    (void)framebuffer;
+    (void)program;
+    return GPUStatusUnsupportedFormat;
+}
+#endif
+
+#pragma mark - Shader Program
+
+static GPU_THREAD_LOCAL GPUProgramCacheStats programCacheStats;
+static char *programCacheDirectory;
+
+#define GPU_PROGRAM_CACHE_MAGIC 0x42555047u // "GPUB"
+#define GPU_PROGRAM_CACHE_VERSION 1u
+#define GPU_PROGRAM_CACHE_MAX_BINARY_SIZE (64u << 20)
+
+typedef struct GPUProgramCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t binaryFormat;
+    uint32_t length;
+    double compileSeconds;
+} GPUProgramCacheHeader;
+
+GPUStatus gpuSetProgramCacheDirectory(const char *path)
+{
+    free(programCacheDirectory);
+    programCacheDirectory = NULL;
+    
+    if (path != NULL) {
+        programCacheDirectory = strdup(path);
+        if (programCacheDirectory == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+    }
+    
+    return GPUStatusOK;
+}
+
+void gpuGetProgramCacheStats(GPUProgramCacheStats *stats)
+{
+    *stats = programCacheStats;
+}
+
+static void gpuPrepareProgramLink(GLuint programId, int retrievable)
+{
+    // Bind attribute locations.
+    // This needs to be done prior to linking.
+    glBindAttribLocation(programId, 0, "inputPosition");
+    glBindAttribLocation(programId, 1, "inputUV");
+    
+#if GPU_HAVE_PROGRAM_BINARY
+    if (retrievable) {
+        glProgramParameteri(programId, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+#else
+    (void)retrievable;
+#endif
+}
+
+static GLuint gpuBuildProgram(const char *vertexShaderCode, const char *fragmentShaderCode, int retrievable, void (*logFunc)(const char *log))
+{
+    // Create shader program.
+    GLuint programId = glCreateProgram();
+    
+    // Create and compile vertex shader.
+    GLuint vertexShader;
+    int success = gpuCompileShader(&vertexShader, GL_VERTEX_SHADER, vertexShaderCode, logFunc);
+    
+    if (!success) {
+        glDeleteProgram(programId);
+        fprintf(stderr, "Failed to compile vertex shader.\n");
+        return 0;
+    }
+    
+    // Create and compile fragment shader.
+    GLuint fragmentShader;
+    success = gpuCompileShader(&fragmentShader, GL_FRAGMENT_SHADER, fragmentShaderCode, logFunc);
+    if (!success) {
+        glDeleteShader(vertexShader);
+        glDeleteProgram(programId);
+        fprintf(stderr, "Failed to compile fragment shader.\n");
+        return 0;
+    }
+    
+    // Attach vertex shader to program.
+    glAttachShader(programId, vertexShader);
+    
+    // Attach fragment shader to program.
+    glAttachShader(programId, fragmentShader);
+    
+    gpuPrepareProgramLink(programId, retrievable);
+    
+    // Link program.
+    success = gpuLinkProgram(programId);
+    if (!success) {
+        glDetachShader(programId, vertexShader);
+        glDeleteShader(vertexShader);
+        glDetachShader(programId, fragmentShader);
+        glDeleteShader(fragmentShader);
+        glDeleteProgram(programId);
+        fprintf(stderr, "Failed to compile shader program.\n");
+        return 0;
+    }
+    
+    // Release vertex and fragment shaders.
+    glDetachShader(programId, vertexShader);
+    glDeleteShader(vertexShader);
+    glDetachShader(programId, fragmentShader);
+    glDeleteShader(fragmentShader);
+    
+    return programId;
+}
+
+#if GPU_HAVE_PROGRAM_BINARY
+static uint64_t gpuGetProgramCacheKey(const char *vertexShaderCode, const char *fragmentShaderCode)
+{
+    // Binaries are only valid for the driver that produced them.
+    const char *strings[] = {
+        vertexShaderCode,
+        fragmentShaderCode,
+        (const char *)glGetString(GL_VENDOR),
+        (const char *)glGetString(GL_RENDERER),
+        (const char *)glGetString(GL_VERSION),
+    };
+    
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < sizeof(strings) / sizeof(strings[0]); i++) {
+        if (strings[i] != NULL) {
+            hash = gpuHashBytes64(hash, strings[i], strlen(strings[i]) + 1);
+        }
+    }
+    
+    return hash;
+}
+
+static char *gpuGetProgramCachePath(uint64_t key, const char *suffix)
+{
+    size_t length = strlen(programCacheDirectory) + strlen(suffix) + 32;
+    char *path = malloc(length);
+    if (path != NULL) {
+        snprintf(path, length, "%s/%016llx%s", programCacheDirectory, (unsigned long long)key, suffix);
+    }
+    return path;
+}
+
+/* Returns a linked program or 0 if there is no usable cached binary. */
+static GLuint gpuLoadProgramBinary(uint64_t key, double *compileSeconds)
+{
+    char *path = gpuGetProgramCachePath(key, ".bin");
+    if (path == NULL) {
+        return 0;
+    }
+    FILE *file = fopen(path, "rb");
+    free(path);
+    if (file == NULL) {
+        return 0;
+    }
+    
+    GPUProgramCacheHeader header;
+    void *binary = NULL;
+    int readOK = fread(&header, sizeof(header), 1, file) == 1 &&
+                 header.magic == GPU_PROGRAM_CACHE_MAGIC &&
+                 header.version == GPU_PROGRAM_CACHE_VERSION &&
+                 header.key == key &&
+                 header.length > 0 && header.length <= GPU_PROGRAM_CACHE_MAX_BINARY_SIZE &&
+                 (binary = malloc(header.length)) != NULL &&
+                 fread(binary, header.length, 1, file) == 1;
+    fclose(file);
+    
+    GLuint programId = 0;
+    if (readOK) {
+        // Clear earlier errors so a rejected format is not missed.
+        while (glGetError() != GL_NO_ERROR) {
+        }
+        
+        programId = glCreateProgram();
+        glProgramBinary(programId, header.binaryFormat, binary, (GLsizei)header.length);
+        
+        GLint linked = GL_FALSE;
+        glGetProgramiv(programId, GL_LINK_STATUS, &linked);
+        if (glGetError() != GL_NO_ERROR || linked != GL_TRUE) {
+            glDeleteProgram(programId);
+            programId = 0;
+        }
+    }
+    free(binary);
+    
+    if (programId == 0) {
+        programCacheStats.rejected++;
+        return 0;
+    }
+    
+    *compileSeconds = header.compileSeconds;
+    return programId;
+}
+
+static void gpuStoreProgramBinary(uint64_t key, GLuint programId, double compileSeconds)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0 || (uint32_t)length > GPU_PROGRAM_CACHE_MAX_BINARY_SIZE) {
+        return;
+    }
+    
+    void *binary = malloc(length);
+    if (binary == NULL) {
+        return;
+    }
+    
+    GPUProgramCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    GLenum binaryFormat = 0;
+    GLsizei writtenLength = 0;
+    glGetProgramBinary(programId, length, &writtenLength, &binaryFormat, binary);
+    header.magic = GPU_PROGRAM_CACHE_MAGIC;
+    header.version = GPU_PROGRAM_CACHE_VERSION;
+    header.key = key;
+    header.binaryFormat = binaryFormat;
+    header.length = (uint32_t)writtenLength;
+    header.compileSeconds = compileSeconds;
+    
+    // Write to a temporary file and rename it into place, so that other
+    // processes never see a partially written binary. The counter keeps
+    // threads of this process apart.
+    static uint32_t temporaryCount;
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".%ld.%u.tmp", (long)getpid(),
+             __atomic_add_fetch(&temporaryCount, 1, __ATOMIC_RELAXED));
+    char *temporaryPath = gpuGetProgramCachePath(key, suffix);
+    char *path = gpuGetProgramCachePath(key, ".bin");
+    FILE *file = temporaryPath != NULL && path != NULL && writtenLength > 0 ? fopen(temporaryPath, "wb") : NULL;
+    if (file != NULL) {
+        int writeOK = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                      fwrite(binary, header.length, 1, file) == 1;
+        writeOK = fclose(file) == 0 && writeOK;
+        if (!writeOK || rename(temporaryPath, path) != 0) {
+            fprintf(stderr, "Failed to write program binary to %s.\n", path);
+            remove(temporaryPath);
+        }
+    }
+    
+    free(temporaryPath);
+    free(path);
+    free(binary);
+}
+#endif
+
+/* Looks the program up in the binary cache. Returns the loaded program, or
+   0 with useCache set if the linked program should be stored. */
+static GLuint gpuLookupProgramCache(const char *vertexShaderCode, const char *fragmentShaderCode,
+                                    int *useCache, uint64_t *key)
+{
+    *useCache = 0;
+    *key = 0;
+    
+#if GPU_HAVE_PROGRAM_BINARY
+    if (programCacheDirectory == NULL || !gpuGetCapabilities()->programBinary) {
+        return 0;
+    }
+    *useCache = 1;
+    *key = gpuGetProgramCacheKey(vertexShaderCode, fragmentShaderCode);
+    
+    double start = gpuGetTime();
+    double compileSeconds = 0.0;
+    GLuint programId = gpuLoadProgramBinary(*key, &compileSeconds);
+    if (programId != 0) {
+        double saved = compileSeconds - (gpuGetTime() - start);
+        programCacheStats.hits++;
+        programCacheStats.secondsSaved += saved > 0.0 ? saved : 0.0;
+    } else {
+        programCacheStats.misses++;
+    }
+    return programId;
+#else
+    (void)vertexShaderCode;
+    (void)fragmentShaderCode;
+    return 0;
+#endif
+}
+
+/* Like texture generations, shared by all contexts. */
+static uint64_t programSerial;
+
+static GPUStatus gpuFinishProgram(GPUProgram *program, GLuint programId)
+{
+    program->programId = programId;
+    
+    GPUStatus status = gpuReflectParameters(program);
+    if (status != GPUStatusOK) {
+        gpuDeleteProgram(programId);
+        return status;
+    }
+    
+    // Only per-layer batch programs have it; the lookup is not free.
+    program->layerIndexLocation = glGetUniformLocation(programId, "gpuLayerIndex");
+    program->serial = __atomic_add_fetch(&programSerial, 1, __ATOMIC_RELAXED);
+    program->valid = 1;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuCompileProgram(const char *vertexShaderCode, const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
 {
-    switch (colorFormat) {
-        case GPUColorFormatRGB: return GL_RGB;
-        case GPUColorFormatRGBA: return GL_RGBA;
-        case GPUColorFormatBGRA: return GL_BGRA;
-        default: return GL_RGBA;
-    };
+    memset(program, 0, sizeof(GPUProgram));
+    
+    GPU_STATS_START(compileStart);
+    int useCache;
+    uint64_t key;
+    GLuint programId = gpuLookupProgramCache(vertexShaderCode, fragmentShaderCode, &useCache, &key);
+    
+    if (programId == 0) {
+        double start = gpuGetTime();
+        programId = gpuBuildProgram(vertexShaderCode, fragmentShaderCode, useCache, logFunc);
+        if (programId == 0) {
+            // Failed compiles take as long and count all the same.
+            GPU_STATS_RECORD(GPUStatsCategoryCompile, compileStart, 0);
+            return GPUStatusUnknownError;
+        }
+#if GPU_HAVE_PROGRAM_BINARY
+        if (useCache) {
+            gpuStoreProgramBinary(key, programId, gpuGetTime() - start);
+        }
+#else
+        (void)start;
+#endif
+    }
+    
+    GPUStatus status = gpuFinishProgram(program, programId);
+    GPU_STATS_RECORD(GPUStatsCategoryCompile, compileStart, 0);
+    
+    return status;
 }
 
-#pragma mark - Shader Program
+/* Compiles one of the library's own passes, written in the legacy GLSL
+   that works everywhere, with the default vertex shader. Samplers default
+   to low precision on OpenGL ES, which would cut float inputs short. */
+static GPUStatus gpuCompileInternalProgram(const char *fragmentShaderCode, GPUProgram *program)
+{
+#if GPU_OPENGL_ES
+    static const char *precision = "precision highp float;\nprecision highp sampler2D;\n";
+#else
+    static const char *precision = "";
+#endif
+    size_t length = strlen(precision) + strlen(fragmentShaderCode) + 1;
+    char *code = malloc(length);
+    if (code == NULL) {
+        memset(program, 0, sizeof(GPUProgram));
+        return GPUStatusOutOfMemory;
+    }
+    snprintf(code, length, "%s%s", precision, fragmentShaderCode);
+    
+    GPUStatus status = gpuCompileProgram(kGPUDefaultVertexShaderCode, code, program, NULL);
+    free(code);
+    
+    return status;
+}
 
-GPUStatus gpuCompileProgram(const char *vertexShaderCode, const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
+uint64_t gpuGetProgramStateHash(GPUProgram *program)
 {
-    memset(program, 0, sizeof(GPUProgram));
+    if (!program->valid) {
+        return 0;
+    }
     
-    // Create shader program.
-    GLuint programId = glCreateProgram();
+    uint64_t hash = gpuHashBytes64(GPU_HASH_SEED, &program->serial, sizeof(program->serial));
+    uint32_t valueCount = 0;
+    for (uint32_t i = 0; i < program->parameterCount; i++) {
+        GPUParameter *parameter = &program->parameters[i];
+        if (parameter->valueOffset + parameter->components * parameter->size > valueCount) {
+            valueCount = parameter->valueOffset + parameter->components * parameter->size;
+        }
+    }
+    if (program->parameterValues != NULL) {
+        hash = gpuHashBytes64(hash, program->parameterValues, valueCount * sizeof(uint32_t));
+    }
+    for (int i = 0; i < 7; i++) {
+        if (program->additionalTextures[i].textureShouldBeUsed) {
+            GPUTexture *texture = &program->additionalTextures[i].texture;
+            hash = gpuHashBytes64(hash, &i, sizeof(i));
+            hash = gpuHashBytes64(hash, &texture->generation, sizeof(texture->generation));
+        }
+    }
     
-    // Create and compile vertex shader.
+    return hash;
+}
+
+#ifndef GL_COMPLETION_STATUS_KHR
+#define GL_COMPLETION_STATUS_KHR 0x91B1
+#endif
+
+typedef struct GPUCompileJob {
+    struct GPUCompileJob *next;
+    char *vertexShaderCode;
+    char *fragmentShaderCode;
+    void (*logFunc)(const char *log);
+    GLuint programId;
     GLuint vertexShader;
-    int success = gpuCompileShader(&vertexShader, GL_VERTEX_SHADER, vertexShaderCode, logFunc);
+    GLuint fragmentShader;
+    int usesThread;
+    int done;
+    int useCache;
+    uint64_t cacheKey;
+    double startTime;
+} GPUCompileJob;
+
+#if GPU_HAVE_HEADLESS_CONTEXT
+// The compile thread owns a context that shares objects with the context
+// that was current when it was started. Jobs are queued under the mutex.
+static pthread_mutex_t compileMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t compileQueued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t compileFinished = PTHREAD_COND_INITIALIZER;
+static pthread_t compileThread;
+static int compileThreadState; // 0 stopped, 1 starting, 2 running, 3 failed
+static int compileThreadStopping;
+static EGLDisplay compileDisplay;
+static EGLContext compileShareContext;
+static GPUCompileJob *compileQueueHead;
+static GPUCompileJob *compileQueueTail;
+
+static void *gpuCompileThreadMain(void *argument)
+{
+    (void)argument;
     
-    if (!success) {
-        glDeleteProgram(programId);
-        fprintf(stderr, "Failed to compile vertex shader.\n");
-        return GPUStatusUnknownError;
+    EGLContext context = EGL_NO_CONTEXT;
+    EGLSurface surface = EGL_NO_SURFACE;
+    GPUStatus status = gpuCreateEGLContextOnDisplay(compileDisplay, compileShareContext, &context, &surface);
+    
+    pthread_mutex_lock(&compileMutex);
+    compileThreadState = status == GPUStatusOK ? 2 : 3;
+    pthread_cond_broadcast(&compileFinished);
+    
+    while (status == GPUStatusOK) {
+        while (compileQueueHead == NULL && !compileThreadStopping) {
+            pthread_cond_wait(&compileQueued, &compileMutex);
+        }
+        GPUCompileJob *job = compileQueueHead;
+        if (job == NULL) {
+            break;
+        }
+        compileQueueHead = job->next;
+        if (compileQueueHead == NULL) {
+            compileQueueTail = NULL;
+        }
+        pthread_mutex_unlock(&compileMutex);
+        
+        job->programId = gpuBuildProgram(job->vertexShaderCode, job->fragmentShaderCode, job->useCache, job->logFunc);
+        // The program must be complete before another context uses it.
+        glFinish();
+        
+        pthread_mutex_lock(&compileMutex);
+        job->done = 1;
+        pthread_cond_broadcast(&compileFinished);
     }
+    pthread_mutex_unlock(&compileMutex);
     
-    // Create and compile fragment shader.
-    GLuint fragmentShader;
-    success = gpuCompileShader(&fragmentShader, GL_FRAGMENT_SHADER, fragmentShaderCode, logFunc);
-    if (!success) {
-        glDeleteShader(vertexShader);
-        glDeleteProgram(programId);
-        fprintf(stderr, "Failed to compile fragment shader.\n");
+    if (status == GPUStatusOK) {
+        eglMakeCurrent(compileDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (surface != EGL_NO_SURFACE) {
+            eglDestroySurface(compileDisplay, surface);
+        }
+        eglDestroyContext(compileDisplay, context);
+    }
+    eglReleaseThread();
+    
+    return NULL;
+}
+
+/* Starts the compile thread for the current EGL context if needed. Returns
+   0 if there is no EGL context or the shared context cannot be created. */
+static int gpuStartCompileThread(void)
+{
+    pthread_mutex_lock(&compileMutex);
+    if (compileThreadState == 0 && eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        compileDisplay = eglGetCurrentDisplay();
+        compileShareContext = eglGetCurrentContext();
+        compileThreadState = 1;
+        if (pthread_create(&compileThread, NULL, gpuCompileThreadMain, NULL) != 0) {
+            compileThreadState = 0;
+        }
+        while (compileThreadState == 1) {
+            pthread_cond_wait(&compileFinished, &compileMutex);
+        }
+        if (compileThreadState == 3) {
+            fprintf(stderr, "Failed to create shared context for compile thread.\n");
+        }
+    }
+    int running = compileThreadState == 2 && compileShareContext == eglGetCurrentContext();
+    pthread_mutex_unlock(&compileMutex);
+    
+    return running;
+}
+
+void gpuStopCompileThread(void)
+{
+    pthread_mutex_lock(&compileMutex);
+    if (compileThreadState == 0) {
+        pthread_mutex_unlock(&compileMutex);
+        return;
+    }
+    compileThreadStopping = 1;
+    pthread_cond_broadcast(&compileQueued);
+    pthread_mutex_unlock(&compileMutex);
+    
+    // Queued jobs are finished before the thread exits.
+    pthread_join(compileThread, NULL);
+    
+    pthread_mutex_lock(&compileMutex);
+    compileThreadState = 0;
+    compileThreadStopping = 0;
+    compileShareContext = EGL_NO_CONTEXT;
+    pthread_mutex_unlock(&compileMutex);
+}
+
+/* Stops the compile thread only if it shares objects with the context. */
+static void gpuStopCompileThreadSharing(EGLContext context)
+{
+    pthread_mutex_lock(&compileMutex);
+    int sharing = compileThreadState != 0 && compileShareContext == context;
+    pthread_mutex_unlock(&compileMutex);
+    
+    if (sharing) {
+        gpuStopCompileThread();
+    }
+}
+#endif
+
+static void gpuFreeCompileJob(GPUCompileJob *job)
+{
+    free(job->vertexShaderCode);
+    free(job->fragmentShaderCode);
+    free(job);
+}
+
+static void gpuStartParallelCompile(GPUCompileJob *job)
+{
+    // Nothing here queries the result, so the driver compiles and links in
+    // the background until the completion status is polled.
+    const char *vertexShaderCode = job->vertexShaderCode;
+    const char *fragmentShaderCode = job->fragmentShaderCode;
+    job->programId = glCreateProgram();
+    job->vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    glShaderSource(job->vertexShader, 1, &vertexShaderCode, NULL);
+    glCompileShader(job->vertexShader);
+    job->fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
+    glShaderSource(job->fragmentShader, 1, &fragmentShaderCode, NULL);
+    glCompileShader(job->fragmentShader);
+    
+    glAttachShader(job->programId, job->vertexShader);
+    glAttachShader(job->programId, job->fragmentShader);
+    gpuPrepareProgramLink(job->programId, job->useCache);
+    glLinkProgram(job->programId);
+}
+
+static int gpuIsCompileJobDone(GPUCompileJob *job, int wait)
+{
+#if GPU_HAVE_HEADLESS_CONTEXT
+    if (job->usesThread) {
+        pthread_mutex_lock(&compileMutex);
+        while (wait && !job->done) {
+            pthread_cond_wait(&compileFinished, &compileMutex);
+        }
+        int done = job->done;
+        pthread_mutex_unlock(&compileMutex);
+        return done;
+    }
+#endif
+    
+    // Querying the link status blocks until the driver is done.
+    GLint completed = GL_TRUE;
+    if (!wait) {
+        glGetProgramiv(job->programId, GL_COMPLETION_STATUS_KHR, &completed);
+    }
+    return completed == GL_TRUE;
+}
+
+static GPUStatus gpuCompleteCompileJob(GPUProgram *program)
+{
+    GPUCompileJob *job = program->compileJob;
+    program->compileJob = NULL;
+    
+    GLuint programId = job->programId;
+    if (!job->usesThread) {
+        int vertexCompiled = gpuCheckShaderCompiled(job->vertexShader, job->logFunc);
+        int fragmentCompiled = gpuCheckShaderCompiled(job->fragmentShader, job->logFunc);
+        int linked = gpuCheckProgramLinked(programId);
+        glDetachShader(programId, job->vertexShader);
+        glDeleteShader(job->vertexShader);
+        glDetachShader(programId, job->fragmentShader);
+        glDeleteShader(job->fragmentShader);
+        if (!vertexCompiled || !fragmentCompiled || !linked) {
+            fprintf(stderr, "Failed to compile shader program.\n");
+            glDeleteProgram(programId);
+            programId = 0;
+        }
+    }
+    
+#if GPU_HAVE_PROGRAM_BINARY
+    if (programId != 0 && job->useCache) {
+        gpuStoreProgramBinary(job->cacheKey, programId, gpuGetTime() - job->startTime);
+    }
+#endif
+    
+    gpuFreeCompileJob(job);
+    
+    if (programId == 0) {
         return GPUStatusUnknownError;
     }
     
-    // Attach vertex shader to program.
-    glAttachShader(programId, vertexShader);
+    return gpuFinishProgram(program, programId);
+}
+
+GPUStatus gpuCompileProgramAsync(const char *vertexShaderCode, const char *fragmentShaderCode, GPUProgram *program, void (*logFunc)(const char *log))
+{
+    int parallel = gpuGetCapabilities()->parallelShaderCompile;
+    int usesThread = 0;
+#if GPU_HAVE_HEADLESS_CONTEXT
+    usesThread = !parallel && gpuStartCompileThread();
+#endif
+    if (!parallel && !usesThread) {
+        return gpuCompileProgram(vertexShaderCode, fragmentShaderCode, program, logFunc);
+    }
+    
+    memset(program, 0, sizeof(GPUProgram));
+    
+    int useCache;
+    uint64_t key;
+    GLuint programId = gpuLookupProgramCache(vertexShaderCode, fragmentShaderCode, &useCache, &key);
+    if (programId != 0) {
+        return gpuFinishProgram(program, programId);
+    }
+    
+    GPUCompileJob *job = calloc(1, sizeof(GPUCompileJob));
+    if (job == NULL) {
+        return GPUStatusOutOfMemory;
+    }
+    job->vertexShaderCode = strdup(vertexShaderCode);
+    job->fragmentShaderCode = strdup(fragmentShaderCode);
+    if (job->vertexShaderCode == NULL || job->fragmentShaderCode == NULL) {
+        gpuFreeCompileJob(job);
+        return GPUStatusOutOfMemory;
+    }
+    job->logFunc = logFunc;
+    job->usesThread = usesThread;
+    job->useCache = useCache;
+    job->cacheKey = key;
+    job->startTime = gpuGetTime();
+    
+#if GPU_HAVE_HEADLESS_CONTEXT
+    if (usesThread) {
+        pthread_mutex_lock(&compileMutex);
+        if (compileQueueTail != NULL) {
+            compileQueueTail->next = job;
+        } else {
+            compileQueueHead = job;
+        }
+        compileQueueTail = job;
+        pthread_cond_signal(&compileQueued);
+        pthread_mutex_unlock(&compileMutex);
+    }
+#endif
+    if (!usesThread) {
+        gpuStartParallelCompile(job);
+    }
+    
+    program->compileJob = job;
+    
+    return GPUStatusOK;
+}
+
+GPUStatus gpuPollProgram(GPUProgram *program)
+{
+    if (program->compileJob == NULL) {
+        return program->valid ? GPUStatusOK : GPUStatusInvalidProgram;
+    }
+    if (!gpuIsCompileJobDone(program->compileJob, 0)) {
+        return GPUStatusNotReady;
+    }
+    return gpuCompleteCompileJob(program);
+}
+
+GPUStatus gpuWaitForProgram(GPUProgram *program)
+{
+    if (program->compileJob == NULL) {
+        return program->valid ? GPUStatusOK : GPUStatusInvalidProgram;
+    }
+    gpuIsCompileJobDone(program->compileJob, 1);
+    return gpuCompleteCompileJob(program);
+}
+
+void gpuDestroyProgram(GPUProgram *program)
+{
+    if (program->compileJob != NULL) {
+        gpuWaitForProgram(program);
+    }
+    if (program->valid) {
+        program->valid = 0;
+        gpuDeleteProgram(program->programId);
+        free(program->parameters);
+        free(program->parameterValues);
+        program->parameters = NULL;
+        program->parameterValues = NULL;
+        program->parameterCount = 0;
+    }
+}
+
+static int gpuGetParameterTypeInfo(GLenum type, GPUValueType *valueType, uint32_t *components)
+{
+    switch (type) {
+        case GL_FLOAT: *valueType = GPUValueTypeFloat; *components = 1; return 1;
+        case GL_FLOAT_VEC2: *valueType = GPUValueTypeFloat; *components = 2; return 1;
+        case GL_FLOAT_VEC3: *valueType = GPUValueTypeFloat; *components = 3; return 1;
+        case GL_FLOAT_VEC4: *valueType = GPUValueTypeFloat; *components = 4; return 1;
+        case GL_FLOAT_MAT2: *valueType = GPUValueTypeFloat; *components = 4; return 1;
+        case GL_FLOAT_MAT3: *valueType = GPUValueTypeFloat; *components = 9; return 1;
+        case GL_FLOAT_MAT4: *valueType = GPUValueTypeFloat; *components = 16; return 1;
+#ifdef GL_FLOAT_MAT2x3
+        case GL_FLOAT_MAT2x3: *valueType = GPUValueTypeFloat; *components = 6; return 1;
+        case GL_FLOAT_MAT2x4: *valueType = GPUValueTypeFloat; *components = 8; return 1;
+        case GL_FLOAT_MAT3x2: *valueType = GPUValueTypeFloat; *components = 6; return 1;
+        case GL_FLOAT_MAT3x4: *valueType = GPUValueTypeFloat; *components = 12; return 1;
+        case GL_FLOAT_MAT4x2: *valueType = GPUValueTypeFloat; *components = 8; return 1;
+        case GL_FLOAT_MAT4x3: *valueType = GPUValueTypeFloat; *components = 12; return 1;
+#endif
+        case GL_INT: *valueType = GPUValueTypeInt; *components = 1; return 1;
+        case GL_INT_VEC2: *valueType = GPUValueTypeInt; *components = 2; return 1;
+        case GL_INT_VEC3: *valueType = GPUValueTypeInt; *components = 3; return 1;
+        case GL_INT_VEC4: *valueType = GPUValueTypeInt; *components = 4; return 1;
+#ifdef GL_UNSIGNED_INT_VEC2
+        case GL_UNSIGNED_INT: *valueType = GPUValueTypeUnsignedInt; *components = 1; return 1;
+        case GL_UNSIGNED_INT_VEC2: *valueType = GPUValueTypeUnsignedInt; *components = 2; return 1;
+        case GL_UNSIGNED_INT_VEC3: *valueType = GPUValueTypeUnsignedInt; *components = 3; return 1;
+        case GL_UNSIGNED_INT_VEC4: *valueType = GPUValueTypeUnsignedInt; *components = 4; return 1;
+#endif
+        case GL_BOOL: *valueType = GPUValueTypeBool; *components = 1; return 1;
+        case GL_BOOL_VEC2: *valueType = GPUValueTypeBool; *components = 2; return 1;
+        case GL_BOOL_VEC3: *valueType = GPUValueTypeBool; *components = 3; return 1;
+        case GL_BOOL_VEC4: *valueType = GPUValueTypeBool; *components = 4; return 1;
+        default:
+            // Samplers and any other opaque types are set as a single int.
+            *valueType = GPUValueTypeInt;
+            *components = 1;
+            return 0;
+    }
+}
+
+static void gpuReadParameterValues(GPUProgram *program, GPUParameter *parameter, char *elementName)
+{
+    uint32_t *values = program->parameterValues + parameter->valueOffset;
+    for (uint32_t element = 0; element < parameter->size; element++) {
+        int32_t location = parameter->location;
+        if (element > 0) {
+            sprintf(elementName, "%s[%u]", parameter->name, element);
+            location = glGetUniformLocation(program->programId, elementName);
+            if (location == -1) {
+                continue;
+            }
+        }
+        switch (parameter->valueType) {
+            case GPUValueTypeFloat:
+                glGetUniformfv(program->programId, location, (GLfloat *)values);
+                break;
+#ifdef GL_UNSIGNED_INT_VEC2
+            case GPUValueTypeUnsignedInt:
+                glGetUniformuiv(program->programId, location, (GLuint *)values);
+                break;
+#endif
+            default:
+                glGetUniformiv(program->programId, location, (GLint *)values);
+                break;
+        }
+        values += parameter->components;
+    }
+}
+
+static void gpuApplyParameter(GPUProgram *program, GPUParameter *parameter)
+{
+    const void *values = program->parameterValues + parameter->valueOffset;
+    GLint location = parameter->location;
+    GLsizei count = parameter->size;
+    switch (parameter->type) {
+        case GL_FLOAT: glUniform1fv(location, count, values); break;
+        case GL_FLOAT_VEC2: glUniform2fv(location, count, values); break;
+        case GL_FLOAT_VEC3: glUniform3fv(location, count, values); break;
+        case GL_FLOAT_VEC4: glUniform4fv(location, count, values); break;
+        case GL_FLOAT_MAT2: glUniformMatrix2fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT3: glUniformMatrix3fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT4: glUniformMatrix4fv(location, count, GL_FALSE, values); break;
+#ifdef GL_FLOAT_MAT2x3
+        case GL_FLOAT_MAT2x3: glUniformMatrix2x3fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT2x4: glUniformMatrix2x4fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT3x2: glUniformMatrix3x2fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT3x4: glUniformMatrix3x4fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT4x2: glUniformMatrix4x2fv(location, count, GL_FALSE, values); break;
+        case GL_FLOAT_MAT4x3: glUniformMatrix4x3fv(location, count, GL_FALSE, values); break;
+#endif
+#ifdef GL_UNSIGNED_INT_VEC2
+        case GL_UNSIGNED_INT: glUniform1uiv(location, count, values); break;
+        case GL_UNSIGNED_INT_VEC2: glUniform2uiv(location, count, values); break;
+        case GL_UNSIGNED_INT_VEC3: glUniform3uiv(location, count, values); break;
+        case GL_UNSIGNED_INT_VEC4: glUniform4uiv(location, count, values); break;
+#endif
+        case GL_INT_VEC2: case GL_BOOL_VEC2: glUniform2iv(location, count, values); break;
+        case GL_INT_VEC3: case GL_BOOL_VEC3: glUniform3iv(location, count, values); break;
+        case GL_INT_VEC4: case GL_BOOL_VEC4: glUniform4iv(location, count, values); break;
+        default: glUniform1iv(location, count, values); break;
+    }
+}
+
+static void gpuFlushParameters(GPUProgram *program)
+{
+#if GPU_HAVE_HEADLESS_CONTEXT
+    // Executor workers share the program with other contexts but not the
+    // uniform state their context last saw, so they never touch the dirty
+    // flags and apply everything when the values changed.
+    if (currentWorker != NULL) {
+        uint32_t slot = (uint32_t)(program->serial % GPU_EXECUTOR_PARAMETER_SLOTS);
+        if (currentWorker->appliedParameters[slot].serial == program->serial &&
+            currentWorker->appliedParameters[slot].version == program->parameterVersion) {
+            return;
+        }
+        for (uint32_t i = 0; i < program->parameterCount; i++) {
+            gpuApplyParameter(program, &program->parameters[i]);
+        }
+        currentWorker->appliedParameters[slot].serial = program->serial;
+        currentWorker->appliedParameters[slot].version = program->parameterVersion;
+        return;
+    }
+#endif
+    
+    if (!program->hasDirtyParameters) {
+        return;
+    }
+    
+    for (uint32_t i = 0; i < program->parameterCount; i++) {
+        GPUParameter *parameter = &program->parameters[i];
+        if (!parameter->dirty) {
+            continue;
+        }
+        parameter->dirty = 0;
+        gpuApplyParameter(program, parameter);
+    }
+    
+    program->hasDirtyParameters = 0;
+}
+
+static GPUStatus gpuWriteParameter(GPUParameterHandle *handle, GPUValueType valueType,
+                                   uint32_t components, uint32_t count, const void *values)
+{
+    GPUStatus status = gpuCheckParameterHandle(handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    
+    GPUProgram *program = handle->program;
+    GPUParameter *parameter = &program->parameters[handle->index];
+    if (parameter->components != components) {
+        return GPUStatusParameterTypeMismatch;
+    }
+    
+    // Like glUniform*, silently ignore values past the end of the array.
+    if (count > parameter->size - handle->element) {
+        count = parameter->size - handle->element;
+    }
+    
+    uint32_t *shadow = program->parameterValues + parameter->valueOffset + handle->element * components;
+    size_t valueCount = count * components;
+    
+    if (parameter->valueType == valueType) {
+        if (memcmp(shadow, values, valueCount * sizeof(uint32_t)) == 0) {
+            return GPUStatusOK;
+        }
+        memcpy(shadow, values, valueCount * sizeof(uint32_t));
+    } else if (parameter->valueType == GPUValueTypeBool && valueType != GPUValueTypeUnsignedInt) {
+        int changed = 0;
+        for (size_t i = 0; i < valueCount; i++) {
+            uint32_t value = valueType == GPUValueTypeFloat ? ((const float *)values)[i] != 0.0f : ((const int32_t *)values)[i] != 0;
+            if (shadow[i] != value) {
+                shadow[i] = value;
+                changed = 1;
+            }
+        }
+        if (!changed) {
+            return GPUStatusOK;
+        }
+    } else {
+        return GPUStatusParameterTypeMismatch;
+    }
+    
+    parameter->dirty = 1;
+    program->hasDirtyParameters = 1;
+    program->parameterVersion++;
+    
+    return GPUStatusOK;
+}
+
+static GPUStatus gpuReflectParameters(GPUProgram *program)
+{
+    GLint uniformCount = 0;
+    GLint maxNameLength = 0;
+    glGetProgramiv(program->programId, GL_ACTIVE_UNIFORMS, &uniformCount);
+    glGetProgramiv(program->programId, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxNameLength);
+    
+    if (uniformCount > 0) {
+        // Parameters and their names share a single allocation.
+        size_t namesOffset = uniformCount * sizeof(GPUParameter);
+        program->parameters = malloc(namesOffset + uniformCount * (maxNameLength + 1));
+        if (program->parameters == NULL) {
+            return GPUStatusOutOfMemory;
+        }
+        char *names = (char *)program->parameters + namesOffset;
+        uint32_t valueCount = 0;
+        
+        for (GLint i = 0; i < uniformCount; i++) {
+            GLsizei nameLength = 0;
+            GLint size = 0;
+            GLenum type = 0;
+            glGetActiveUniform(program->programId, i, maxNameLength + 1, &nameLength, &size, &type, names);
+            
+            // Built-ins and block members cannot be set through glUniform*.
+            int32_t location = glGetUniformLocation(program->programId, names);
+            if (location == -1) {
+                continue;
+            }
+            
+            // Arrays are reported as "name[0]"; store them under "name".
+            if (nameLength > 3 && strcmp(names + nameLength - 3, "[0]") == 0) {
+                nameLength -= 3;
+                names[nameLength] = '\0';
+            }
+            
+            GPUParameter *parameter = &program->parameters[program->parameterCount++];
+            parameter->name = names;
+            parameter->nameHash = gpuHashString(names, nameLength);
+            parameter->location = location;
+            parameter->type = type;
+            parameter->size = size;
+            
+            GPUValueType valueType;
+            gpuGetParameterTypeInfo(type, &valueType, &parameter->components);
+            parameter->valueType = valueType;
+            parameter->valueOffset = valueCount;
+            valueCount += parameter->components * size;
+            
+            names += nameLength + 1;
+        }
+        
+        gpuAssignSamplerUnits(program);
+        
+        // Start from the values the driver holds, which includes any
+        // initializers in the shader source, so nothing is dirty yet.
+        program->parameterValues = calloc(valueCount > 0 ? valueCount : 1, sizeof(uint32_t));
+        char *elementName = malloc(maxNameLength + 16);
+        if (program->parameterValues == NULL || elementName == NULL) {
+            free(elementName);
+            free(program->parameterValues);
+            free(program->parameters);
+            program->parameterValues = NULL;
+            program->parameters = NULL;
+            program->parameterCount = 0;
+            return GPUStatusOutOfMemory;
+        }
+        for (uint32_t i = 0; i < program->parameterCount; i++) {
+            gpuReadParameterValues(program, &program->parameters[i], elementName);
+        }
+        free(elementName);
+    } else {
+        gpuAssignSamplerUnits(program);
+    }
+    
+    return GPUStatusOK;
+}
+
+/* The location of the first of the named samplers the program has, or -1. */
+static int32_t gpuFindSamplerLocation(GPUProgram *program, const char *name, const char *coreName)
+{
+    int32_t index = gpuFindParameter(program, name, strlen(name));
+    if (index < 0) {
+        index = gpuFindParameter(program, coreName, strlen(coreName));
+    }
+    return index < 0 ? -1 : program->parameters[index].location;
+}
+
+/* Samplers never change units, so they are set once here instead of on
+   every draw: texture uses unit 0 and texture2 to texture8 units 1 to 7.
+   GLSL 1.30 and later have a texture() function, which a sampler named
+   texture would hide, so inputTexture to inputTexture8 work as well. */
+static void gpuAssignSamplerUnits(GPUProgram *program)
+{
+    static const char *samplerNames[7] = {
+        "texture2", "texture3", "texture4", "texture5", "texture6", "texture7", "texture8"
+    };
+    static const char *coreSamplerNames[7] = {
+        "inputTexture2", "inputTexture3", "inputTexture4", "inputTexture5",
+        "inputTexture6", "inputTexture7", "inputTexture8"
+    };
+    
+    program->textureUniformLocation = gpuFindSamplerLocation(program, "texture", "inputTexture");
+    for (int i = 0; i < 7; i++) {
+        program->additionalTextures[i].uniformLocation = gpuFindSamplerLocation(program, samplerNames[i], coreSamplerNames[i]);
+    }
+    
+    gpuUseProgram(program->programId);
+    if (program->textureUniformLocation != -1) {
+        glUniform1i(program->textureUniformLocation, 0);
+    }
+    for (int i = 0; i < 7; i++) {
+        if (program->additionalTextures[i].uniformLocation != -1) {
+            glUniform1i(program->additionalTextures[i].uniformLocation, i + 1);
+        }
+    }
+}
+
+static int32_t gpuFindParameter(GPUProgram *program, const char *name, size_t length)
+{
+    uint32_t hash = gpuHashString(name, length);
+    for (uint32_t i = 0; i < program->parameterCount; i++) {
+        GPUParameter *parameter = &program->parameters[i];
+        if (parameter->nameHash == hash &&
+            strncmp(parameter->name, name, length) == 0 &&
+            parameter->name[length] == '\0') {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+GPUStatus gpuGetParameterHandle(GPUProgram *program, const char *name, GPUParameterHandle *handle)
+{
+    handle->program = program;
+    handle->index = -1;
+    handle->element = 0;
+    handle->location = -1;
     
-    // Attach fragment shader to program.
-    glAttachShader(programId, fragmentShader);
+    if (!program->valid) {
+        return GPUStatusInvalidProgram;
+    }
     
-    // Bind attribute locations.
-    // This needs to be done prior to linking.
-    glBindAttribLocation(programId, 0, "inputPosition");
-    glBindAttribLocation(programId, 1, "inputUV");
+    size_t length = strlen(name);
+    int32_t index = gpuFindParameter(program, name, length);
+    if (index >= 0) {
+        handle->index = index;
+        handle->location = program->parameters[index].location;
+        return GPUStatusOK;
+    }
     
-    // Link program.
-    success = gpuLinkProgram(programId);
-    if (!success) {
-        glDetachShader(programId, vertexShader);
-        glDeleteShader(vertexShader);
-        glDetachShader(programId, fragmentShader);
-        glDeleteShader(fragmentShader);
-        glDeleteProgram(programId);
-        fprintf(stderr, "Failed to compile shader program.\n");
-        return GPUStatusUnknownError;
+    // Resolve "name[element]" against the array parameter "name".
+    const char *bracket = strchr(name, '[');
+    if (bracket == NULL || name[length - 1] != ']') {
+        return GPUStatusNoSuchParameter;
     }
     
-    // Release vertex and fragment shaders.
-    glDetachShader(programId, vertexShader);
-    glDeleteShader(vertexShader);
-    glDetachShader(programId, fragmentShader);
-    glDeleteShader(fragmentShader);
+    char *end = NULL;
+    unsigned long element = strtoul(bracket + 1, &end, 10);
+    if (end != name + length - 1) {
+        return GPUStatusNoSuchParameter;
+    }
     
-    program->programId = programId;
-    program->textureUniformLocation = glGetUniformLocation(program->programId, "texture");
-    program->additionalTextures[0].uniformLocation = glGetUniformLocation(program->programId, "texture2");
-    program->additionalTextures[1].uniformLocation = glGetUniformLocation(program->programId, "texture3");
-    program->additionalTextures[2].uniformLocation = glGetUniformLocation(program->programId, "texture4");
-    program->additionalTextures[3].uniformLocation = glGetUniformLocation(program->programId, "texture5");
-    program->additionalTextures[4].uniformLocation = glGetUniformLocation(program->programId, "texture6");
-    program->additionalTextures[5].uniformLocation = glGetUniformLocation(program->programId, "texture7");
-    program->additionalTextures[6].uniformLocation = glGetUniformLocation(program->programId, "texture8");
+    index = gpuFindParameter(program, name, bracket - name);
+    if (index < 0 || element >= program->parameters[index].size) {
+        return GPUStatusNoSuchParameter;
+    }
     
-    program->valid = 1;
+    handle->index = index;
+    handle->element = (uint32_t)element;
+    handle->location = element == 0 ? program->parameters[index].location : glGetUniformLocation(program->programId, name);
     
     return GPUStatusOK;
 }
 
-void gpuDestroyProgram(GPUProgram *program)
+static GPUStatus gpuCheckParameterHandle(GPUParameterHandle *handle)
 {
-    if (program->valid) {
-        program->valid = 0;
-        glDeleteProgram(program->programId);
+    if (handle->program == NULL || !handle->program->valid) {
+        return GPUStatusInvalidProgram;
+    }
+    if (handle->index < 0 || handle->location == -1) {
+        return GPUStatusNoSuchParameter;
     }
+    return GPUStatusOK;
 }
 
 static int gpuCompileShader(GLuint *shader, GLenum type, const char *sourceCode, void (*logFunc)(const char *log))
 {
-    GLint status;
-    
     *shader = glCreateShader(type);
     glShaderSource(*shader, 1, &sourceCode, NULL);
     glCompileShader(*shader);
     
-    glGetShaderiv(*shader, GL_COMPILE_STATUS, &status);
+    if (!gpuCheckShaderCompiled(*shader, logFunc)) {
+        glDeleteShader(*shader);
+        return 0;
+    }
+    
+    return 1;
+}
+
+static int gpuCheckShaderCompiled(GLuint shader, void (*logFunc)(const char *log))
+{
+    GLint status;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
     if (status == 0) {
         GLint logLength;
-        glGetShaderiv(*shader, GL_INFO_LOG_LENGTH, &logLength);
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
         if (logLength > 0) {
             GLchar *log = (GLchar *)malloc(logLength);
-            glGetShaderInfoLog(*shader, logLength, &logLength, log);
+            glGetShaderInfoLog(shader, logLength, &logLength, log);
             printf("Shader compile log:\n%s\n", log);
             if (logFunc != NULL) {
                 logFunc(log);
@@ -421,7 +6688,6 @@ static int gpuCompileShader(GLuint *shader, GLenum type, const char *sourceCode,
             free(log);
         }
         
-        glDeleteShader(*shader);
         return 0;
     }
     
@@ -430,9 +6696,14 @@ static int gpuCompileShader(GLuint *shader, GLenum type, const char *sourceCode,
 
 static int gpuLinkProgram(GLuint program)
 {
-    GLint status;
     glLinkProgram(program);
     
+    return gpuCheckProgramLinked(program);
+}
+
+static int gpuCheckProgramLinked(GLuint program)
+{
+    GLint status;
     glGetProgramiv(program, GL_LINK_STATUS, &status);
     if (status == 0) {
         GLint logLength;
@@ -450,395 +6721,852 @@ static int gpuLinkProgram(GLuint program)
     return 1;
 }
 
-void gpuSetSecondTextureForProgram(GPUTexture *texture, GPUProgram *program)
+void gpuSetSecondTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[0].textureShouldBeUsed = 1;
+    program->additionalTextures[0].texture = *texture;
+}
+
+void gpuSetThirdTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[1].textureShouldBeUsed = 1;
+    program->additionalTextures[1].texture = *texture;
+}
+
+void gpuSetFourthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[2].textureShouldBeUsed = 1;
+    program->additionalTextures[2].texture = *texture;
+}
+
+void gpuSetFifthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[3].textureShouldBeUsed = 1;
+    program->additionalTextures[3].texture = *texture;
+}
+
+void gpuSetSixthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[4].textureShouldBeUsed = 1;
+    program->additionalTextures[4].texture = *texture;
+}
+
+void gpuSetSeventhTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[5].textureShouldBeUsed = 1;
+    program->additionalTextures[5].texture = *texture;
+}
+
+void gpuSetEigthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+{
+    program->additionalTextures[6].textureShouldBeUsed = 1;
+    program->additionalTextures[6].texture = *texture;
+}
+
+GPUStatus gpuSetFloatForProgram(const char *name, float value, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetFloatByHandle(handle, value);
+}
+
+GPUStatus gpuSet2FloatsForProgram(const char *name, float value0, float value1, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet2FloatsByHandle(handle, value0, value1);
+}
+
+GPUStatus gpuSet3FloatsForProgram(const char *name, float value0, float value1, float value2, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet3FloatsByHandle(handle, value0, value1, value2);
+}
+
+GPUStatus gpuSet4FloatsForProgram(const char *name, float value0, float value1, float value2, float value3, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet4FloatsByHandle(handle, value0, value1, value2, value3);
+}
+
+GPUStatus gpuSetIntForProgram(const char *name, int32_t value, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetIntByHandle(handle, value);
+}
+
+GPUStatus gpuSet2IntsForProgram(const char *name, int value0, int value1, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet2IntsByHandle(handle, value0, value1);
+}
+
+GPUStatus gpuSet3IntsForProgram(const char *name, int value0, int value1, int value2, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet3IntsByHandle(handle, value0, value1, value2);
+}
+
+GPUStatus gpuSet4IntsForProgram(const char *name, int value0, int value1, int value2, int value3, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSet4IntsByHandle(handle, value0, value1, value2, value3);
+}
+
+GPUStatus gpuSetVector2ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector2ByHandle(handle, values);
+}
+
+GPUStatus gpuSetVector3ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector3ByHandle(handle, values);
+}
+
+GPUStatus gpuSetVector4ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector4ByHandle(handle, values);
+}
+
+GPUStatus gpuSetFloatArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetFloatArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetVector2ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector2ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetVector3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector3ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetVector4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetVector4ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetIntArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetIntArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetIntVector2ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetIntVector2ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetIntVector3ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetIntVector3ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetIntVector4ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetIntVector4ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetMatrix2x2ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix2x2ByHandle(handle, values);
+}
+
+GPUStatus gpuSetMatrix3x3ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix3x3ByHandle(handle, values);
+}
+
+GPUStatus gpuSetMatrix4x4ForProgram(const char *name, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix4x4ByHandle(handle, values);
+}
+
+GPUStatus gpuSetMatrix2x2ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix2x2ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetMatrix3x3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix3x3ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetMatrix4x4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+{
+    GPUParameterHandle handle;
+    GPUStatus status = gpuGetParameterHandle(program, name, &handle);
+    if (status != GPUStatusOK) {
+        return status;
+    }
+    return gpuSetMatrix4x4ArrayByHandle(handle, count, values);
+}
+
+GPUStatus gpuSetFloatByHandle(GPUParameterHandle handle, float value)
+{
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 1, 1, &value);
+}
+
+GPUStatus gpuSet2FloatsByHandle(GPUParameterHandle handle, float value0, float value1)
+{
+    float values[2] = { value0, value1 };
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 2, 1, values);
+}
+
+GPUStatus gpuSet3FloatsByHandle(GPUParameterHandle handle, float value0, float value1, float value2)
+{
+    float values[3] = { value0, value1, value2 };
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 3, 1, values);
+}
+
+GPUStatus gpuSet4FloatsByHandle(GPUParameterHandle handle, float value0, float value1, float value2, float value3)
+{
+    float values[4] = { value0, value1, value2, value3 };
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 4, 1, values);
+}
+
+GPUStatus gpuSetIntByHandle(GPUParameterHandle handle, int32_t value)
+{
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 1, 1, &value);
+}
+
+GPUStatus gpuSet2IntsByHandle(GPUParameterHandle handle, int value0, int value1)
+{
+    int32_t values[2] = { value0, value1 };
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 2, 1, values);
+}
+
+GPUStatus gpuSet3IntsByHandle(GPUParameterHandle handle, int value0, int value1, int value2)
+{
+    int32_t values[3] = { value0, value1, value2 };
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 3, 1, values);
+}
+
+GPUStatus gpuSet4IntsByHandle(GPUParameterHandle handle, int value0, int value1, int value2, int value3)
+{
+    int32_t values[4] = { value0, value1, value2, value3 };
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 4, 1, values);
+}
+
+GPUStatus gpuSetVector2ByHandle(GPUParameterHandle handle, const float *values)
+{
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 2, 1, values);
+}
+
+GPUStatus gpuSetVector3ByHandle(GPUParameterHandle handle, const float *values)
+{
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 3, 1, values);
+}
+
+GPUStatus gpuSetVector4ByHandle(GPUParameterHandle handle, const float *values)
+{
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 4, 1, values);
+}
+
+GPUStatus gpuSetFloatArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    program->additionalTextures[0].textureShouldBeUsed = 1;
-    program->additionalTextures[0].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 1, count, values);
 }
 
-void gpuSetThirdTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetVector2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    program->additionalTextures[1].textureShouldBeUsed = 1;
-    program->additionalTextures[1].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 2, count, values);
 }
 
-void gpuSetFourthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetVector3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    program->additionalTextures[2].textureShouldBeUsed = 1;
-    program->additionalTextures[2].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 3, count, values);
 }
 
-void gpuSsetFifthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetVector4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    program->additionalTextures[3].textureShouldBeUsed = 1;
-    program->additionalTextures[3].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 4, count, values);
 }
 
-void gpuSetSixthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetIntArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values)
 {
-    program->additionalTextures[4].textureShouldBeUsed = 1;
-    program->additionalTextures[4].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 1, count, values);
 }
 
-void gpuSetSeventhTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetIntVector2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values)
 {
-    program->additionalTextures[5].textureShouldBeUsed = 1;
-    program->additionalTextures[5].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 2, count, values);
 }
 
-void gpuSetEigthTextureForProgram(GPUTexture *texture, GPUProgram *program)
+GPUStatus gpuSetIntVector3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values)
 {
-    program->additionalTextures[6].textureShouldBeUsed = 1;
-    program->additionalTextures[6].texture = *texture;
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 3, count, values);
 }
 
-GPUStatus gpuSetFloatForProgram(const char *name, float value, GPUProgram *program)
+GPUStatus gpuSetIntVector4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform1f(location, value);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeInt, 4, count, values);
 }
 
-GPUStatus gpuSset2FloatsForProgram(const char *name, float value0, float value1, GPUProgram *program)
+GPUStatus gpuSetMatrix2x2ByHandle(GPUParameterHandle handle, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform2f(location, value0, value1);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 4, 1, values);
 }
 
-GPUStatus gpuSet3FloatsForProgram(const char *name, float value0, float value1, float value2, GPUProgram *program)
+GPUStatus gpuSetMatrix3x3ByHandle(GPUParameterHandle handle, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform3f(location, value0, value1, value2);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 9, 1, values);
 }
 
-GPUStatus gpuSet4FloatsForProgram(const char *name, float value0, float value1, float value2, float value3, GPUProgram *program)
+GPUStatus gpuSetMatrix4x4ByHandle(GPUParameterHandle handle, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform4f(location, value0, value1, value2, value3);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 16, 1, values);
 }
 
-GPUStatus gpuSetIntForProgram(const char *name, int32_t value, GPUProgram *program)
+GPUStatus gpuSetMatrix2x2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform1i(location, value);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 4, count, values);
 }
 
-GPUStatus gpuSet2IntsForProgram(const char *name, int value0, int value1, GPUProgram *program)
+GPUStatus gpuSetMatrix3x3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform2i(location, value0, value1);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 9, count, values);
 }
 
-GPUStatus gpuSet3IntsForProgram(const char *name, int value0, int value1, int value2, GPUProgram *program)
+GPUStatus gpuSetMatrix4x4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform3i(location, value0, value1, value2);
-    return GPUStatusOK;
+    return gpuWriteParameter(&handle, GPUValueTypeFloat, 16, count, values);
 }
 
-GPUStatus gpuSet4IntsForProgram(const char *name, int value0, int value1, int value2, int value3, GPUProgram *program)
+#pragma mark - Stats
+
+#if GPU_ENABLE_STATS
+#define GPU_STATS_QUERY_COUNT 32
+
+// A draw's name is the label of the filter chain or graph pass that issued
+// it, or NULL for draws made directly.
+typedef struct GPUStatsEvent {
+    const char *name;
+    uint32_t passIndex;
+    uint32_t onGPU;
+    uint32_t programId;
+    uint32_t width;
+    uint32_t height;
+    uint64_t bytes;
+    double start;
+    double duration;
+} GPUStatsEvent;
+
+// Timer queries are used round-robin. A draw is only timed if the next
+// query's result has been collected, so reading results never stalls.
+typedef struct GPUStatsState {
+    GPUStats stats;
+    GPUStatsEvent *events;
+    uint32_t eventStart;
+    uint32_t eventCount;
+    const char *passLabel;
+    uint32_t passIndex;
+#if GPU_HAVE_TIMER_QUERY
+    GLuint queries[GPU_STATS_QUERY_COUNT];
+    GPUStatsEvent pendingDraws[GPU_STATS_QUERY_COUNT];
+    uint32_t pendingStart;
+    uint32_t pendingCount;
+    int drawTimed;
+#if GPU_OPENGL_ES
+    PFNGLGETQUERYOBJECTUI64VEXTPROC getQueryObjectui64v;
+#endif
+#endif
+} GPUStatsState;
+
+static GPU_THREAD_LOCAL GPUStatsState statsState;
+
+/* Keeps the most recent GPU_STATS_MAX_EVENTS events for the trace. */
+static void gpuRecordStatsEvent(const GPUStatsEvent *event)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    if (statsState.events == NULL) {
+        statsState.events = malloc(GPU_STATS_MAX_EVENTS * sizeof(GPUStatsEvent));
+        if (statsState.events == NULL) {
+            return;
+        }
     }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    statsState.events[(statsState.eventStart + statsState.eventCount) % GPU_STATS_MAX_EVENTS] = *event;
+    if (statsState.eventCount < GPU_STATS_MAX_EVENTS) {
+        statsState.eventCount++;
+    } else {
+        statsState.eventStart = (statsState.eventStart + 1) % GPU_STATS_MAX_EVENTS;
     }
-    glUniform4i(location, value0, value1, value2, value3);
-    return GPUStatusOK;
 }
 
-GPUStatus gpuSetVector2ForProgram(const char *name, const float *values, GPUProgram *program)
+static void gpuRecordCPUTiming(GPUStatsCategory category, double start, uint64_t bytes)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
+    static const char *names[] = { "upload", "readback", "readback wait", "compile" };
+    double duration = gpuGetTime() - start;
+    GPUStats *stats = &statsState.stats;
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    switch (category) {
+        case GPUStatsCategoryUpload:
+            stats->uploads++;
+            stats->bytesUploaded += bytes;
+            stats->uploadSeconds += duration;
+            break;
+        case GPUStatsCategoryReadback:
+            stats->readbacks++;
+            stats->bytesRead += bytes;
+            stats->readbackSeconds += duration;
+            break;
+        case GPUStatsCategoryReadbackWait:
+            stats->readbackSeconds += duration;
+            break;
+        case GPUStatsCategoryCompile:
+            stats->compiles++;
+            stats->compileSeconds += duration;
+            break;
     }
-    glUniform2fv(location, 1, values);
-    return GPUStatusOK;
+    
+    GPUStatsEvent event = { names[category], 0, 0, 0, 0, 0, bytes, start, duration };
+    gpuRecordStatsEvent(&event);
 }
 
-GPUStatus gpuSetVector3ForProgram(const char *name, const float *values, GPUProgram *program)
+/* Reads the results of finished draws, oldest first, without waiting. */
+static void gpuCollectDrawTimings(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+#if GPU_HAVE_TIMER_QUERY
+    while (statsState.pendingCount > 0) {
+        uint32_t slot = statsState.pendingStart;
+        GLuint available = 0;
+        glGetQueryObjectuiv(statsState.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        if (!available) {
+            return;
+        }
+        GLuint64 elapsed = 0;
+#if GPU_OPENGL_ES
+        statsState.getQueryObjectui64v(statsState.queries[slot], GL_QUERY_RESULT, &elapsed);
+        // Results are meaningless across a disjoint operation such as a
+        // change of the GPU clock.
+        GLint disjoint = 0;
+        glGetIntegerv(GL_GPU_DISJOINT_EXT, &disjoint);
+#else
+        glGetQueryObjectui64v(statsState.queries[slot], GL_QUERY_RESULT, &elapsed);
+        GLint disjoint = 0;
+#endif
+        statsState.pendingStart = (slot + 1) % GPU_STATS_QUERY_COUNT;
+        statsState.pendingCount--;
+        
+        if (disjoint) {
+            statsState.stats.droppedTimings++;
+            continue;
+        }
+        GPUStatsEvent *event = &statsState.pendingDraws[slot];
+        event->duration = elapsed * 1e-9;
+        statsState.stats.timedDraws++;
+        statsState.stats.gpuSeconds += event->duration;
+        gpuRecordStatsEvent(event);
     }
-    glUniform3fv(location, 1, values);
-    return GPUStatusOK;
+#endif
 }
 
-GPUStatus gpuSetVector4ForProgram(const char *name, const float *values, GPUProgram *program)
+static void gpuBeginDrawTiming(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    statsState.stats.draws++;
+#if GPU_HAVE_TIMER_QUERY
+    statsState.drawTimed = 0;
+    if (!gpuGetCapabilities()->timerQuery) {
+        return;
+    }
+    if (statsState.queries[0] == 0) {
+#if GPU_OPENGL_ES
+        statsState.getQueryObjectui64v =
+            (PFNGLGETQUERYOBJECTUI64VEXTPROC)eglGetProcAddress("glGetQueryObjectui64vEXT");
+        if (statsState.getQueryObjectui64v == NULL) {
+            return;
+        }
+#endif
+        glGenQueries(GPU_STATS_QUERY_COUNT, statsState.queries);
     }
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    gpuCollectDrawTimings();
+    if (statsState.pendingCount == GPU_STATS_QUERY_COUNT) {
+        statsState.stats.droppedTimings++;
+        return;
     }
-    glUniform4fv(location, 1, values);
-    return GPUStatusOK;
+    
+    uint32_t slot = (statsState.pendingStart + statsState.pendingCount) % GPU_STATS_QUERY_COUNT;
+    GPUStatsEvent event = { statsState.passLabel, statsState.passIndex, 1, stateCache.program,
+                            stateCache.viewportWidth, stateCache.viewportHeight, 0, gpuGetTime(), 0.0 };
+    statsState.pendingDraws[slot] = event;
+#if GPU_OPENGL_ES
+    glBeginQuery(GL_TIME_ELAPSED_EXT, statsState.queries[slot]);
+#else
+    glBeginQuery(GL_TIME_ELAPSED, statsState.queries[slot]);
+#endif
+    statsState.drawTimed = 1;
+#endif
 }
 
-GPUStatus gpuSetFloatArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+static void gpuEndDrawTiming(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+#if GPU_HAVE_TIMER_QUERY
+    if (statsState.drawTimed) {
+#if GPU_OPENGL_ES
+        glEndQuery(GL_TIME_ELAPSED_EXT);
+#else
+        glEndQuery(GL_TIME_ELAPSED);
+#endif
+        statsState.pendingCount++;
     }
-    glUniform1fv(location, count, values);
-    return GPUStatusOK;
+#endif
 }
 
-GPUStatus gpuSetVector2ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+/* Drops pending timings and deletes the queries, which belong to the
+   current context. */
+static void gpuReleaseTimerQueries(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+#if GPU_HAVE_TIMER_QUERY
+    if (statsState.queries[0] != 0) {
+        glDeleteQueries(GPU_STATS_QUERY_COUNT, statsState.queries);
+        memset(statsState.queries, 0, sizeof(statsState.queries));
     }
-    glUniform2fv(location, count, values);
-    return GPUStatusOK;
+    statsState.pendingStart = 0;
+    statsState.pendingCount = 0;
+#endif
 }
 
-GPUStatus gpuSetVector3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+/* Frees the trace events, which would otherwise outlive the thread. */
+static void gpuReleaseStatsEvents(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform3fv(location, count, values);
-    return GPUStatusOK;
+    free(statsState.events);
+    statsState.events = NULL;
+    statsState.eventStart = 0;
+    statsState.eventCount = 0;
 }
 
-GPUStatus gpuSetVector4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+/* Labels the draws the filter chains and graphs issue until called with
+   NULL. */
+static void gpuSetStatsPass(const char *label, uint32_t index)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform4fv(location, count, values);
-    return GPUStatusOK;
+    statsState.passLabel = label;
+    statsState.passIndex = index;
 }
 
-GPUStatus gpuSetIntArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+static void gpuWriteTraceName(FILE *file, const GPUStatsEvent *event)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    if (event->onGPU && event->name != NULL) {
+        fprintf(file, "\"%s %u: program %u %ux%u\"", event->name, event->passIndex,
+                event->programId, event->width, event->height);
+    } else if (event->onGPU) {
+        fprintf(file, "\"program %u %ux%u\"", event->programId, event->width, event->height);
+    } else {
+        fprintf(file, "\"%s\"", event->name);
     }
-    glUniform1iv(location, count, values);
-    return GPUStatusOK;
 }
+#endif
 
-GPUStatus gpuSetIntVector2ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+void gpuGetStats(GPUStats *stats)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform2iv(location, count, values);
-    return GPUStatusOK;
+#if GPU_ENABLE_STATS
+    gpuCollectDrawTimings();
+    *stats = statsState.stats;
+#else
+    memset(stats, 0, sizeof(GPUStats));
+#endif
 }
 
-GPUStatus gpuSetIntVector3ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+void gpuResetStats(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniform3iv(location, count, values);
-    return GPUStatusOK;
+#if GPU_ENABLE_STATS
+    // Draws still in flight count towards the new period.
+    memset(&statsState.stats, 0, sizeof(GPUStats));
+    statsState.eventStart = 0;
+    statsState.eventCount = 0;
+#endif
 }
 
-GPUStatus gpuSetIntVector4ArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program)
+GPUStatus gpuWriteStatsTrace(const char *path)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open %s for the trace.\n", path);
+        return GPUStatusUnknownError;
     }
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"CPU\"}},\n");
+    fprintf(file, "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 2, \"args\": {\"name\": \"GPU\"}}");
+#if GPU_ENABLE_STATS
+    gpuCollectDrawTimings();
+    for (uint32_t i = 0; i < statsState.eventCount; i++) {
+        const GPUStatsEvent *event = &statsState.events[(statsState.eventStart + i) % GPU_STATS_MAX_EVENTS];
+        fprintf(file, ",\n{\"name\": ");
+        gpuWriteTraceName(file, event);
+        fprintf(file, ", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %u, ",
+                event->onGPU ? "gpu" : "cpu", event->start * 1e6, event->duration * 1e6, event->onGPU ? 2 : 1);
+        if (event->onGPU && event->name != NULL) {
+            fprintf(file, "\"args\": {\"pass\": %u, \"program\": %u, \"width\": %u, \"height\": %u}}",
+                    event->passIndex, event->programId, event->width, event->height);
+        } else if (event->onGPU) {
+            fprintf(file, "\"args\": {\"program\": %u, \"width\": %u, \"height\": %u}}",
+                    event->programId, event->width, event->height);
+        } else {
+            fprintf(file, "\"args\": {\"bytes\": %llu}}", (unsigned long long)event->bytes);
+        }
+    }
+#endif
+    fprintf(file, "\n]}\n");
+    
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to write the trace to %s.\n", path);
+        return GPUStatusUnknownError;
     }
-    glUniform4iv(location, count, values);
+    
     return GPUStatusOK;
 }
 
-GPUStatus gpuSsetMatrix2x2ForProgram(const char *name, const float *values, GPUProgram *program)
+#pragma mark - Utilities
+
+static GPU_THREAD_LOCAL GPUCapabilities capabilities;
+
+static int gpuHasExtension(const char *name)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+#if GPU_HAVE_GL3
+    GLint extensionCount = 0;
+    glGetIntegerv(GL_NUM_EXTENSIONS, &extensionCount);
+    for (GLint i = 0; i < extensionCount; i++) {
+        const char *extension = (const char *)glGetStringi(GL_EXTENSIONS, i);
+        if (extension != NULL && strcmp(extension, name) == 0) {
+            return 1;
+        }
     }
-    glUniformMatrix2fv(location, 1, GL_FALSE, values);
-    return GPUStatusOK;
+    return 0;
+#else
+    return gpuExtensionListContains((const char *)glGetString(GL_EXTENSIONS), name);
+#endif
 }
 
-GPUStatus gpuSetMatrix3x3ForProgram(const char *name, const float *values, GPUProgram *program)
+static const GPUCapabilities *gpuGetCapabilities(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    if (capabilities.detected) {
+        return &capabilities;
     }
+    capabilities.detected = 1;
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    // Both "4.5 (Compatibility Profile) ..." and "OpenGL ES 3.2 ..." forms.
+    const char *version = (const char *)glGetString(GL_VERSION);
+    if (version != NULL) {
+        while (*version != '\0' && (*version < '0' || *version > '9')) {
+            version++;
+        }
+        sscanf(version, "%d.%d", &capabilities.majorVersion, &capabilities.minorVersion);
     }
-    glUniformMatrix3fv(location, 1, GL_FALSE, values);
-    return GPUStatusOK;
-}
-
-GPUStatus gpuSetMatrix4x4ForProgram(const char *name, const float *values, GPUProgram *program)
-{
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    int glVersion = capabilities.majorVersion * 10 + capabilities.minorVersion;
+    
+#if GPU_OPENGL_ES
+    capabilities.textureStorage = glVersion >= 30;
+    capabilities.textureArrays = GPU_HAVE_GL3 && glVersion >= 30;
+    capabilities.floatLinear = gpuHasExtension("GL_OES_texture_float_linear");
+    capabilities.floatBlend = gpuHasExtension("GL_EXT_float_blend");
+    capabilities.timerQuery = gpuHasExtension("GL_EXT_disjoint_timer_query");
+#else
+    capabilities.textureStorage = glVersion >= 42 || gpuHasExtension("GL_ARB_texture_storage");
+    capabilities.bufferStorage = glVersion >= 44 || gpuHasExtension("GL_ARB_buffer_storage");
+    capabilities.textureArrays = glVersion >= 30;
+    capabilities.floatLinear = 1;
+    capabilities.floatBlend = 1;
+    capabilities.timerQuery = glVersion >= 33 || gpuHasExtension("GL_ARB_timer_query");
+    // Layered attachments are core in 3.2; writing gl_Layer from the
+    // vertex shader needs one of these.
+    capabilities.layeredRendering = glVersion >= 32 &&
+        (gpuHasExtension("GL_ARB_shader_viewport_layer_array") ||
+         gpuHasExtension("GL_AMD_vertex_shader_layer"));
+#endif
+    
+#if GPU_HAVE_PROGRAM_BINARY
+    // A driver may support the API but offer no binary formats.
+    GLint binaryFormatCount = 0;
+#if GPU_OPENGL_ES
+    if (glVersion >= 30) {
+#else
+    if (glVersion >= 41 || gpuHasExtension("GL_ARB_get_program_binary")) {
+#endif
+        glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount);
     }
+    capabilities.programBinary = binaryFormatCount > 0;
+#endif
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+#if GPU_HAVE_HEADLESS_CONTEXT
+    // The entry point is only looked up through EGL, so OSMesa contexts
+    // compile synchronously or on the compile thread.
+    if (eglGetCurrentContext() != EGL_NO_CONTEXT) {
+        const char *maxThreadsName = NULL;
+        if (gpuHasExtension("GL_KHR_parallel_shader_compile")) {
+            maxThreadsName = "glMaxShaderCompilerThreadsKHR";
+        } else if (gpuHasExtension("GL_ARB_parallel_shader_compile")) {
+            maxThreadsName = "glMaxShaderCompilerThreadsARB";
+        }
+        void (*maxShaderCompilerThreads)(GLuint) = NULL;
+        if (maxThreadsName != NULL) {
+            maxShaderCompilerThreads = (void (*)(GLuint))eglGetProcAddress(maxThreadsName);
+        }
+        if (maxShaderCompilerThreads != NULL) {
+            // Let the driver pick the number of threads.
+            maxShaderCompilerThreads(0xFFFFFFFFu);
+            capabilities.parallelShaderCompile = 1;
+        }
     }
-    glUniformMatrix4fv(location, 1, GL_FALSE, values);
-    return GPUStatusOK;
+#endif
+    
+    return &capabilities;
 }
 
-GPUStatus gpuSetMatrix2x2ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+static int gpuExtensionListContains(const char *extensions, const char *name)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
+    if (extensions == NULL) {
+        return 0;
     }
     
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    size_t length = strlen(name);
+    const char *start = extensions;
+    while ((start = strstr(start, name)) != NULL) {
+        const char *end = start + length;
+        if ((start == extensions || start[-1] == ' ') && (*end == ' ' || *end == '\0')) {
+            return 1;
+        }
+        start = end;
     }
-    glUniformMatrix2fv(location, count, GL_FALSE, values);
-    return GPUStatusOK;
+    
+    return 0;
 }
 
-GPUStatus gpuSetMatrix3x3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+static uint64_t gpuHashBytes64(uint64_t hash, const void *data, size_t length)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
+    // FNV-1a, continuing from hash. Start with 14695981039346656037.
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
     }
-    glUniformMatrix3fv(location, count, GL_FALSE, values);
-    return GPUStatusOK;
+    return hash;
 }
 
-GPUStatus gpuSetMatrix4x4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program)
+static double gpuGetTime(void)
 {
-    if (!program->valid) {
-        return GPUStatusInvalidProgram;
-    }
-    
-    int32_t location = glGetUniformLocation(program->programId, name);
-    if (location == -1) {
-        return GPUStatusNoSuchParameter;
-    }
-    glUniformMatrix4fv(location, count, GL_FALSE, values);
-    return GPUStatusOK;
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (double)time.tv_sec + (double)time.tv_nsec * 1e-9;
 }
 
+static uint32_t gpuHashString(const char *string, size_t length)
+{
+    // FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)string[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
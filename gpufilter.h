@@ -37,8 +37,51 @@
 #include <OpenGLES/ES2/gl.h>
 #include <OpenGLES/ES2/glext.h>
 #endif
+#elif defined(__linux__)
+/* Define GPU_USE_GLES to build against OpenGL ES 3 instead of desktop GL,
+   GPU_USE_CORE_PROFILE for a 3.3 core profile headless context, and
+   GPU_USE_OSMESA to enable the OSMesa headless fallback (desktop GL only). */
+#if GPU_USE_GLES
+#include <GLES3/gl3.h>
+#include <GLES2/gl2ext.h>
+#ifndef GL_BGRA
+#define GL_BGRA GL_BGRA_EXT
+#endif
+#else
+#ifndef GL_GLEXT_PROTOTYPES
+#define GL_GLEXT_PROTOTYPES 1
+#endif
+#include <GL/gl.h>
+#include <GL/glext.h>
+#if GPU_USE_OSMESA
+#include <GL/osmesa.h>
+#endif
+#endif
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#define GPU_HAVE_HEADLESS_CONTEXT 1
+#else
+#error This file is only meant for OS X, iOS or Linux.
+#endif
+
+#if TARGET_OS_IPHONE || GPU_USE_GLES
+#define GPU_OPENGL_ES 1
 #else
-#error This file is only meant for OS X or iOS.
+#define GPU_OPENGL_ES 0
+#endif
+
+/* Pixel buffer objects, sync objects and friends. Missing on OpenGL ES 2. */
+#if TARGET_OS_IPHONE
+#define GPU_HAVE_GL3 0
+#else
+#define GPU_HAVE_GL3 1
+#endif
+
+/* Define GPU_ENABLE_STATS to 1 to count draws and transfers and time them,
+   draws on the GPU and uploads, readbacks and compiles on the CPU. Without
+   it the instrumentation compiles to nothing and the stats stay zero. */
+#ifndef GPU_ENABLE_STATS
+#define GPU_ENABLE_STATS 0
 #endif
 
 /* Convenience macro for writing shaders in C code files. */
@@ -52,7 +95,20 @@ typedef enum GPUStatus {
     GPUStatusOutOfMemory = 4,
     GPUStatusInvalidTexture = 5,
     GPUStatusInvalidFramebuffer = 6,
-    GPUStatusInvalidProgram = 7
+    GPUStatusInvalidProgram = 7,
+    GPUStatusFailedToCreateContext = 8,
+    GPUStatusParameterTypeMismatch = 9,
+    GPUStatusNotReady = 10,
+    GPUStatusReadbackRingFull = 11,
+    GPUStatusInvalidReadback = 12,
+    GPUStatusInvalidFilterGraph = 13,
+    GPUStatusInvalidTileSize = 14,
+    GPUStatusUnsupportedFormat = 15,
+    GPUStatusInvalidKernel = 16,
+    GPUStatusInvalidExecutor = 17,
+    GPUStatusInvalidResourcePool = 18,
+    GPUStatusInvalidArgument = 19,
+    GPUStatusInvalidResultCache = 20
 } GPUStatus;
 
 typedef enum GPUColorFormat {
@@ -61,19 +117,70 @@ typedef enum GPUColorFormat {
     GPUColorFormatBGRA = 2
 } GPUColorFormat;
 
+/* How texels are stored on the GPU. Single and dual channel formats read
+   as (r, 0, 0, 1) and (r, g, 0, 1) in shaders. Rendering to the float
+   formats on OpenGL ES needs EXT_color_buffer_float. */
+typedef enum GPUPixelFormat {
+    GPUPixelFormatRGBA8 = 0,
+    GPUPixelFormatR8 = 1,
+    GPUPixelFormatRG8 = 2,
+    GPUPixelFormatRGBA16F = 3,
+    GPUPixelFormatRGBA32F = 4,
+    GPUPixelFormatRGB10A2 = 5
+} GPUPixelFormat;
+
+typedef enum GPUTextureFilter {
+    GPUTextureFilterNearest = 0,
+    GPUTextureFilterLinear = 1
+} GPUTextureFilter;
+
+/* A rectangle in pixels, with y counting rows from the first one uploaded
+   or read back. */
+typedef struct GPURect {
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+} GPURect;
+
+/* generation changes whenever the contents do: on every upload and every
+   render into the texture's framebuffer. No two contents of any textures
+   share a generation. */
 typedef struct GPUTexture {
     uint32_t valid;
     uint32_t textureId;
     uint32_t width;
     uint32_t height;
+    uint32_t storageFormat;
+    uint32_t immutable;
+    GPUPixelFormat pixelFormat;
+    GPUTextureFilter filter;
+    uint64_t generation;
 } GPUTexture;
 
+struct GPUResourcePool;
+
 typedef struct GPUFramebuffer {
     uint32_t valid;
     uint32_t framebufferId;
     GPUTexture texture;
+    struct GPUResourcePool *pool;
 } GPUFramebuffer;
 
+/* An active uniform of a linked program, as reported by the driver. Its
+   current value lives in the program's parameter value buffer. */
+typedef struct GPUParameter {
+    const char *name;
+    uint32_t nameHash;
+    int32_t location;
+    uint32_t type;
+    uint32_t size;
+    uint32_t valueType;
+    uint32_t components;
+    uint32_t valueOffset;
+    uint32_t dirty;
+} GPUParameter;
+
 typedef struct GPUProgram {
     uint32_t valid;
     uint32_t programId;
@@ -83,18 +190,471 @@ typedef struct GPUProgram {
         GPUTexture texture;
         int32_t uniformLocation;
     } additionalTextures[7];
+    uint32_t parameterCount;
+    GPUParameter *parameters;
+    uint32_t *parameterValues;
+    uint32_t hasDirtyParameters;
+    struct GPUCompileJob *compileJob;
+    uint32_t haloRadius;
+    uint32_t batchMode;
+    int32_t layerIndexLocation;
+    uint64_t serial;
+    uint64_t parameterVersion;
 } GPUProgram;
 
+typedef struct GPUParameterHandle {
+    GPUProgram *program;
+    int32_t index;
+    uint32_t element;
+    int32_t location;
+} GPUParameterHandle;
+
+/* Where a filter graph node reads an image from: either a texture owned by
+   the caller or the output of an earlier node. */
+typedef struct GPUFilterSource {
+    int32_t node;
+    GPUTexture *texture;
+} GPUFilterSource;
+
+typedef struct GPUFilterNode {
+    GPUProgram *program;
+    GPUFilterSource inputs[8];
+    uint32_t width;
+    uint32_t height;
+    GPUPixelFormat pixelFormat;
+    uint32_t isOutput;
+    void (*prepare)(GPUProgram *program, void *userData);
+    void *userData;
+    int32_t lastUse;
+    int32_t buffer;
+} GPUFilterNode;
+
+typedef struct GPUFilterGraph {
+    uint32_t valid;
+    uint32_t compiled;
+    uint32_t nodeCount;
+    uint32_t nodeCapacity;
+    GPUFilterNode *nodes;
+    uint32_t bufferCount;
+    GPUFramebuffer *buffers;
+} GPUFilterGraph;
+
+typedef struct GPUFilterStage {
+    const char *fragmentShaderCode;
+    uint32_t pointwise;
+} GPUFilterStage;
+
+typedef struct GPUFilterChain {
+    uint32_t valid;
+    uint32_t stageCount;
+    uint32_t passCount;
+    GPUProgram *passes;
+    uint32_t *stagePasses;
+    GPUFramebuffer buffers[2];
+    GPUFramebuffer *retainedBuffers;
+    uint32_t retainedValid;
+    uint32_t retainedOutputId;
+} GPUFilterChain;
+
+typedef struct GPUResultCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t cachedBytes;
+    uint32_t cachedResults;
+} GPUResultCacheStats;
+
+/* key hashes the fields after it, which an entry has to match exactly:
+   the input's generation, the image's size and format, and the serial and
+   gpuGetProgramStateHash() of each of the passCount programs, in pairs in
+   passKeys. */
+typedef struct GPUResultCacheEntry {
+    uint64_t key;
+    uint64_t inputGeneration;
+    uint32_t width;
+    uint32_t height;
+    GPUPixelFormat pixelFormat;
+    uint32_t passCount;
+    uint64_t *passKeys;
+    GPUFramebuffer framebuffer;
+    uint64_t sizeInBytes;
+    uint64_t lastUse;
+} GPUResultCacheEntry;
+
+/* Rendered images keyed by everything that went into them. */
+typedef struct GPUResultCache {
+    uint32_t valid;
+    uint64_t budgetInBytes;
+    uint64_t clock;
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+    GPUResultCacheEntry *entries;
+    GPUResultCacheStats stats;
+} GPUResultCache;
+
+#define GPU_MAX_CONVOLUTION_RADIUS 32
+#define GPU_MAX_CONVOLUTION_LEVELS 6
+
+typedef enum GPUKernelType {
+    GPUKernelTypeCustom = 0,
+    GPUKernelTypeGaussian = 1,
+    GPUKernelTypeBox = 2
+} GPUKernelType;
+
+/* A symmetric, separable kernel applied as a horizontal and a vertical
+   pass. weights is only used by custom kernels, the others are computed
+   for the resolution they run at. buffers[0] holds the horizontal pass and
+   buffers[1] onwards the downsampled levels used for large kernels. */
+typedef struct GPUConvolution {
+    uint32_t valid;
+    GPUKernelType kernelType;
+    float sigma;
+    uint32_t radius;
+    float weights[GPU_MAX_CONVOLUTION_RADIUS + 1];
+    GPUProgram program;
+    GPUProgram downsampleProgram;
+    GPUProgram upsampleProgram;
+    GPUFramebuffer buffers[GPU_MAX_CONVOLUTION_LEVELS + 1];
+} GPUConvolution;
+
+#define GPU_MAX_PYRAMID_LEVELS 16
+
+typedef enum GPUPyramidType {
+    GPUPyramidTypeGaussian = 0,
+    GPUPyramidTypeLaplacian = 1
+} GPUPyramidType;
+
+/* The levels of an image pyramid, each half the size of the one before,
+   stored as the mip chain of a single texture. levels[i] renders into
+   level i and shares that texture with the other levels. */
+typedef struct GPUPyramid {
+    uint32_t valid;
+    GPUPyramidType type;
+    uint32_t levelCount;
+    GPUPixelFormat pixelFormat;
+    uint32_t textureId;
+    uint32_t sampledLevel;
+    GPUFramebuffer levels[GPU_MAX_PYRAMID_LEVELS];
+    GPUProgram downsampleProgram;
+    GPUProgram upsampleProgram;
+} GPUPyramid;
+
+#define GPU_MAX_REDUCTION_LEVELS 16
+#define GPU_HISTOGRAM_BIN_COUNT 256
+
+typedef enum GPUReductionOperation {
+    GPUReductionOperationMin = 0,
+    GPUReductionOperationMax = 1,
+    GPUReductionOperationSum = 2,
+    GPUReductionOperationMean = 3
+} GPUReductionOperation;
+
+/* Reduces an image per channel in passes of 4x4 texels each, down to one
+   RGBA32F texel. levels[levelCount - 1] holds the result. */
+typedef struct GPUReduction {
+    uint32_t valid;
+    GPUReductionOperation operation;
+    uint32_t levelCount;
+    GPUProgram program;
+    GPUFramebuffer levels[GPU_MAX_REDUCTION_LEVELS];
+} GPUReduction;
+
+/* Counts per channel in a GPU_HISTOGRAM_BIN_COUNT x 1 RGBA32F framebuffer,
+   red counts in red and so on. */
+typedef struct GPUHistogram {
+    uint32_t valid;
+    GPUProgram program;
+    GPUFramebuffer bins;
+} GPUHistogram;
+
+typedef struct GPUProgramCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t rejected;
+    double secondsSaved;
+} GPUProgramCacheStats;
+
+typedef struct GPUStateCacheStats {
+    uint64_t issued;
+    uint64_t elided;
+} GPUStateCacheStats;
+
+/* gpuSeconds only covers the timedDraws; draws are not timed without
+   timer queries, or while all queries are still waiting for results
+   (droppedTimings). Seconds besides gpuSeconds are CPU time. */
+typedef struct GPUStats {
+    uint64_t draws;
+    uint64_t timedDraws;
+    uint64_t droppedTimings;
+    double gpuSeconds;
+    uint64_t uploads;
+    uint64_t bytesUploaded;
+    double uploadSeconds;
+    uint64_t readbacks;
+    uint64_t bytesRead;
+    double readbackSeconds;
+    uint64_t compiles;
+    double compileSeconds;
+} GPUStats;
+
+/* workerStats sums what gpuGetStats() returned on each worker after its
+   last finished job. */
+typedef struct GPUExecutorStats {
+    uint64_t jobsRun;
+    uint64_t jobsStolen;
+    GPUStats workerStats;
+} GPUExecutorStats;
+
+typedef struct GPUResourcePoolStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+    uint64_t idleBytes;
+    uint32_t idleResources;
+} GPUResourcePoolStats;
+
+typedef struct GPUResourcePoolEntry {
+    GPUFramebuffer framebuffer;
+    uint32_t isTexture;
+    uint64_t sizeInBytes;
+    uint64_t lastUse;
+} GPUResourcePoolEntry;
+
+/* Idle framebuffers and textures waiting to be handed out again. */
+typedef struct GPUResourcePool {
+    uint32_t valid;
+    uint64_t budgetInBytes;
+    uint64_t clock;
+    uint32_t entryCount;
+    uint32_t entryCapacity;
+    uint32_t lentFramebuffers;
+    GPUResourcePoolEntry *entries;
+    GPUResourcePoolStats stats;
+} GPUResourcePool;
+
+#define GPU_STATS_MAX_EVENTS 4096
+
+#define GPU_MAX_READBACK_DEPTH 8
+
+typedef struct GPUReadbackTicket {
+    uint32_t slot;
+    uint32_t sequence;
+} GPUReadbackTicket;
+
+typedef struct GPUReadbackRing {
+    uint32_t valid;
+    uint32_t depth;
+    uint32_t next;
+    uint32_t sequence;
+    struct {
+        uint32_t state;
+        uint32_t sequence;
+        uint32_t bufferId;
+        uint32_t capacity;
+        uint32_t sizeInBytes;
+        uint32_t repackFormat;
+        uint32_t repackType;
+        void *fence;
+        uint8_t *pixelData;
+    } slots[GPU_MAX_READBACK_DEPTH];
+} GPUReadbackRing;
+
+#define GPU_MAX_UPLOAD_STREAM_DEPTH 4
+
+typedef struct GPUUploadStream {
+    uint32_t valid;
+    uint32_t width;
+    uint32_t height;
+    GPUColorFormat colorFormat;
+    uint32_t sizeInBytes;
+    uint32_t depth;
+    uint32_t current;
+    uint32_t persistent;
+    uint32_t mapped;
+    struct {
+        uint32_t bufferId;
+        void *fence;
+        uint8_t *pixelData;
+    } slots[GPU_MAX_UPLOAD_STREAM_DEPTH];
+} GPUUploadStream;
+
+typedef enum GPUPackedFormat {
+    GPUPackedFormatRGB24 = 0,
+    GPUPackedFormatGray8 = 1,
+    GPUPackedFormatNV12 = 2
+} GPUPackedFormat;
+
+typedef struct GPUPacker {
+    uint32_t valid;
+    GPUProgram program;
+    GPUFramebuffer buffer;
+    uint8_t *scratch;
+    size_t scratchSize;
+} GPUPacker;
+
+typedef enum GPUYUVFormat {
+    GPUYUVFormatNV12 = 0,
+    GPUYUVFormatI420 = 1
+} GPUYUVFormat;
+
+typedef enum GPUYUVColorSpace {
+    GPUYUVColorSpaceBT601 = 0,
+    GPUYUVColorSpaceBT709 = 1
+} GPUYUVColorSpace;
+
+typedef enum GPUYUVRange {
+    GPUYUVRangeLimited = 0,
+    GPUYUVRangeFull = 1
+} GPUYUVRange;
+
+/* One 8-bit planar YUV 4:2:0 frame in client memory. NV12 has a Y plane
+   and an interleaved UV plane, I420 has Y, U and V planes. The chroma
+   planes are (width + 1) / 2 by (height + 1) / 2 samples. */
+typedef struct GPUYUVImage {
+    GPUYUVFormat format;
+    GPUYUVColorSpace colorSpace;
+    GPUYUVRange range;
+    uint32_t width;
+    uint32_t height;
+    const uint8_t *planes[3];
+    size_t bytesPerRow[3];
+} GPUYUVImage;
+
+/* The planes of a YUV frame on the GPU, as R8 and RG8 textures. */
+typedef struct GPUYUVTexture {
+    uint32_t valid;
+    GPUYUVFormat format;
+    GPUYUVColorSpace colorSpace;
+    GPUYUVRange range;
+    uint32_t width;
+    uint32_t height;
+    GPUTexture planes[3];
+} GPUYUVTexture;
+
+/* Same-size images stored as the layers of one GL_TEXTURE_2D_ARRAY. */
+typedef struct GPUTextureArray {
+    uint32_t valid;
+    uint32_t textureId;
+    uint32_t width;
+    uint32_t height;
+    uint32_t layerCount;
+    GPUPixelFormat pixelFormat;
+} GPUTextureArray;
+
+/* Renders into every layer of a texture array. attachedLayer is the layer
+   currently attached, or -1 when all layers are attached for layered
+   rendering. */
+typedef struct GPUFramebufferArray {
+    uint32_t valid;
+    uint32_t framebufferId;
+    GPUTextureArray texture;
+    int32_t attachedLayer;
+} GPUFramebufferArray;
+
+#if GPU_HAVE_HEADLESS_CONTEXT
+typedef enum GPUHeadlessBackend {
+    GPUHeadlessBackendNone = 0,
+    GPUHeadlessBackendEGL = 1,
+    GPUHeadlessBackendOSMesa = 2
+} GPUHeadlessBackend;
+
+typedef struct GPUHeadlessContext {
+    uint32_t valid;
+    GPUHeadlessBackend backend;
+    EGLDisplay display;
+    EGLContext context;
+    EGLSurface surface;
+    void *osmesaContext;
+    void *osmesaBuffer;
+} GPUHeadlessContext;
+
+/* Worker threads, each with its own context sharing objects with the
+   context the executor was created on. */
+typedef struct GPUExecutor {
+    uint32_t valid;
+    uint32_t workerCount;
+    struct GPUExecutorState *state;
+} GPUExecutor;
+#endif
+
+#if GPU_HAVE_HEADLESS_CONTEXT
+#pragma mark - Headless Context
+
+/* Creates an off-screen GL context without a window system and makes it
+   current on the calling thread. Tries surfaceless EGL first (a GPU device
+   or Mesa's surfaceless platform) and falls back to OSMesa if enabled.
+   Call gpuConfigureRenderingPipeline() afterwards as usual. */
+GPUStatus gpuCreateHeadlessContext(GPUHeadlessContext *context);
+
+/* Makes the headless context current on the calling thread. */
+GPUStatus gpuMakeHeadlessContextCurrent(GPUHeadlessContext *context);
+
+/* Also drops the calling thread's trace events, so write the trace before. */
+void gpuDestroyHeadlessContext(GPUHeadlessContext *context);
+
+#pragma mark - Executor
+
+/* Starts workerCount threads, or one per core if 0, each with a context in
+   the share group of the current EGL context. Textures, buffers and
+   programs are shared; framebuffers are not, so each worker renders into
+   framebuffers from its own resource pool of poolBudgetInBytes, which is
+   current on the worker. Programs created on other contexts after this
+   call are only visible to the workers once glFinish() returned there. */
+GPUStatus gpuCreateExecutor(uint32_t workerCount, uint64_t poolBudgetInBytes, GPUExecutor *executor);
+
+/* Finishes queued jobs and stops the workers. Call before destroying the
+   context the executor shares objects with. */
+void gpuDestroyExecutor(GPUExecutor *executor);
+
+/* Queues a job, which calls run on one of the workers with its context
+   current and then completion, if not NULL, with run's status. By then
+   everything run rendered is finished and may be used by other contexts.
+   Jobs are spread over the workers, and idle workers steal queued jobs
+   from busy ones; jobs submitted from a job stay on the same worker unless
+   stolen. Each worker applies a program's parameter values on its own
+   context when they changed since it last used the program, so set them
+   before submitting and not while jobs using the program run. */
+GPUStatus gpuSubmitExecutorJob(GPUExecutor *executor,
+                               GPUStatus (*run)(void *userData, uint32_t workerIndex),
+                               void (*completion)(void *userData, GPUStatus status),
+                               void *userData);
+
+/* Waits until all submitted jobs have completed. Must not be called from
+   a job. */
+GPUStatus gpuWaitForExecutor(GPUExecutor *executor);
+
+void gpuGetExecutorStats(GPUExecutor *executor, GPUExecutorStats *stats);
+#endif
+
 #pragma mark - Render Image
 
-/* Configures the rendering pipeline. Call before rendering the first time. */
+/* Configures the rendering pipeline. Call before rendering the first time
+   on each context, as it sets up the context's vertex buffer. */
 GPUStatus gpuConfigureRenderingPipeline(void);
 
+/* Rendering remembers the framebuffer, viewport, program and textures it
+   bound last and skips binding them again. Call this after changing any
+   of them with GL calls of your own, or after making another context
+   current other than through gpuMakeHeadlessContextCurrent(). */
+void gpuInvalidateStateCache(void);
+
+/* How many binds were issued to the GL and how many were skipped. Like the
+   cache itself, these are per thread, as is the current context. */
+void gpuGetStateCacheStats(GPUStateCacheStats *stats);
+
 /* Renders the texture image to the framebuffer using the specified program. */
 GPUStatus gpuRenderTextureToFramebufferUsingProgram(GPUTexture *texture,
                                                     GPUFramebuffer *framebuffer,
                                                     GPUProgram *program);
 
+/* Renders only the part of the framebuffer inside region, clipped to the
+   framebuffer; the rest keeps its contents. Texture coordinates are the
+   same as for a full render. */
+GPUStatus gpuRenderTextureToFramebufferRegionUsingProgram(GPUTexture *texture,
+                                                          GPUFramebuffer *framebuffer,
+                                                          GPUProgram *program,
+                                                          const GPURect *region);
+
 /* Renders the framebuffer texture to the framebuffer using the program. */
 GPUStatus gpuRenderFramebufferToFramebufferUsingProgram(GPUFramebuffer *source,
                                                         GPUFramebuffer *target,
@@ -106,20 +666,404 @@ GPUStatus gpuRenderFramebufferToFramebufferUsingProgram(GPUFramebuffer *source,
 GPUStatus gpuCreateFramebuffer(uint32_t width, uint32_t height,
                                GPUFramebuffer *framebuffer);
 
+/* Creates a frame buffer backed by a texture of the given pixel format.
+   Returns GPUStatusUnsupportedFormat if the GL cannot store it and
+   GPUStatusFailedToMakeFramebufferObjectError if it cannot render to it. */
+GPUStatus gpuCreateFramebufferWithFormat(uint32_t width, uint32_t height,
+                                         GPUPixelFormat pixelFormat,
+                                         GPUFramebuffer *framebuffer);
+
 void gpuDestroyFramebuffer(GPUFramebuffer *framebuffer);
 
+/* Bytes per pixel of a pixel format, both on the GPU and when read back:
+   R8 is one byte, RG8 two, RGBA16F four half floats, RGBA32F four floats
+   and RGB10A2 one 32-bit word with red in the low bits. */
+uint32_t gpuGetPixelFormatSize(GPUPixelFormat pixelFormat);
+
 uint32_t gpuGetFramebufferSizeInBytes(GPUFramebuffer *framebuffer);
 
+/* RGBA8 framebuffers are converted to colorFormat. Framebuffers of any
+   other pixel format are read in that format's own layout, see
+   gpuGetPixelFormatSize(), and colorFormat is ignored. The same holds for
+   the readback ring. */
 GPUStatus gpuGetFramebufferContents(GPUFramebuffer *framebuffer,
                                     uint8_t *pixelData,
                                     GPUColorFormat colorFormat);
 
+/* Reads only the region, which has to lie inside the framebuffer, or
+   GPUStatusInvalidArgument is returned. Its first pixel goes to pixelData
+   and rows are bytesPerRow apart, so it can be written straight into the
+   matching part of a full image. */
+GPUStatus gpuGetFramebufferRegionContents(GPUFramebuffer *framebuffer,
+                                          const GPURect *region,
+                                          uint8_t *pixelData, size_t bytesPerRow,
+                                          GPUColorFormat colorFormat);
+
+#pragma mark - Resource Pool
+
+/* Creates a pool that recycles framebuffers and textures by size and
+   format. At most budgetInBytes of idle resources are kept; the least
+   recently released ones are freed first. */
+GPUStatus gpuCreateResourcePool(uint64_t budgetInBytes, GPUResourcePool *pool);
+
+/* Frees all idle resources. Pooled framebuffers point back at their pool,
+   so every framebuffer acquired from it has to be released or destroyed
+   before the pool is; textures handed out are freed when they come back. */
+void gpuDestroyResourcePool(GPUResourcePool *pool);
+
+void gpuSetResourcePoolBudget(GPUResourcePool *pool, uint64_t budgetInBytes);
+
+/* Frees least recently used idle resources until at most targetInBytes
+   remain. */
+void gpuTrimResourcePool(GPUResourcePool *pool, uint64_t targetInBytes);
+
+void gpuGetResourcePoolStats(GPUResourcePool *pool, GPUResourcePoolStats *stats);
+
+/* Makes gpuCreateFramebuffer() and gpuCreateFramebufferWithFormat() take
+   framebuffers from the pool on the calling thread. Pooled framebuffers go
+   back to their pool in gpuDestroyFramebuffer(). Pass NULL to allocate
+   directly again. */
+void gpuSetCurrentResourcePool(GPUResourcePool *pool);
+
+/* The contents of a recycled framebuffer or texture are undefined. */
+GPUStatus gpuAcquirePooledFramebuffer(GPUResourcePool *pool,
+                                      uint32_t width, uint32_t height,
+                                      GPUFramebuffer *framebuffer);
+GPUStatus gpuAcquirePooledFramebufferWithFormat(GPUResourcePool *pool,
+                                                uint32_t width, uint32_t height,
+                                                GPUPixelFormat pixelFormat,
+                                                GPUFramebuffer *framebuffer);
+void gpuReleasePooledFramebuffer(GPUResourcePool *pool, GPUFramebuffer *framebuffer);
+
+GPUStatus gpuAcquirePooledTexture(GPUResourcePool *pool,
+                                  uint32_t width, uint32_t height,
+                                  GPUColorFormat colorFormat,
+                                  GPUTexture *texture);
+void gpuReleasePooledTexture(GPUResourcePool *pool, GPUTexture *texture);
+
+#pragma mark - Filter Graph
+
+/* A filter graph renders a chain or DAG of programs and allocates the
+   intermediate framebuffers itself. Nodes can only read from textures or
+   from nodes added before them, and intermediates whose lifetimes do not
+   overlap share the same framebuffer. */
+GPUStatus gpuCreateFilterGraph(GPUFilterGraph *graph);
+
+void gpuDestroyFilterGraph(GPUFilterGraph *graph);
+
+GPUFilterSource gpuFilterSourceFromTexture(GPUTexture *texture);
+GPUFilterSource gpuFilterSourceFromNode(int32_t node);
+
+/* Adds a node rendering the input with the program into a width x height
+   RGBA8 image and returns its index in node. */
+GPUStatus gpuAddFilterGraphNode(GPUFilterGraph *graph, GPUProgram *program,
+                                GPUFilterSource input,
+                                uint32_t width, uint32_t height,
+                                int32_t *node);
+
+/* Same for an image of the given pixel format, e.g. RGBA16F to keep HDR
+   values between nodes. Only nodes of the same size and format share an
+   intermediate framebuffer. */
+GPUStatus gpuAddFilterGraphNodeWithFormat(GPUFilterGraph *graph, GPUProgram *program,
+                                          GPUFilterSource input,
+                                          uint32_t width, uint32_t height,
+                                          GPUPixelFormat pixelFormat,
+                                          int32_t *node);
+
+/* Binds a source to texture2 (unit 1) through texture8 (unit 7) of the
+   node's program while the node renders. */
+GPUStatus gpuSetFilterGraphNodeTexture(GPUFilterGraph *graph, int32_t node,
+                                       uint32_t unit, GPUFilterSource source);
+
+/* Called right before the node renders, e.g. to set node-specific
+   parameters on a program that is shared between nodes. */
+GPUStatus gpuSetFilterGraphNodeCallback(GPUFilterGraph *graph, int32_t node,
+                                        void (*prepare)(GPUProgram *program, void *userData),
+                                        void *userData);
+
+/* Keeps the node's image around after the graph has run. Nodes that are
+   neither outputs nor read by an output are not rendered at all. */
+GPUStatus gpuMarkFilterGraphOutput(GPUFilterGraph *graph, int32_t node);
+
+/* Works out intermediate lifetimes and allocates the framebuffers. Done
+   automatically by gpuRunFilterGraph() after the graph has changed. */
+GPUStatus gpuCompileFilterGraph(GPUFilterGraph *graph);
+
+GPUStatus gpuRunFilterGraph(GPUFilterGraph *graph);
+
+/* The framebuffer holding an output node's image, or NULL. */
+GPUFramebuffer *gpuGetFilterGraphOutput(GPUFilterGraph *graph, int32_t node);
+
+#pragma mark - Filter Chain
+
+/* Compiles a linear chain of fragment shaders, all using the default vertex
+   shader. Runs of consecutive stages marked pointwise are fused into a
+   single pass. A pointwise stage may only read its input as
+   texture2D(texture, uv) in main(), must write gl_FragColor, and may not
+   use discard, other samplers or varyings other than uv. Stages that turn
+   out not to qualify are rendered as passes of their own. */
+GPUStatus gpuCompileFilterChain(const GPUFilterStage *stages, uint32_t stageCount,
+                                GPUFilterChain *chain,
+                                void (*logFunc)(const char *log));
+
+void gpuDestroyFilterChain(GPUFilterChain *chain);
+
+/* Parameters of fused stages are renamed to "stage<index>_<name>"; this
+   looks them up by the name used in the stage's own source. */
+GPUStatus gpuGetFilterChainParameterHandle(GPUFilterChain *chain, uint32_t stage,
+                                           const char *name,
+                                           GPUParameterHandle *handle);
+
+/* The program a stage is rendered with, e.g. to bind additional textures
+   to a stage that is not fused. */
+GPUProgram *gpuGetFilterChainProgram(GPUFilterChain *chain, uint32_t stage);
+
+/* Renders the input through every pass into the output framebuffer.
+   Intermediate images have the output's pixel format, so a float output
+   keeps values outside [0, 1] between passes. */
+GPUStatus gpuRunFilterChain(GPUFilterChain *chain, GPUTexture *input,
+                            GPUFramebuffer *output);
+
+/* Re-renders only what changed after the input, of the output's size,
+   changed inside dirty. Each pass redraws the region its input changed
+   in, grown by its halo radius (see gpuSetProgramHaloRadius()), and
+   updated returns the region of the output that was redrawn. The chain
+   keeps every intermediate image for this, and renders everything when
+   there is nothing to build on: on the first call, after
+   gpuRunFilterChain() or when the output, its size or its pixel format
+   changed. */
+GPUStatus gpuRunFilterChainRegion(GPUFilterChain *chain, GPUTexture *input,
+                                  GPUFramebuffer *output, const GPURect *dirty,
+                                  GPURect *updated);
+
+#pragma mark - Result Cache
+
+/* Keeps rendered images so that requesting the same one again costs
+   nothing. An image is identified by its input's generation, the programs
+   and their state hashes (see gpuGetProgramStateHash()), its size and its
+   pixel format, all of which are compared, not only hashed. At most
+   budgetInBytes of images are kept, the least recently used ones are freed
+   first; the newest stays even if it alone is over budget. */
+GPUStatus gpuCreateResultCache(uint64_t budgetInBytes, GPUResultCache *cache);
+
+void gpuDestroyResultCache(GPUResultCache *cache);
+
+void gpuSetResultCacheBudget(GPUResultCache *cache, uint64_t budgetInBytes);
+
+void gpuGetResultCacheStats(GPUResultCache *cache, GPUResultCacheStats *stats);
+
+/* Renders the texture with the program into a width x height image, or
+   finds it in the cache. output receives a framebuffer owned by the cache:
+   it must not be rendered into or destroyed, and stays valid until the
+   next call that adds to the cache. Its generation stays the same while it
+   is cached, so passes that read it can be cached as well. Returns
+   GPUStatusInvalidResultCache if the cache was destroyed. */
+GPUStatus gpuRenderTextureCached(GPUResultCache *cache, GPUTexture *texture,
+                                 GPUProgram *program, uint32_t width, uint32_t height,
+                                 GPUFramebuffer *output);
+
+/* The same for a whole filter chain. */
+GPUStatus gpuRunFilterChainCached(GPUResultCache *cache, GPUFilterChain *chain,
+                                  GPUTexture *input, uint32_t width, uint32_t height,
+                                  GPUFramebuffer *output);
+
+/* Both render an RGBA8 image; these render one of the given pixel format,
+   which is part of what the result is cached by. The chain's intermediate
+   images have that format as well, see gpuRunFilterChain(). */
+GPUStatus gpuRenderTextureCachedWithFormat(GPUResultCache *cache, GPUTexture *texture,
+                                           GPUProgram *program, uint32_t width, uint32_t height,
+                                           GPUPixelFormat pixelFormat, GPUFramebuffer *output);
+GPUStatus gpuRunFilterChainCachedWithFormat(GPUResultCache *cache, GPUFilterChain *chain,
+                                            GPUTexture *input, uint32_t width, uint32_t height,
+                                            GPUPixelFormat pixelFormat, GPUFramebuffer *output);
+
+#pragma mark - Convolution
+
+/* A kernel from its center weight and one side: weights[0] to
+   weights[radius], mirrored for the other side. Up to
+   GPU_MAX_CONVOLUTION_RADIUS. */
+GPUStatus gpuCreateConvolution(const float *weights, uint32_t radius,
+                               GPUConvolution *convolution);
+
+/* A normalized Gaussian reaching out to three sigma. */
+GPUStatus gpuCreateGaussianConvolution(float sigma, GPUConvolution *convolution);
+
+/* A normalized box of 2 * radius + 1 pixels. */
+GPUStatus gpuCreateBoxConvolution(uint32_t radius, GPUConvolution *convolution);
+
+void gpuDestroyConvolution(GPUConvolution *convolution);
+
+/* Convolves the input into the output. Pairs of taps are merged into one
+   linearly filtered fetch where the formats allow it, and Gaussian and box
+   kernels wider than GPU_MAX_CONVOLUTION_RADIUS run on a downsampled copy
+   that is upsampled into the output, so the cost stays bounded. The input
+   keeps its filtering. */
+GPUStatus gpuRunConvolution(GPUConvolution *convolution, GPUTexture *input,
+                            GPUFramebuffer *output);
+
+#pragma mark - Pyramid
+
+/* Allocates levelCount levels starting at width x height, fewer if the
+   chain reaches 1x1 first. The pixel format has to be linearly
+   filterable. Needs OpenGL ES 3 on mobile. */
+GPUStatus gpuCreatePyramid(uint32_t width, uint32_t height, uint32_t levelCount,
+                           GPUPixelFormat pixelFormat, GPUPyramid *pyramid);
+
+void gpuDestroyPyramid(GPUPyramid *pyramid);
+
+/* A level as an input texture. Levels share one texture, so only the level
+   asked for last can be sampled; it must not be rendered into meanwhile.
+   The returned texture must not be uploaded to or destroyed. */
+GPUTexture *gpuGetPyramidLevelTexture(GPUPyramid *pyramid, uint32_t level);
+
+/* A level as a render target. Must not be destroyed. */
+GPUFramebuffer *gpuGetPyramidLevelFramebuffer(GPUPyramid *pyramid, uint32_t level);
+
+/* Copies the input into the first level, scaled with its own filtering,
+   and fills each further level with a tent filtered half-size copy of the
+   one before. A Laplacian pyramid then replaces every level but the last
+   with its difference to the next level, upsampled. Laplacian levels are
+   signed and need RGBA16F or RGBA32F. */
+GPUStatus gpuBuildPyramid(GPUTexture *input, GPUPyramidType type, GPUPyramid *pyramid);
+
+/* Turns a Laplacian pyramid back into a Gaussian one, so the first level
+   holds the reconstructed image. Does nothing to a Gaussian pyramid. */
+GPUStatus gpuCollapsePyramid(GPUPyramid *pyramid);
+
+#pragma mark - Reduction
+
+/* Reductions and histograms stay on the GPU: their results can be bound
+   as input textures of later passes, and reading them back transfers a
+   few bytes instead of the image. Both need float render targets. */
+GPUStatus gpuCreateReduction(GPUReductionOperation operation, GPUReduction *reduction);
+
+void gpuDestroyReduction(GPUReduction *reduction);
+
+GPUStatus gpuRunReduction(GPUReduction *reduction, GPUTexture *input);
+
+/* The 1x1 result of the last run, NULL before the first. */
+GPUTexture *gpuGetReductionTexture(GPUReduction *reduction);
+
+/* Reads back the result of the last run, one float per channel. */
+GPUStatus gpuGetReductionResult(GPUReduction *reduction, float result[4]);
+
+/* Needs OpenGL 3 or OpenGL ES 3, and float blending. */
+GPUStatus gpuCreateHistogram(GPUHistogram *histogram);
+
+void gpuDestroyHistogram(GPUHistogram *histogram);
+
+/* Counts every channel's values, clamped to 0..1, in 256 evenly spaced
+   bins. Counts are exact up to 2^24 per bin. */
+GPUStatus gpuRunHistogram(GPUHistogram *histogram, GPUTexture *input);
+
+GPUTexture *gpuGetHistogramTexture(GPUHistogram *histogram);
+
+/* counts[bin * 4 + channel]. */
+GPUStatus gpuGetHistogramCounts(GPUHistogram *histogram, uint32_t counts[GPU_HISTOGRAM_BIN_COUNT * 4]);
+
+#pragma mark - Tiled Processing
+
+/* How many pixels around each output pixel the program reads from its
+   input, e.g. the radius of a blur. Zero for pointwise programs, which is
+   the default. */
+void gpuSetProgramHaloRadius(GPUProgram *program, uint32_t radius);
+
+/* The tile size gpuRenderImageTiled() uses for the requested one. */
+uint32_t gpuGetTileSize(uint32_t tileSize);
+
+/* Renders an image of any size through a sequence of programs, one tile at
+   a time, so that neither dimension is limited by GL_MAX_TEXTURE_SIZE and
+   GPU memory stays at one texture and two framebuffers of tileSize x
+   tileSize. Tiles overlap by the sum of the programs' halo radii so that
+   neighbor sampling sees the same pixels as with a single texture. The
+   output has the input's color format and may be memory-mapped. Pass 0 as
+   tileSize for a default that fits the GL's limits. Every tile is
+   min(width, gpuGetTileSize(tileSize)) pixels wide and correspondingly
+   high, which is what texel offsets in the programs must be based on. */
+GPUStatus gpuRenderImageTiled(uint32_t width, uint32_t height,
+                              GPUColorFormat colorFormat,
+                              const uint8_t *pixelData, size_t bytesPerRow,
+                              GPUProgram **programs, uint32_t programCount,
+                              uint32_t tileSize,
+                              uint8_t *outputData, size_t outputBytesPerRow);
+
+/* Same, with the images between the programs in the given pixel format,
+   e.g. RGBA16F for HDR steps. Only the last program renders into RGBA8 for
+   the output, which takes one more framebuffer unless the format is RGBA8
+   itself. */
+GPUStatus gpuRenderImageTiledWithFormat(uint32_t width, uint32_t height,
+                                        GPUColorFormat colorFormat,
+                                        const uint8_t *pixelData, size_t bytesPerRow,
+                                        GPUProgram **programs, uint32_t programCount,
+                                        uint32_t tileSize, GPUPixelFormat pixelFormat,
+                                        uint8_t *outputData, size_t outputBytesPerRow);
+
+#pragma mark - Framebuffer Readback
+
+/* Creates a ring of up to GPU_MAX_READBACK_DEPTH pixel pack buffers that
+   framebuffer contents can be read back through without stalling. */
+GPUStatus gpuCreateReadbackRing(uint32_t depth, GPUReadbackRing *ring);
+
+void gpuDestroyReadbackRing(GPUReadbackRing *ring);
+
+/* Starts copying the framebuffer contents into the next free buffer of the
+   ring and returns immediately. Returns GPUStatusReadbackRingFull if every
+   buffer still holds a readback that has not been unmapped. */
+GPUStatus gpuBeginFramebufferReadback(GPUFramebuffer *framebuffer,
+                                      GPUColorFormat colorFormat,
+                                      GPUReadbackRing *ring,
+                                      GPUReadbackTicket *ticket);
+
+/* Returns GPUStatusOK once the readback has finished, GPUStatusNotReady
+   while it is still in flight. Never blocks. */
+GPUStatus gpuPollReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket);
+
+/* Waits for the readback to finish if needed and maps its pixels. The
+   pointer stays valid until gpuUnmapReadback(), which also frees the slot. */
+GPUStatus gpuMapReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket,
+                         const uint8_t **pixelData);
+
+void gpuUnmapReadback(GPUReadbackRing *ring, GPUReadbackTicket ticket);
+
+#pragma mark - Packed Readback
+
+/* Compiles the packing pass. The packer keeps a framebuffer for the packed
+   bytes, sized for the last image it packed. */
+GPUStatus gpuCreatePacker(GPUPacker *packer);
+
+void gpuDestroyPacker(GPUPacker *packer);
+
+/* Bytes in one packed row, and the number of rows, for a framebuffer of
+   the given size reduced by downsample in each direction. NV12 has the
+   luma rows followed by the interleaved chroma rows at the same stride. */
+uint32_t gpuGetPackedRowSize(uint32_t width, GPUPackedFormat format, uint32_t downsample);
+uint32_t gpuGetPackedRowCount(uint32_t height, GPUPackedFormat format, uint32_t downsample);
+
+/* Converts the framebuffer to the packed format on the GPU and reads back
+   only the packed bytes. With a downsample factor above 1 (up to 8) each
+   output pixel is the average of a downsample x downsample block. Gray8
+   and NV12 use the color space's luma and the given range. pixelData
+   holds gpuGetPackedRowCount() rows of bytesPerRow bytes, with bytesPerRow
+   at least gpuGetPackedRowSize(). Bytes past the row size, up to the next
+   multiple of four, may be overwritten. Returns GPUStatusInvalidArgument
+   for a larger downsample factor or a shorter bytesPerRow. */
+GPUStatus gpuReadFramebufferPacked(GPUPacker *packer, GPUFramebuffer *framebuffer,
+                                   GPUPackedFormat format, uint32_t downsample,
+                                   GPUYUVColorSpace colorSpace, GPUYUVRange range,
+                                   uint8_t *pixelData, size_t bytesPerRow);
+
 #pragma mark - Texture
 
 GPUStatus gpuCreateTexture(GPUTexture *texture);
 
 void gpuDestroyTexture(GPUTexture *texture);
 
+/* Allocates texture storage on the first upload and reuses it for later
+   uploads of the same size and format. Storage is immutable where the GL
+   supports it, so the first upload that changes the size or format gives
+   the texture a new textureId; later changes respecify it in place. Copies
+   of the GPUTexture struct made before that upload keep the deleted id and
+   must be refreshed from the texture that was uploaded to. */
 GPUStatus gpuUploadImageToTexture(uint32_t width, uint32_t height,
                                   GPUColorFormat colorFormat,
                                   uint8_t *pixelData, GPUTexture *texture);
@@ -129,27 +1073,181 @@ GPUStatus gpuCreateTextureFromImage(uint32_t width, uint32_t height,
                                     GPUColorFormat colorFormat,
                                     uint8_t *pixelData, GPUTexture *texture);
 
+/* Uploads pixels laid out as described for gpuGetPixelFormatSize(). */
+GPUStatus gpuUploadPixelsToTexture(uint32_t width, uint32_t height,
+                                   GPUPixelFormat pixelFormat,
+                                   const void *pixelData, GPUTexture *texture);
+
+/* Textures and framebuffers start out with nearest sampling. Pooled ones
+   are reset to it when they are released. */
+void gpuSetTextureFiltering(GPUTexture *texture, GPUTextureFilter filter);
+
 /* Calls gpuCreateTextureFromImage() with all white pixel data. */
 GPUStatus gpuCreateBlankTexture(uint32_t width, uint32_t height,
                                 GPUTexture *texture);
 
+/* Creates a texture of the given pixel format with every channel 1.0. */
+GPUStatus gpuCreateBlankTextureWithFormat(uint32_t width, uint32_t height,
+                                          GPUPixelFormat pixelFormat,
+                                          GPUTexture *texture);
+
+#pragma mark - Streaming Texture Upload
+
+/* Creates a ring of up to GPU_MAX_UPLOAD_STREAM_DEPTH pixel unpack buffers
+   for uploading a stream of same-size frames. The buffers are persistently
+   mapped where the GL supports it. */
+GPUStatus gpuCreateUploadStream(uint32_t width, uint32_t height,
+                                GPUColorFormat colorFormat, uint32_t depth,
+                                GPUUploadStream *stream);
+
+void gpuDestroyUploadStream(GPUUploadStream *stream);
+
+/* Returns a buffer to write the next frame into. Only waits if the GPU is
+   still reading the frame that was written to the same buffer depth frames
+   ago. */
+GPUStatus gpuBeginStreamUpload(GPUUploadStream *stream, uint8_t **pixelData);
+
+/* Queues the frame written since gpuBeginStreamUpload() for upload to the
+   texture without waiting for the copy to finish. */
+GPUStatus gpuEndStreamUpload(GPUUploadStream *stream, GPUTexture *texture);
+
+#pragma mark - YUV Texture
+
+GPUStatus gpuCreateYUVTexture(GPUYUVTexture *texture);
+
+void gpuDestroyYUVTexture(GPUYUVTexture *texture);
+
+/* Uploads each plane as is, honoring its row stride, so no conversion
+   happens on the CPU. Needs R8/RG8 textures, so not on OpenGL ES 2. */
+GPUStatus gpuUploadYUVImageToTexture(const GPUYUVImage *image,
+                                     GPUYUVTexture *texture);
+
+/* Compiles a program whose first pass reads YUV. The fragment shader code
+   is appended to a prelude declaring "varying vec2 uv", the samplers
+   texture, texture2 and texture3 for the planes and
+   "vec4 gpuSampleYUV(vec2 position)", which returns RGB. The shader must
+   not declare those itself. Pass NULL for a plain conversion to RGB. */
+GPUStatus gpuCompileYUVProgram(const char *fragmentShaderCode,
+                               GPUProgram *program,
+                               void (*logFunc)(const char *log));
+
+/* Renders the YUV texture with a program from gpuCompileYUVProgram(),
+   converting with the texture's color space and range. Binds the chroma
+   planes as the program's second and third texture. */
+GPUStatus gpuRenderYUVTextureToFramebufferUsingProgram(GPUYUVTexture *texture,
+                                                       GPUFramebuffer *framebuffer,
+                                                       GPUProgram *program);
+
+#pragma mark - Batch Processing
+
+/* Batches run one program over many same-size images with a single
+   upload, one program and texture setup, and a single readback. They need
+   texture arrays, so not OpenGL ES 2; these return
+   GPUStatusUnsupportedFormat there. */
+GPUStatus gpuCreateTextureArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                GPUPixelFormat pixelFormat, GPUTextureArray *texture);
+
+void gpuDestroyTextureArray(GPUTextureArray *texture);
+
+/* Uploads layerCount images, tightly packed one after the other in the
+   array's pixel format, starting at firstLayer. */
+GPUStatus gpuUploadImagesToTextureArray(uint32_t firstLayer, uint32_t layerCount,
+                                        const void *pixelData, GPUTextureArray *texture);
+
+GPUStatus gpuCreateFramebufferArray(uint32_t width, uint32_t height, uint32_t layerCount,
+                                    GPUPixelFormat pixelFormat, GPUFramebufferArray *framebuffer);
+
+void gpuDestroyFramebufferArray(GPUFramebufferArray *framebuffer);
+
+/* Reads every layer back, tightly packed one after the other in the
+   array's native layout (see gpuGetPixelFormatSize()). */
+GPUStatus gpuGetFramebufferArrayContents(GPUFramebufferArray *framebuffer, void *pixelData);
+
+/* Compiles a program for batches. The fragment shader code is appended to
+   a prelude declaring "vec2 uv", "float gpuLayer" and
+   "vec4 gpuSampleLayer(vec2 position)", which samples the current layer of
+   the input array. Further textures are sampler2D as usual. The shader
+   must not declare those itself. Pass NULL for a plain copy. */
+GPUStatus gpuCompileBatchProgram(const char *fragmentShaderCode,
+                                 GPUProgram *program,
+                                 void (*logFunc)(const char *log));
+
+/* Runs the program over every layer of the framebuffer array, reading the
+   same layer of the texture array. Where the GL can route primitives to
+   layers from the vertex shader this is a single instanced draw,
+   otherwise one draw per layer. */
+GPUStatus gpuRenderTextureArrayToFramebufferArrayUsingProgram(GPUTextureArray *texture,
+                                                              GPUFramebufferArray *framebuffer,
+                                                              GPUProgram *program);
+
 
 #pragma mark - Shader Program
 
+/* A hash of everything a render with the program depends on besides its
+   input: the program's serial, which no other program ever shares even if
+   the GL reuses its name, its current parameter values and the
+   generations of its additional textures. Those are copies, so assign
+   an additional texture again after changing its contents. 0 for invalid
+   programs. */
+uint64_t gpuGetProgramStateHash(GPUProgram *program);
+
 /* A pass-through vertex shader. Useful for most cases. */
 extern const char *kGPUDefaultVertexShaderCode;
 
 /* A pass-through fragment shader. Custom fragment shaders are more useful. */
 extern const char *kGPUDefaultFragmentShaderCode;
 
+/* The same in GLSL 3.30 core, or GLSL ES 3.00 on OpenGL ES, for drivers
+   that only accept current GLSL in a core profile. As texture() is a
+   function there, the fragment shader samples "inputTexture"; further
+   textures may likewise be called inputTexture2 to inputTexture8. On
+   OpenGL ES both stages must use the same version. */
+extern const char *kGPUCoreVertexShaderCode;
+extern const char *kGPUCoreFragmentShaderCode;
+
 /* Compiles a shader program from a vertex shader and a fragment shader. */
 GPUStatus gpuCompileProgram(const char *vertexShaderCode,
                             const char *fragmentShaderCode,
                             GPUProgram *program,
                             void (*logFunc)(const char *log));
 
+/* Starts compiling a program and returns without waiting for the driver,
+   so that many programs can compile at the same time. Uses
+   KHR_parallel_shader_compile where available, otherwise a thread with a
+   context sharing objects with the current EGL context. Elsewhere the
+   program is compiled before returning. The program becomes valid once
+   gpuPollProgram() or gpuWaitForProgram() returns GPUStatusOK. logFunc
+   may be called from the compile thread. */
+GPUStatus gpuCompileProgramAsync(const char *vertexShaderCode,
+                                 const char *fragmentShaderCode,
+                                 GPUProgram *program,
+                                 void (*logFunc)(const char *log));
+
+/* Returns GPUStatusNotReady while the program is still compiling. */
+GPUStatus gpuPollProgram(GPUProgram *program);
+
+GPUStatus gpuWaitForProgram(GPUProgram *program);
+
+#if GPU_HAVE_HEADLESS_CONTEXT
+/* Finishes queued programs and stops the compile thread. Call before
+   destroying the context it shares objects with; gpuDestroyHeadlessContext()
+   does this. */
+void gpuStopCompileThread(void);
+#endif
+
 void gpuDestroyProgram(GPUProgram *program);
 
+/* Caches linked program binaries in an existing directory, keyed by the
+   shader sources and the GL vendor, renderer and version. Programs found
+   there are loaded with glProgramBinary instead of being compiled; binaries
+   the driver rejects are recompiled and replaced. Pass NULL to disable.
+   Without program binary support programs are always compiled. */
+GPUStatus gpuSetProgramCacheDirectory(const char *path);
+
+/* Hits, misses, rejected binaries and the compile time saved by hits, on
+   the calling thread. The cache directory is shared by all threads. */
+void gpuGetProgramCacheStats(GPUProgramCacheStats *stats);
+
 /* Bind textures to program, in addition to the input image to render. */
 void gpuSetSecondTextureForProgram(GPUTexture *texture, GPUProgram *program);
 void gpuSetThirdTextureForProgram(GPUTexture *texture, GPUProgram *program);
@@ -159,7 +1257,9 @@ void gpuSetSixthTextureForProgram(GPUTexture *texture, GPUProgram *program);
 void gpuSetSeventhTextureForProgram(GPUTexture *texture, GPUProgram *program);
 void gpuSetEigthTextureForProgram(GPUTexture *texture, GPUProgram *program);
 
-/* Bind parameters to program. */
+/* Bind parameters to program. Values are kept on the program and only the
+   ones that changed are uploaded the next time the program is used for
+   rendering, so parameters can be set while another program is bound. */
 GPUStatus gpuSetFloatForProgram(const char *name, float value, GPUProgram *program);
 GPUStatus gpuSet2FloatsForProgram(const char *name, float value0, float value1, GPUProgram *program);
 GPUStatus gpuSet3FloatsForProgram(const char *name, float value0, float value1, float value2, GPUProgram *program);
@@ -171,10 +1271,8 @@ GPUStatus gpuSet4IntsForProgram(const char *name, int value0, int value1, int va
 GPUStatus gpuSetVector2ForProgram(const char *name, const float *values, GPUProgram *program);
 GPUStatus gpuSetVector3ForProgram(const char *name, const float *values, GPUProgram *program);
 GPUStatus gpuSetVector4ForProgram(const char *name, const float *values, GPUProgram *program);
-GPUStatus gpuSetVector3ForProgram(const char *name, const float *values, GPUProgram *program);
-GPUStatus gpuSetVector4ForProgram(const char *name, const float *values, GPUProgram *program);
-GPUStatus gpuSetFloatArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 GPUStatus gpuSetFloatArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
+GPUStatus gpuSetVector2ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 GPUStatus gpuSetVector3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 GPUStatus gpuSetVector4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 GPUStatus gpuSetIntArrayForProgram(const char *name, uint32_t count, const int32_t *values, GPUProgram *program);
@@ -188,3 +1286,53 @@ GPUStatus gpuSetMatrix2x2ArrayForProgram(const char *name, uint32_t count, const
 GPUStatus gpuSetMatrix3x3ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 GPUStatus gpuSetMatrix4x4ArrayForProgram(const char *name, uint32_t count, const float *values, GPUProgram *program);
 
+/* Looks up a parameter once so that it can be set repeatedly without any
+   string work. Array elements can be addressed as "name[index]". The handle
+   stays valid for as long as the program does. */
+GPUStatus gpuGetParameterHandle(GPUProgram *program, const char *name,
+                                GPUParameterHandle *handle);
+
+/* Bind parameters to program through a handle. */
+GPUStatus gpuSetFloatByHandle(GPUParameterHandle handle, float value);
+GPUStatus gpuSet2FloatsByHandle(GPUParameterHandle handle, float value0, float value1);
+GPUStatus gpuSet3FloatsByHandle(GPUParameterHandle handle, float value0, float value1, float value2);
+GPUStatus gpuSet4FloatsByHandle(GPUParameterHandle handle, float value0, float value1, float value2, float value3);
+GPUStatus gpuSetIntByHandle(GPUParameterHandle handle, int32_t value);
+GPUStatus gpuSet2IntsByHandle(GPUParameterHandle handle, int value0, int value1);
+GPUStatus gpuSet3IntsByHandle(GPUParameterHandle handle, int value0, int value1, int value2);
+GPUStatus gpuSet4IntsByHandle(GPUParameterHandle handle, int value0, int value1, int value2, int value3);
+GPUStatus gpuSetVector2ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetVector3ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetVector4ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetFloatArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetVector2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetVector3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetVector4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetIntArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values);
+GPUStatus gpuSetIntVector2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values);
+GPUStatus gpuSetIntVector3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values);
+GPUStatus gpuSetIntVector4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const int32_t *values);
+GPUStatus gpuSetMatrix2x2ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetMatrix3x3ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetMatrix4x4ByHandle(GPUParameterHandle handle, const float *values);
+GPUStatus gpuSetMatrix2x2ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetMatrix3x3ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+GPUStatus gpuSetMatrix4x4ArrayByHandle(GPUParameterHandle handle, uint32_t count, const float *values);
+
+#pragma mark - Stats
+
+/* What the calling thread did on its context since the last reset, see
+   GPU_ENABLE_STATS. Timer results are collected without waiting, so the
+   latest draws may not be included yet. Synchronous compiles count;
+   those on the compile thread count there. */
+void gpuGetStats(GPUStats *stats);
+
+void gpuResetStats(void);
+
+/* Writes the calling thread's most recent GPU_STATS_MAX_EVENTS timed draws,
+   uploads, readbacks and compiles as Chrome trace events, which
+   chrome://tracing and Perfetto open. CPU work is on one track and draws on
+   another. Draws start at the time they were issued and are named after
+   their program and framebuffer size, prefixed with the filter chain pass
+   or graph node index if a chain or graph issued them. */
+GPUStatus gpuWriteStatsTrace(const char *path);
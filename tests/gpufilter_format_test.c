@@ -0,0 +1,196 @@
+/*
+ * The MIT License (MIT)
+ *
+ * Copyright (c) 2013 Martin Johannesson
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of
+ * this software and associated documentation files (the "Software"), to deal in
+ * the Software without restriction, including without limitation the rights to
+ * use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of
+ * the Software, and to permit persons to whom the Software is furnished to do so,
+ * subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS
+ * FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR
+ * COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER
+ * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ */
+
+/* Checks that two-pass chains keep values outside [0, 1] between their
+   passes when rendering into float formats. The first pass adds 4 to a
+   white input and the second scales by 1/8, so every path has to produce
+   0.625, not the 0.125 an 8-bit intermediate clamped to 1 would give:
+
+       make test
+       make test GL=es
+ */
+
+#include "gpufilter.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_SIZE 16
+#define TEST_EXPECTED 0.625f
+
+#if GPU_OPENGL_ES
+#define TEST_PRECISION "precision highp float;\n"
+#else
+#define TEST_PRECISION ""
+#endif
+
+static const char *kAddShaderCode =
+    TEST_PRECISION
+    "varying vec2 uv;\n"
+    "uniform sampler2D texture;\n"
+    "void main() { gl_FragColor = texture2D(texture, uv) + vec4(4.0); }\n";
+
+static const char *kScaleShaderCode =
+    TEST_PRECISION
+    "varying vec2 uv;\n"
+    "uniform sampler2D texture;\n"
+    "void main() { gl_FragColor = texture2D(texture, uv) * 0.125; }\n";
+
+static int failures = 0;
+
+static void testCheck(int condition, const char *what)
+{
+    if (!condition) {
+        fprintf(stderr, "FAILED: %s\n", what);
+        failures++;
+    }
+}
+
+/* Whether every channel of a float framebuffer holds the expected value. */
+static int testFramebufferHolds(GPUFramebuffer *framebuffer, float expected)
+{
+    static float pixels[TEST_SIZE * TEST_SIZE * 4];
+    if (gpuGetFramebufferContents(framebuffer, (uint8_t *)pixels, GPUColorFormatRGBA) != GPUStatusOK) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < TEST_SIZE * TEST_SIZE * 4; i++) {
+        if (fabsf(pixels[i] - expected) > 1e-3f) {
+            fprintf(stderr, "Read %f instead of %f.\n", pixels[i], expected);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void testChain(GPUFilterChain *chain, GPUTexture *input)
+{
+    GPUFramebuffer output;
+    testCheck(gpuCreateFramebufferWithFormat(TEST_SIZE, TEST_SIZE, GPUPixelFormatRGBA32F, &output) == GPUStatusOK,
+              "float chain output");
+    testCheck(gpuRunFilterChain(chain, input, &output) == GPUStatusOK, "float chain run");
+    testCheck(testFramebufferHolds(&output, TEST_EXPECTED), "float chain intermediate");
+
+    // The retained intermediates of the region run must follow the output
+    // format as well.
+    GPURect dirty = { 0, 0, TEST_SIZE, TEST_SIZE };
+    testCheck(gpuRunFilterChainRegion(chain, input, &output, &dirty, NULL) == GPUStatusOK, "float region run");
+    testCheck(testFramebufferHolds(&output, TEST_EXPECTED), "float region intermediate");
+    gpuDestroyFramebuffer(&output);
+}
+
+static void testCachedChain(GPUFilterChain *chain, GPUTexture *input)
+{
+    GPUResultCache cache;
+    gpuCreateResultCache(16 << 20, &cache);
+    GPUFramebuffer output;
+    for (int i = 0; i < 2; i++) {
+        testCheck(gpuRunFilterChainCachedWithFormat(&cache, chain, input, TEST_SIZE, TEST_SIZE,
+                                                    GPUPixelFormatRGBA32F, &output) == GPUStatusOK,
+                  "cached float chain run");
+        testCheck(output.texture.pixelFormat == GPUPixelFormatRGBA32F, "cached float chain format");
+        testCheck(testFramebufferHolds(&output, TEST_EXPECTED), "cached float chain intermediate");
+    }
+    GPUResultCacheStats stats;
+    gpuGetResultCacheStats(&cache, &stats);
+    testCheck(stats.hits == 1 && stats.misses == 1, "cached float chain reuse");
+
+    // The same chain into RGBA8 is a different result.
+    testCheck(gpuRunFilterChainCached(&cache, chain, input, TEST_SIZE, TEST_SIZE, &output) == GPUStatusOK &&
+              output.texture.pixelFormat == GPUPixelFormatRGBA8, "cached chain format in the key");
+    gpuDestroyResultCache(&cache);
+}
+
+static void testGraph(GPUProgram *add, GPUProgram *scale, GPUTexture *input)
+{
+    GPUFilterGraph graph;
+    int32_t first, second;
+    gpuCreateFilterGraph(&graph);
+    gpuAddFilterGraphNodeWithFormat(&graph, add, gpuFilterSourceFromTexture(input),
+                                    TEST_SIZE, TEST_SIZE, GPUPixelFormatRGBA32F, &first);
+    gpuAddFilterGraphNodeWithFormat(&graph, scale, gpuFilterSourceFromNode(first),
+                                    TEST_SIZE, TEST_SIZE, GPUPixelFormatRGBA32F, &second);
+    gpuMarkFilterGraphOutput(&graph, second);
+    testCheck(gpuRunFilterGraph(&graph) == GPUStatusOK, "float graph run");
+    GPUFramebuffer *output = gpuGetFilterGraphOutput(&graph, second);
+    testCheck(output != NULL && testFramebufferHolds(output, TEST_EXPECTED), "float graph intermediate");
+    gpuDestroyFilterGraph(&graph);
+}
+
+static void testTiled(GPUProgram *add, GPUProgram *scale, const uint8_t *image)
+{
+    static uint8_t output[TEST_SIZE * TEST_SIZE * 4];
+    GPUProgram *programs[] = { add, scale };
+    testCheck(gpuRenderImageTiledWithFormat(TEST_SIZE, TEST_SIZE, GPUColorFormatRGBA, image, TEST_SIZE * 4,
+                                            programs, 2, TEST_SIZE / 2, GPUPixelFormatRGBA16F,
+                                            output, TEST_SIZE * 4) == GPUStatusOK,
+              "float tiled render");
+    int holds = 1;
+    for (uint32_t i = 0; i < TEST_SIZE * TEST_SIZE * 4; i++) {
+        holds &= abs((int)output[i] - (int)(TEST_EXPECTED * 255.0f + 0.5f)) <= 1;
+    }
+    testCheck(holds, "float tiled intermediate");
+}
+
+int main(void)
+{
+    GPUHeadlessContext context;
+    if (gpuCreateHeadlessContext(&context) != GPUStatusOK) {
+        return 1;
+    }
+    gpuConfigureRenderingPipeline();
+
+    static uint8_t image[TEST_SIZE * TEST_SIZE * 4];
+    memset(image, 255, sizeof(image));
+    GPUTexture input;
+    testCheck(gpuCreateTextureFromImage(TEST_SIZE, TEST_SIZE, GPUColorFormatRGBA, image, &input) == GPUStatusOK,
+              "input texture");
+
+    GPUFilterStage stages[] = { { kAddShaderCode, 0 }, { kScaleShaderCode, 0 } };
+    GPUFilterChain chain;
+    testCheck(gpuCompileFilterChain(stages, 2, &chain, NULL) == GPUStatusOK && chain.passCount == 2,
+              "two-pass chain");
+    GPUProgram add, scale;
+    testCheck(gpuCompileProgram(kGPUDefaultVertexShaderCode, kAddShaderCode, &add, NULL) == GPUStatusOK &&
+              gpuCompileProgram(kGPUDefaultVertexShaderCode, kScaleShaderCode, &scale, NULL) == GPUStatusOK,
+              "programs");
+
+    testChain(&chain, &input);
+    testCachedChain(&chain, &input);
+    testGraph(&add, &scale, &input);
+    testTiled(&add, &scale, image);
+
+    gpuDestroyProgram(&add);
+    gpuDestroyProgram(&scale);
+    gpuDestroyFilterChain(&chain);
+    gpuDestroyTexture(&input);
+    gpuDestroyHeadlessContext(&context);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d checks failed.\n", failures);
+        return 1;
+    }
+    printf("All checks passed.\n");
+    return 0;
+}